@@ -1,2 +1,4 @@
-rm ldb
-gcc ldb.c -o ldb -lsqlite3
+rm -f ldb ldb_bench ldb_load
+gcc ldb.c main.c -o ldb -lsqlite3 -lpthread
+gcc ldb.c ldb_bench.c -o ldb_bench -lsqlite3 -lpthread
+gcc ldb.c ldb_load.c -o ldb_load -lsqlite3 -lpthread
@@ -1,1216 +1,6374 @@
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <pthread.h>
+#include <stdarg.h>
 #include <sqlite3.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-static sqlite3	*ldb;
+#include "ldb.h"
 
-static sqlite3_stmt *client_create_stmt;
 static char *client_create_sql = "INSERT INTO client (email, password, apikey) "
 					"VALUES (LOWER(?), ?, ?);";
 
-static sqlite3_stmt *client_activate_stmt;
+static char *client_auth_sql = "SELECT 1 FROM client "
+					"WHERE email = LOWER(?) "
+					"AND apikey = ? "
+					"AND status = 1;";
+
 static char *client_activate_sql = "UPDATE client SET status = 1 "
 					"WHERE email = LOWER(?) AND apikey = ?;";
 
-static sqlite3_stmt *client_apikey_set_stmt;
 static char *client_apikey_set_sql = "UPDATE client SET apikey = ? "
 					"WHERE email = LOWER(?) "
 					"AND password = ? "
 					"AND status = 1;";
 
-static sqlite3_stmt *client_apikey_reset_stmt;
 static char *client_apikey_reset_sql = "UPDATE client SET apikey = ? "
 					"WHERE email = LOWER(?) "
 					"AND apikey = ? "
 					"AND status = 1;";
 
-static sqlite3_stmt *client_recover_stmt;
 static char *client_recover_sql = "UPDATE client SET recover_key = ?, recover_date = CURRENT_TIMESTAMP "
 					"WHERE email = LOWER(?) "
 					"AND (recover_date is NULL OR recover_date <= datetime('now', '-1 hours')) "
 					"AND status = 1;";
 
-static sqlite3_stmt *client_password_reset_stmt;
 static char *client_password_reset_sql = "UPDATE client SET password = ?, recover_date = NULL, recover_key = NULL "
 					"WHERE email = LOWER(?) "
 					"AND recover_key = ? "
 					"AND recover_date >= datetime('now', '-24 hours') "
 					"AND status = 1;";
 
-static sqlite3_stmt *network_create_stmt;
-static char *network_create_sql = "INSERT INTO network (email, uid, description, subnet, netmask, "
+static char *network_create_sql = "INSERT INTO network (client_id, uid, description, subnet, netmask) "
+					"SELECT id, ?2, ?3, ?4, ?5 FROM client "
+					"WHERE email = LOWER(?1);";
+
+/* PEM is kept as DER, ldb_pem() gives it back byte for byte. */
+static char *network_secret_create_sql = "INSERT INTO network_secret (network_id, "
 					"embassy_certificate, embassy_privatekey, "
 					"passport_certificate, passport_privatekey) "
-					"VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);";
+					"VALUES (?, ldb_der(?), ldb_der(?), ldb_der(?), ldb_der(?));";
 
-// FIXME we need uid for this query
-static sqlite3_stmt *network_get_stmt;
-static char *network_get_sql = "SELECT uid, subnet, netmask, ipv4_last FROM network "
-				"WHERE email = ? "
+static char *network_get_sql = "SELECT uid, subnet, netmask FROM network "
+				"WHERE client_id = (SELECT id FROM client WHERE email = LOWER(?)) "
 				"AND description = ?;";
 
-static sqlite3_stmt *network_list_stmt;
-static char *network_list_sql = "SELECT uid, description FROM network,client "
-				"WHERE network.email = client.email "
-				"AND client.email = LOWER(?) "
-				"AND client.apikey = ?;";
+/* Credentials are checked beforehand by ldb_auth(). */
+static char *network_list_sql = "SELECT uid, description FROM network "
+				"WHERE client_id = (SELECT id FROM client WHERE email = LOWER(?));";
+
+/* Uids are resolved to ids once per call, the other statements of the call
+ * take the ids. */
+static char *network_id_sql = "SELECT id FROM network WHERE uid = ?;";
 
-static sqlite3_stmt *network_embassy_get_stmt;
-static char *network_embassy_get_sql = "SELECT embassy_certificate, embassy_privatekey, embassy_serial "
+static char *network_delete_sql = "DELETE FROM network WHERE id = ?;";
+
+static char *network_secret_delete_sql = "DELETE FROM network_secret WHERE network_id = ?;";
+
+static char *node_id_sql = "SELECT id FROM node WHERE uid = ? AND network_id = ?;";
+
+static char *network_embassy_get_sql = "SELECT ldb_pem(network_secret.embassy_certificate), "
+					"ldb_pem(network_secret.embassy_privatekey), network.embassy_serial "
 					"FROM network "
-					"WHERE uid = ?;";
+					"JOIN network_secret ON network_secret.network_id = network.id "
+					"WHERE network.uid = ?;";
 
-static sqlite3_stmt *network_serial_inc_stmt;
 static char *network_serial_inc_sql = "UPDATE network "
 					"SET embassy_serial = embassy_serial + 1 "
 					"WHERE uid = ?;";
 
-static sqlite3_stmt *network_ipv4_last_set_stmt;
-static char *network_ipv4_last_set_sql = "UPDATE network SET ipv4_last = ? "
-					"WHERE uid = ?;";
+/* embassy_serial is the last serial issued, reserve the next ?1 for
+ * ldb_network_serial_next(): [embassy_serial + 1, embassy_serial + ?1].
+ */
+static char *network_serial_reserve_sql = "UPDATE network "
+					"SET embassy_serial = embassy_serial + ?1 "
+					"WHERE uid = ?2 "
+					"RETURNING embassy_serial - ?1 + 1;";
 
-static sqlite3_stmt *node_create_stmt;
-static char *node_create_sql = "INSERT INTO node (network_uid, uid, provkey, description) "
+static char *node_create_sql = "INSERT INTO node (network_id, uid, provkey, description) "
 				"VALUES (?, ?, ?, ?);";
 
-static sqlite3_stmt *node_delete_stmt;
+/* Credentials are checked beforehand by ldb_auth(). */
 static char *node_delete_sql = "DELETE FROM node "
 				"WHERE description = ? "
-				"AND node.network_uid IN (SELECT uid FROM network WHERE description = $1 "
-							 "AND email = (SELECT email FROM client WHERE email = ? AND apikey = ? AND status = 1)) "
-				"RETURNING node.uid, node.network_uid;";
+				"AND node.network_id IN (SELECT id FROM network WHERE description = $1 "
+					"AND client_id = (SELECT id FROM client WHERE email = LOWER(?))) "
+				"RETURNING node.uid, (SELECT uid FROM network WHERE id = node.network_id);";
+
+/* One page of a network's nodes, those with a uid greater than ?3 in uid
+ * order. Credentials are checked beforehand by ldb_auth().
+ */
+static char *node_list_sql = "SELECT node.uid, node.description, node.provkey, "
+				"(ipv4.address >> 24) || '.' || ((ipv4.address >> 16) & 255) || '.' || "
+				"((ipv4.address >> 8) & 255) || '.' || (ipv4.address & 255), "
+				"node.status, node.date "
+				"FROM node "
+				"JOIN network ON network.id = node.network_id "
+				"LEFT JOIN ipv4 ON ipv4.node_id = node.id "
+				"WHERE network.uid = ?1 "
+				"AND network.client_id = (SELECT id FROM client WHERE email = LOWER(?2)) "
+				"AND node.uid > ?3 "
+				"ORDER BY node.uid "
+				"LIMIT ?4;";
 
-static sqlite3_stmt *node_status_set_stmt;
 static char *node_status_set_sql = "UPDATE node "
 					"SET status = ?, ipsrc = ? "
-					"WHERE uid = ? AND network_uid = ?;";
+					"WHERE uid = ? "
+					"AND network_id = (SELECT id FROM network WHERE uid = ?);";
 
 
-static sqlite3_stmt *ipv4_allocate_stmt;
-static char *ipv4_allocate_sql = "INSERT INTO ipv4 (network_uid, node_uid, address, date) "
-					"VALUES (?, ?, ?, CURRENT_TIMESTAMP) "
-					"ON CONFLICT (network_uid, address) DO UPDATE "
-					"SET node_uid = ?, date = CURRENT_TIMESTAMP "
-					"WHERE network_uid = ? AND address = ?;";
+static char *ipv4_allocate_sql = "INSERT INTO ipv4 (network_id, node_id, address, date) "
+					"VALUES (?, ?, ?, CURRENT_TIMESTAMP);";
 
-static sqlite3_stmt *ipv4_release_stmt;
-static char *ipv4_release_sql = "UPDATE ipv4 "
-				"SET node_uid = NULL, date = CURRENT_TIMESTAMP "
-				"WHERE network_uid = ? AND node_uid = ?;";
+static char *ipv4_release_sql = "DELETE FROM ipv4 "
+				"WHERE network_id = ? AND node_id = ? "
+				"RETURNING address;";
 
-static sqlite3_stmt *ipv4_delete_stmt;
 static char *ipv4_delete_sql = "DELETE FROM ipv4 "
-				"WHERE network_uid = ?;";
+				"WHERE network_id = ?;";
 
-static sqlite3_stmt *ipv4_available_stmt;
-static char *ipv4_available_sql = "SELECT address FROM ipv4 "
-					"WHERE network_uid = ? AND node_uid IS NULL "
-					"ORDER BY address ASC "
+static char *ipv4_available_sql = "SELECT (first >> 24) || '.' || ((first >> 16) & 255) || '.' || "
+					"((first >> 8) & 255) || '.' || (first & 255) "
+					"FROM ipv4_free "
+					"WHERE network_id = (SELECT id FROM network WHERE uid = ?) "
+					"ORDER BY first ASC "
 					"LIMIT 1;";
-/* FIXME need ipv4 table first
-static sqlite3_stmt *node_list_stmt;
-static char *node_list_sql = "SELECT node.uid, node.description, node.provekey, ipv4.address, node.status, node.date "
-				"FROM node, network, ipv4 "
-				"WHERE node.network_uid = ? "
-				"AND network.uid = node.network_uid "
-				"AND node.uid = ipv4.node_uid "
-				"AND network.email = (SELECT email from client WHERE email = ? AND apikey = ? AND status = 1);",
-*/
 
+/* Free addresses of a network, as ranges of host order integers. The range
+ * holding an address is the one with the greatest first <= address.
+ */
+static char *ipv4_range_find_sql = "SELECT first, last FROM ipv4_free "
+					"WHERE network_id = ? AND first <= ? "
+					"ORDER BY first DESC "
+					"LIMIT 1;";
 
+static char *ipv4_range_lowest_sql = "SELECT first, last FROM ipv4_free "
+					"WHERE network_id = ? "
+					"ORDER BY first ASC "
+					"LIMIT 1;";
 
-// FIXME create foreign key from network + ON DELETE CASCADE and ON UPDATE CASCADE
+static char *ipv4_range_get_sql = "SELECT first, last FROM ipv4_free "
+					"WHERE network_id = ? AND first = ?;";
+
+static char *ipv4_range_add_sql = "INSERT INTO ipv4_free (network_id, first, last) "
+					"VALUES (?, ?, ?);";
+
+static char *ipv4_range_del_sql = "DELETE FROM ipv4_free "
+					"WHERE network_id = ? AND first = ?;";
+
+static char *ipv4_pool_delete_sql = "DELETE FROM ipv4_free "
+					"WHERE network_id = ?;";
+
+/* Up to ?4 leases after rowid ?1, for ldb_ipv4_sweep(). status is NULL when
+ * the node is gone, then whether the lease is older than ?2 seconds, and
+ * older than ?3.
+ */
+static char *ipv4_lease_scan_sql = "SELECT ipv4.rowid, ipv4.network_id, ipv4.address, node.status, "
+					"ifnull(ipv4.date < datetime('now', -?2 || ' seconds'), 1), "
+					"ifnull(ipv4.date < datetime('now', -?3 || ' seconds'), 1) "
+					"FROM ipv4 "
+					"LEFT JOIN node ON node.id = ipv4.node_id "
+					"WHERE ipv4.rowid > ?1 "
+					"ORDER BY ipv4.rowid "
+					"LIMIT ?4;";
+
+static char *ipv4_lease_renew_sql = "UPDATE ipv4 SET date = CURRENT_TIMESTAMP "
+					"WHERE rowid = ?;";
+
+static char *ipv4_lease_del_sql = "DELETE FROM ipv4 "
+					"WHERE rowid = ?;";
+
+static char *begin_deferred_sql = "BEGIN DEFERRED;";
+static char *begin_immediate_sql = "BEGIN IMMEDIATE;";
+static char *commit_sql = "COMMIT;";
+static char *rollback_sql = "ROLLBACK;";
+static char *savepoint_sql = "SAVEPOINT ldb;";
+static char *release_sql = "RELEASE ldb;";
+static char *rollback_to_sql = "ROLLBACK TO ldb;";
+
+/* Directory of a sharded database: the shard holding each network. */
+static char *shard_get_sql = "SELECT shard FROM network_shard WHERE uid = ?;";
+static char *shard_add_sql = "INSERT INTO network_shard (uid, shard) VALUES (?, ?);";
+
+/* Any read starts the read transaction that BEGIN defers. */
+static char *read_pin_sql = "PRAGMA schema_version;";
+
+
+
+
+enum {
+	STMT_CLIENT_CREATE,
+	STMT_CLIENT_AUTH,
+	STMT_CLIENT_ACTIVATE,
+	STMT_CLIENT_APIKEY_SET,
+	STMT_CLIENT_APIKEY_RESET,
+	STMT_CLIENT_RECOVER,
+	STMT_CLIENT_PASSWORD_RESET,
+	STMT_NETWORK_CREATE,
+	STMT_NETWORK_SECRET_CREATE,
+	STMT_NETWORK_GET,
+	STMT_NETWORK_ID,
+	STMT_NETWORK_DELETE,
+	STMT_NETWORK_SECRET_DELETE,
+	STMT_NETWORK_LIST,
+	STMT_NETWORK_EMBASSY_GET,
+	STMT_NETWORK_SERIAL_INC,
+	STMT_NETWORK_SERIAL_RESERVE,
+	STMT_NODE_ID,
+	STMT_NODE_CREATE,
+	STMT_NODE_DELETE,
+	STMT_NODE_LIST,
+	STMT_NODE_STATUS_SET,
+	STMT_IPV4_ALLOCATE,
+	STMT_IPV4_RELEASE,
+	STMT_IPV4_DELETE,
+	STMT_IPV4_AVAILABLE,
+	STMT_IPV4_RANGE_FIND,
+	STMT_IPV4_RANGE_LOWEST,
+	STMT_IPV4_RANGE_GET,
+	STMT_IPV4_RANGE_ADD,
+	STMT_IPV4_RANGE_DEL,
+	STMT_IPV4_POOL_DELETE,
+	STMT_IPV4_LEASE_SCAN,
+	STMT_IPV4_LEASE_RENEW,
+	STMT_IPV4_LEASE_DEL,
+	STMT_BEGIN_DEFERRED,
+	STMT_BEGIN_IMMEDIATE,
+	STMT_COMMIT,
+	STMT_ROLLBACK,
+	STMT_SAVEPOINT,
+	STMT_RELEASE,
+	STMT_ROLLBACK_TO,
+	STMT_READ_BEGIN,
+	STMT_READ_PIN,
+	STMT_READ_END,
+	STMT_SHARD_GET,
+	STMT_SHARD_ADD,
+	STMT_MAX
+};
+
+/* Statement registry. Statements are prepared on a connection the first
+ * time they're used, read-only ones on readers too. `params' gives the
+ * type of each parameter, in order, for ldb_bind(): t text, i int,
+ * I int64. `ncol' is how many columns a row has, both are checked when the
+ * statement is prepared.
+ */
+static const struct {
+	const char	 *name;
+	char		**sql;
+	int		  readonly;
+	const char	 *params;
+	int		  ncol;
+} stmt_tbl[STMT_MAX] = {
+	[STMT_CLIENT_CREATE]		= { "client_create", &client_create_sql, 0, "ttt", 0 },
+	[STMT_CLIENT_AUTH]		= { "client_auth", &client_auth_sql, 1, "tt", 1 },
+	[STMT_CLIENT_ACTIVATE]		= { "client_activate", &client_activate_sql, 0, "tt", 0 },
+	[STMT_CLIENT_APIKEY_SET]	= { "client_apikey_set", &client_apikey_set_sql, 0, "ttt", 0 },
+	[STMT_CLIENT_APIKEY_RESET]	= { "client_apikey_reset", &client_apikey_reset_sql, 0, "ttt", 0 },
+	[STMT_CLIENT_RECOVER]		= { "client_recover", &client_recover_sql, 0, "tt", 0 },
+	[STMT_CLIENT_PASSWORD_RESET]	= { "client_password_reset", &client_password_reset_sql, 0, "ttt", 0 },
+	[STMT_NETWORK_CREATE]		= { "network_create", &network_create_sql, 0, "ttttt", 0 },
+	[STMT_NETWORK_SECRET_CREATE]	= { "network_secret_create", &network_secret_create_sql, 0, "Itttt", 0 },
+	[STMT_NETWORK_GET]		= { "network_get", &network_get_sql, 1, "tt", 3 },
+	[STMT_NETWORK_ID]		= { "network_id", &network_id_sql, 1, "t", 1 },
+	[STMT_NETWORK_DELETE]		= { "network_delete", &network_delete_sql, 0, "I", 0 },
+	[STMT_NETWORK_SECRET_DELETE]	= { "network_secret_delete", &network_secret_delete_sql, 0, "I", 0 },
+	[STMT_NETWORK_LIST]		= { "network_list", &network_list_sql, 1, "t", 2 },
+	[STMT_NETWORK_EMBASSY_GET]	= { "network_embassy_get", &network_embassy_get_sql, 1, "t", 3 },
+	[STMT_NETWORK_SERIAL_INC]	= { "network_serial_inc", &network_serial_inc_sql, 0, "t", 0 },
+	[STMT_NETWORK_SERIAL_RESERVE]	= { "network_serial_reserve", &network_serial_reserve_sql, 0, "it", 1 },
+	[STMT_NODE_ID]			= { "node_id", &node_id_sql, 1, "tI", 1 },
+	[STMT_NODE_CREATE]		= { "node_create", &node_create_sql, 0, "Ittt", 0 },
+	[STMT_NODE_DELETE]		= { "node_delete", &node_delete_sql, 0, "ttt", 2 },
+	[STMT_NODE_LIST]		= { "node_list", &node_list_sql, 1, "ttti", 6 },
+	[STMT_NODE_STATUS_SET]		= { "node_status_set", &node_status_set_sql, 0, "ittt", 0 },
+	[STMT_IPV4_ALLOCATE]		= { "ipv4_allocate", &ipv4_allocate_sql, 0, "III", 0 },
+	[STMT_IPV4_RELEASE]		= { "ipv4_release", &ipv4_release_sql, 0, "II", 1 },
+	[STMT_IPV4_DELETE]		= { "ipv4_delete", &ipv4_delete_sql, 0, "I", 0 },
+	[STMT_IPV4_AVAILABLE]		= { "ipv4_available", &ipv4_available_sql, 1, "t", 1 },
+	[STMT_IPV4_RANGE_FIND]		= { "ipv4_range_find", &ipv4_range_find_sql, 0, "II", 2 },
+	[STMT_IPV4_RANGE_LOWEST]	= { "ipv4_range_lowest", &ipv4_range_lowest_sql, 0, "I", 2 },
+	[STMT_IPV4_RANGE_GET]		= { "ipv4_range_get", &ipv4_range_get_sql, 0, "II", 2 },
+	[STMT_IPV4_RANGE_ADD]		= { "ipv4_range_add", &ipv4_range_add_sql, 0, "III", 0 },
+	[STMT_IPV4_RANGE_DEL]		= { "ipv4_range_del", &ipv4_range_del_sql, 0, "II", 0 },
+	[STMT_IPV4_POOL_DELETE]		= { "ipv4_pool_delete", &ipv4_pool_delete_sql, 0, "I", 0 },
+	[STMT_IPV4_LEASE_SCAN]		= { "ipv4_lease_scan", &ipv4_lease_scan_sql, 0, "Iiii", 6 },
+	[STMT_IPV4_LEASE_RENEW]		= { "ipv4_lease_renew", &ipv4_lease_renew_sql, 0, "I", 0 },
+	[STMT_IPV4_LEASE_DEL]		= { "ipv4_lease_del", &ipv4_lease_del_sql, 0, "I", 0 },
+	[STMT_BEGIN_DEFERRED]		= { "begin_deferred", &begin_deferred_sql, 0, "", 0 },
+	[STMT_BEGIN_IMMEDIATE]		= { "begin_immediate", &begin_immediate_sql, 0, "", 0 },
+	[STMT_COMMIT]			= { "commit", &commit_sql, 0, "", 0 },
+	[STMT_ROLLBACK]			= { "rollback", &rollback_sql, 0, "", 0 },
+	[STMT_SAVEPOINT]		= { "savepoint", &savepoint_sql, 0, "", 0 },
+	[STMT_RELEASE]			= { "release", &release_sql, 0, "", 0 },
+	[STMT_ROLLBACK_TO]		= { "rollback_to", &rollback_to_sql, 0, "", 0 },
+	[STMT_READ_BEGIN]		= { "read_begin", &begin_deferred_sql, 1, "", 0 },
+	[STMT_READ_PIN]			= { "read_pin", &read_pin_sql, 1, "", 1 },
+	[STMT_READ_END]			= { "read_end", &commit_sql, 1, "", 0 },
+	[STMT_SHARD_GET]		= { "shard_get", &shard_get_sql, 1, "t", 1 },
+	[STMT_SHARD_ADD]		= { "shard_add", &shard_add_sql, 0, "ti", 0 },
+};
+
+/* Public calls, for the statistics. */
+enum {
+	CALL_CLIENT_CREATE,
+	CALL_CLIENT_AUTH,
+	CALL_CLIENT_ACTIVATE,
+	CALL_CLIENT_APIKEY_SET,
+	CALL_CLIENT_APIKEY_RESET,
+	CALL_CLIENT_RECOVER,
+	CALL_CLIENT_PASSWORD_RESET,
+	CALL_NETWORK_CREATE,
+	CALL_NETWORK_GET,
+	CALL_NETWORK_LIST,
+	CALL_NETWORK_EMBASSY_GET,
+	CALL_NETWORK_SERIAL_INC,
+	CALL_NETWORK_SERIAL_NEXT,
+	CALL_SHARD_NETWORK_CREATE,
+	CALL_NODE_CREATE,
+	CALL_NODE_CREATE_BATCH,
+	CALL_NODE_DELETE,
+	CALL_NODE_LIST,
+	CALL_NODE_STATUS_SET,
+	CALL_IPV4_ALLOCATE,
+	CALL_IPV4_RELEASE,
+	CALL_IPV4_DELETE,
+	CALL_IPV4_AVAILABLE,
+	CALL_IPV4_SWEEP,
+	CALL_BEGIN,
+	CALL_COMMIT,
+	CALL_ROLLBACK,
+	CALL_READ_BEGIN,
+	CALL_READ_END,
+	CALL_MAX
+};
+
+static const char *call_names[CALL_MAX] = {
+	[CALL_CLIENT_CREATE]		= "ldb_client_create",
+	[CALL_CLIENT_AUTH]		= "ldb_client_auth",
+	[CALL_CLIENT_ACTIVATE]		= "ldb_client_activate",
+	[CALL_CLIENT_APIKEY_SET]	= "ldb_client_apikey_set",
+	[CALL_CLIENT_APIKEY_RESET]	= "ldb_client_apikey_reset",
+	[CALL_CLIENT_RECOVER]		= "ldb_client_recover",
+	[CALL_CLIENT_PASSWORD_RESET]	= "ldb_client_password_reset",
+	[CALL_NETWORK_CREATE]		= "ldb_network_create",
+	[CALL_NETWORK_GET]		= "ldb_network_get",
+	[CALL_NETWORK_LIST]		= "ldb_network_list",
+	[CALL_NETWORK_EMBASSY_GET]	= "ldb_network_embassy_get",
+	[CALL_NETWORK_SERIAL_INC]	= "ldb_network_serial_inc",
+	[CALL_NETWORK_SERIAL_NEXT]	= "ldb_network_serial_next",
+	[CALL_SHARD_NETWORK_CREATE]	= "ldb_shard_network_create",
+	[CALL_NODE_CREATE]		= "ldb_node_create",
+	[CALL_NODE_CREATE_BATCH]	= "ldb_node_create_batch",
+	[CALL_NODE_DELETE]		= "ldb_node_delete",
+	[CALL_NODE_LIST]		= "ldb_node_list",
+	[CALL_NODE_STATUS_SET]		= "ldb_node_status_set",
+	[CALL_IPV4_ALLOCATE]		= "ldb_ipv4_allocate",
+	[CALL_IPV4_RELEASE]		= "ldb_ipv4_release",
+	[CALL_IPV4_DELETE]		= "ldb_ipv4_delete",
+	[CALL_IPV4_AVAILABLE]		= "ldb_ipv4_available",
+	[CALL_IPV4_SWEEP]		= "ldb_ipv4_sweep",
+	[CALL_BEGIN]			= "ldb_begin",
+	[CALL_COMMIT]			= "ldb_commit",
+	[CALL_ROLLBACK]			= "ldb_rollback",
+	[CALL_READ_BEGIN]		= "ldb_read_begin",
+	[CALL_READ_END]			= "ldb_read_end",
+};
+
+/* Statistics, only collected while ctx->stats_enabled. Calls record their
+ * latency in log2 buckets of nanoseconds, statements accumulate their
+ * sqlite3_stmt_status() counters. Updated with relaxed atomics.
+ */
+struct ldb_stats_call_ctr {
+	uint64_t	calls;
+	uint64_t	errors;
+	uint64_t	time_ns;
+	uint64_t	hist[LDB_STATS_BUCKETS];
+};
+
+struct ldb_stats_stmt_ctr {
+	uint64_t	fullscan_step;
+	uint64_t	sort;
+	uint64_t	autoindex;
+	uint64_t	vm_step;
+};
+
+/* A connection and its own set of prepared statements. The writer is shared
+ * behind ctx->writer_mtx, a reader is bound to a single thread at a time.
+ */
+struct ldb_conn {
+	struct ldb_ctx	*ctx;
+	sqlite3		*db;
+	sqlite3_stmt	*stmt[STMT_MAX];
+	int		 readonly;
+	int		 bound;
+	/* Lock contention: when the current call first waited, 0 until it
+	 * does, how many times it slept, and the state of the jitter
+	 * generator. */
+	uint64_t	 busy_start;
+	int		 busy_attempt;
+	unsigned int	 busy_seed;
+	/* Give up on locks at once, for maintenance that can wait. */
+	int		 busy_nowait;
+};
+
+#define LDB_ROW_MAXCOL	8
+
+/* A private copy of the last row a statement returned to a thread. */
+struct ldb_row {
+	char	*buf;
+	size_t	 size;
+	int	 off[LDB_ROW_MAXCOL];
+};
+
+/* Per-thread state: the reader connection bound to the thread, and the rows
+ * handed out by the single-row functions. Statements are reset as soon as
+ * the row is copied, an active statement would pin its read snapshot or, on
+ * the writer, keep the write transaction open.
+ */
+struct ldb_thread {
+	LIST_ENTRY(ldb_thread)	 entry;
+	struct ldb_ctx		*ctx;
+	struct ldb_conn		*reader;
+	int			 depth;		/* calls using the reader */
+	int			 txn;
+	int			 snapshot;	/* reader pinned by ldb_read_begin() */
+	struct ldb_row		 row[STMT_MAX];
+};
+
+/* Cache of validated email/apikey pairs, so that authenticated calls skip
+ * the client lookup. Shards are set associative, LDB_AUTH_WAYS entries per
+ * set, and evict round robin within a set.
+ */
+#define LDB_AUTH_SHARDS		16
+#define LDB_AUTH_SLOTS		1024
+#define LDB_AUTH_WAYS		4
+#define LDB_AUTH_EMAIL_MAX	256
+
+struct ldb_auth_entry {
+	uint64_t	 hash;
+	char		*email;
+	char		*apikey;
+};
+
+struct ldb_auth_shard {
+	pthread_rwlock_t	 lock;
+	/* Bumped by every invalidation, a lookup that missed only fills
+	 * the cache if no invalidation ran while it read the database. */
+	unsigned long		 gen;
+	unsigned int		 victim;
+	struct ldb_auth_entry	 entry[LDB_AUTH_SLOTS];
+};
+
+/* Embassy serials reserved in the database and not handed out yet, per
+ * network. What's left of a block is lost on exit, never reused.
+ */
+#define LDB_SERIAL_BLOCK	1000
+#define LDB_SERIAL_BUCKETS	256
+
+struct ldb_serial {
+	LIST_ENTRY(ldb_serial)	 entry;
+	sqlite3_int64		 next;
+	sqlite3_int64		 end;
+	char			 uid[];
+};
+
+/* Shard of each network uid looked up in the directory. Networks never
+ * move, entries stay valid until ldb_fini().
+ */
+#define LDB_DIR_BUCKETS		4096
+
+struct ldb_dir {
+	LIST_ENTRY(ldb_dir)	 entry;
+	uint64_t		 hash;
+	int			 shard;
+	char			 uid[];
+};
+
+/* Presence buffer: last status/ipsrc reported by each node, flushed to the
+ * database every tick when it changed. Keyed on node and network uid, a
+ * node stays in it until its last change is written.
+ */
+#define LDB_PRESENCE_SHARDS	16
+#define LDB_PRESENCE_BUCKETS	4096
+#define LDB_PRESENCE_IPSRC	64
+
+struct ldb_presence {
+	LIST_ENTRY(ldb_presence) entry;
+	LIST_ENTRY(ldb_presence) dirty_entry;
+	uint64_t		 hash;
+	uint64_t		 seq;		/* of the last change */
+	int			 dirty;
+	int			 status;
+	char			 ipsrc[LDB_PRESENCE_IPSRC];
+	char			*network_uid;
+	char			 uid[];
+};
+
+LIST_HEAD(ldb_presence_list, ldb_presence);
+
+struct ldb_presence_shard {
+	pthread_mutex_t			 mtx;
+	struct ldb_presence_list	 dirty;
+	struct ldb_presence_list	 bucket[LDB_PRESENCE_BUCKETS];
+};
+
+struct ldb_pr {
+	struct ldb_ctx			*ctx;
+	pthread_t			 thread;
+	pthread_mutex_t			 mtx;
+	pthread_cond_t			 cond;
+	int				 tick_ms;
+	int				 stop;
+	uint64_t			 seq;
+	struct ldb_presence_shard	 shard[LDB_PRESENCE_SHARDS];
+};
+
+/* Lease sweeper, ldb_ipv4_sweep() every `interval_ms'. */
+struct ldb_sw {
+	struct ldb_ctx		*ctx;
+	pthread_t		 thread;
+	pthread_mutex_t		 mtx;
+	pthread_cond_t		 cond;
+	int			 ttl;
+	int			 budget_ms;
+	int			 interval_ms;
+	int			 stop;
+};
+
+/* Maintenance thread: every `idle_ms' that went by without a write, one
+ * slice of the next task.
+ */
+struct ldb_mt {
+	struct ldb_ctx		*ctx;
+	pthread_t		 thread;
+	pthread_mutex_t		 mtx;
+	pthread_cond_t		 cond;
+	int			 idle_ms;
+	int			 vacuum_pages;
+	int			 next;
+	int			 stop;
+};
+
+/* Online backup: the writer is the source, so pages it changes while the
+ * copy runs are forwarded to the destination instead of restarting it.
+ */
+struct ldb_bk {
+	struct ldb_ctx			*ctx;
+	pthread_t			 thread;
+	pthread_mutex_t			 mtx;
+	pthread_cond_t			 cond;
+	sqlite3				*db;
+	sqlite3_backup			*backup;
+	int				 pages;
+	int				 sleep_ms;
+	int				 page_size;
+	int				 stop;
+	/* Under mtx. */
+	struct ldb_backup_progress	 progress;
+	uint64_t			 start;
+};
+
+/* Change feed. Temporary triggers on the writer hand every changed row to
+ * ldb_cdc_func(), which stages it until the transaction ends: dropped when
+ * it rolls back, copied to the ring of each feed by ldb_release() once it
+ * committed. A ring has a single producer, whoever holds the writer, and a
+ * single consumer, the thread reading the feed.
+ */
+#define LDB_CDC_DEPTH	16
+
+struct ldb_feed;
+
+struct ldb_ring {
+	LIST_ENTRY(ldb_ring)	 entry;
+	struct ldb_ctx		*ctx;		/* the writer publishing */
+	struct ldb_feed		*feed;
+	struct ldb_change	*slot;
+	uint64_t		 mask;
+	uint64_t		 head;		/* next slot written */
+	uint64_t		 tail;		/* next slot read */
+	uint64_t		 lost;
+};
+
+struct ldb_feed {
+	int			 fd;
+	int			 next;
+	int			 nring;
+	struct ldb_ring		 ring[];
+};
+
+struct ldb_ctx {
+	struct ldb_conn			 writer;
+	pthread_mutex_t			 writer_mtx;
+
+	struct ldb_conn			*readers;
+	int				 nreaders;
+	pthread_mutex_t			 readers_mtx;
+	pthread_cond_t			 readers_cond;
+
+	pthread_key_t			 thread_key;
+	LIST_HEAD(, ldb_thread)		 threads;
+
+	struct ldb_wq			*wq;
+	struct ldb_as			*as;
+	struct ldb_pr			*pr;
+	struct ldb_sw			*sw;
+	struct ldb_mt			*mt;
+	struct ldb_bk			*bk;
+
+	struct ldb_auth_shard		 auth[LDB_AUTH_SHARDS];
+	/* Emails whose credentials changed in the writer's current
+	 * transaction, invalidated once it ends. Under writer_mtx. */
+	char				**auth_pending;
+	int				 auth_npending;
+
+	/* How long a call may wait on locks, in ns, and what it cost. */
+	uint64_t			 busy_deadline;
+	uint64_t			 busy;
+	uint64_t			 busy_wait_ns;
+	uint64_t			 busy_timeouts;
+
+	int				 stats_enabled;
+	struct ldb_stats_call_ctr	 stats_call[CALL_MAX];
+	struct ldb_stats_stmt_ctr	 stats_stmt[STMT_MAX];
+
+	pthread_mutex_t			 serial_mtx;
+	int				 serial_block;
+	LIST_HEAD(, ldb_serial)		 serial[LDB_SERIAL_BUCKETS];
+
+	/* Change feed, under writer_mtx: the rings to publish to, the rows
+	 * the writer's transaction changed so far, whether it committed,
+	 * and how many rows were staged when each open savepoint began. */
+	LIST_HEAD(, ldb_ring)		 feeds;
+	struct ldb_change		*cdc;
+	int				 cdc_n;
+	int				 cdc_size;
+	int				 cdc_commit;
+	int				 cdc_mark[LDB_CDC_DEPTH];
+	int				 cdc_depth;
+
+	/* Last lease ldb_ipv4_sweep() went through. Under writer_mtx. */
+	sqlite3_int64			 sweep_cursor;
+
+	/* When the writer last changed rows, and what maintenance did. The
+	 * report is under writer_mtx. */
+	sqlite3_int64			 changes;
+	uint64_t			 last_write;
+	struct ldb_maint_report		 maint;
+
+	/* With shards, this context is the directory and routes the calls. */
+	struct ldb_ctx			**shard;
+	int				 nshard;
+	pthread_rwlock_t		 dir_lock;
+	LIST_HEAD(, ldb_dir)		 dir[LDB_DIR_BUCKETS];
+};
+
+static void
+ldb_thread_free(struct ldb_thread *t)
+{
+	int	i;
 
-int
-ldb_client_create(const char *email, const char *password, const char *apikey)
+	if (t->reader != NULL) {
+		if (t->snapshot)
+			sqlite3_exec(t->reader->db, "ROLLBACK;", NULL, NULL, NULL);
+		t->reader->bound = 0;
+	}
+	for (i = 0; i < STMT_MAX; i++)
+		free(t->row[i].buf);
+	free(t);
+}
+
+/* pthread_key destructor, give the reader back to the pool when a thread
+ * exits.
+ */
+static void
+ldb_thread_exit(void *arg)
 {
-	int	ret;
-	int	line;
+	struct ldb_thread	*t = arg;
+	struct ldb_ctx		*ctx = t->ctx;
+
+	pthread_mutex_lock(&ctx->readers_mtx);
+	LIST_REMOVE(t, entry);
+	ldb_thread_free(t);
+	pthread_cond_signal(&ctx->readers_cond);
+	pthread_mutex_unlock(&ctx->readers_mtx);
+}
 
-	ret = sqlite3_reset(client_create_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+static struct ldb_thread *
+ldb_thread(struct ldb_ctx *ctx)
+{
+	struct ldb_thread	*t;
+
+	if ((t = pthread_getspecific(ctx->thread_key)) != NULL)
+		return (t);
+
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		return (NULL);
 	}
+	t->ctx = ctx;
 
-	ret = sqlite3_bind_text(client_create_stmt, 1, email, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	if (pthread_setspecific(ctx->thread_key, t) != 0) {
+		fprintf(stderr, "%s: pthread_setspecific\n", __func__);
+		free(t);
+		return (NULL);
 	}
 
-	ret = sqlite3_bind_text(client_create_stmt, 2, password, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	pthread_mutex_lock(&ctx->readers_mtx);
+	LIST_INSERT_HEAD(&ctx->threads, t, entry);
+	pthread_mutex_unlock(&ctx->readers_mtx);
+
+	return (t);
+}
+
+/* Copy the current row of statement `id' into the thread, the columns stay
+ * valid until the thread runs the same statement again.
+ */
+static int
+ldb_row_save(struct ldb_thread *t, int id, sqlite3_stmt *stmt)
+{
+	struct ldb_row	*row = &t->row[id];
+	size_t		 size;
+	char		*buf;
+	int		 ncol;
+	int		 i;
+
+	ncol = sqlite3_column_count(stmt);
+	if (ncol > LDB_ROW_MAXCOL)
+		return (-1);
+
+	size = 0;
+	for (i = 0; i < ncol; i++) {
+		/* column_text() first, column_bytes() then gives its length. */
+		if (sqlite3_column_text(stmt, i) != NULL)
+			size += sqlite3_column_bytes(stmt, i) + 1;
 	}
 
-	ret = sqlite3_bind_text(client_create_stmt, 3, apikey, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	if (size > row->size) {
+		if ((buf = realloc(row->buf, size)) == NULL)
+			return (-1);
+		row->buf = buf;
+		row->size = size;
 	}
 
-	ret = sqlite3_step(client_create_stmt);
-	if (ret != SQLITE_DONE) {
-		line = __LINE__;
-		goto error;
+	size = 0;
+	for (i = 0; i < ncol; i++) {
+		if (sqlite3_column_type(stmt, i) == SQLITE_NULL) {
+			row->off[i] = -1;
+			continue;
+		}
+		row->off[i] = size;
+		memcpy(row->buf + size, sqlite3_column_text(stmt, i),
+		    sqlite3_column_bytes(stmt, i) + 1);
+		size += sqlite3_column_bytes(stmt, i) + 1;
 	}
 
 	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
 }
 
-int
-ldb_client_activate(const char *email, const char *apikey)
+static const unsigned char *
+ldb_row_text(struct ldb_thread *t, int id, int col)
 {
-	int	ret;
-	int	line;
-
-	ret = sqlite3_reset(client_activate_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	struct ldb_row	*row = &t->row[id];
 
-	ret = sqlite3_bind_text(client_activate_stmt, 1, email, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	if (row->off[col] == -1)
+		return (NULL);
+	return ((const unsigned char *)row->buf + row->off[col]);
+}
 
-	ret = sqlite3_bind_text(client_activate_stmt, 2, apikey, -2, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+/* Hand the text columns of the current row to the caller: copied into
+ * `arena' when there is one, into the thread's copy of the row otherwise.
+ * Either way `stmt' can be reset afterwards. An arena too small for the
+ * whole row is left untouched.
+ */
+static int
+ldb_row_take(struct ldb_thread *t, int id, sqlite3_stmt *stmt,
+	struct ldb_arena *arena, const unsigned char ***cols, int ncol)
+{
+	const unsigned char	*text;
+	size_t			 size;
+	size_t			 len;
+	int			 i;
+
+	if (arena == NULL) {
+		if (ldb_row_save(t, id, stmt) == -1)
+			return (SQLITE_NOMEM);
+		for (i = 0; i < ncol; i++)
+			*cols[i] = ldb_row_text(t, id, i);
+		return (SQLITE_OK);
 	}
 
-	ret = sqlite3_step(client_activate_stmt);
-	if (ret != SQLITE_DONE) {
-		line = __LINE__;
-		goto error;
+	size = 0;
+	for (i = 0; i < ncol; i++) {
+		if (sqlite3_column_text(stmt, i) != NULL)
+			size += sqlite3_column_bytes(stmt, i) + 1;
 	}
-
-	if (sqlite3_changes(ldb) != 1) {
-		line = __LINE__;
-		goto error;
+	if (size > arena->size - arena->used)
+		return (SQLITE_FULL);
+
+	for (i = 0; i < ncol; i++) {
+		if ((text = sqlite3_column_text(stmt, i)) == NULL) {
+			*cols[i] = NULL;
+			continue;
+		}
+		len = sqlite3_column_bytes(stmt, i) + 1;
+		memcpy(arena->buf + arena->used, text, len);
+		*cols[i] = (const unsigned char *)arena->buf + arena->used;
+		arena->used += len;
 	}
 
-	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
+	return (SQLITE_OK);
 }
 
-int
-ldb_client_apikey_set(const char *email, const char *password, const char *apikey)
+static uint64_t
+ldb_now_ns(void)
 {
-	int	ret;
-	int	line;
+	struct timespec	ts;
 
-	ret = sqlite3_reset(client_apikey_set_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
 
-	ret = sqlite3_bind_text(client_apikey_set_stmt, 1, apikey, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+/* Backoff while a lock is held by another connection or process: sleep
+ * a random time up to a delay that doubles at each attempt, from
+ * LDB_BUSY_MIN_US to LDB_BUSY_MAX_US, until the first wait of the call is
+ * busy_deadline old. The busy handler and the retries of ldb_run() share
+ * that deadline, ldb_busy_reset() starts a new one when the connection is
+ * handed out. Returns -1 once it's time to give up.
+ */
+#define LDB_BUSY_MIN_US		100
+#define LDB_BUSY_MAX_US		50000
+
+static void
+ldb_busy_reset(struct ldb_conn *conn)
+{
+	conn->busy_start = 0;
+	conn->busy_attempt = 0;
+}
 
-	ret = sqlite3_bind_text(client_apikey_set_stmt, 2, email, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+static int
+ldb_busy_wait(struct ldb_conn *conn)
+{
+	struct ldb_ctx	*ctx = conn->ctx;
+	struct timespec	 ts;
+	uint64_t	 now;
+	uint64_t	 left;
+	uint64_t	 us;
+
+	now = ldb_now_ns();
+	if (conn->busy_start == 0) {
+		conn->busy_start = now;
+		__atomic_add_fetch(&ctx->busy, 1, __ATOMIC_RELAXED);
 	}
 
-	ret = sqlite3_bind_text(client_apikey_set_stmt, 3, password, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	if (now - conn->busy_start >= ctx->busy_deadline) {
+		__atomic_add_fetch(&ctx->busy_timeouts, 1, __ATOMIC_RELAXED);
+		return (-1);
 	}
+	left = (ctx->busy_deadline - (now - conn->busy_start)) / 1000 + 1;
 
-	ret = sqlite3_step(client_apikey_set_stmt);
-	if (ret != SQLITE_DONE) {
-		line = __LINE__;
-		goto error;
-	}
+	us = (uint64_t)LDB_BUSY_MIN_US << (conn->busy_attempt < 10 ? conn->busy_attempt : 10);
+	conn->busy_attempt++;
+	if (us > LDB_BUSY_MAX_US)
+		us = LDB_BUSY_MAX_US;
+	us = 1 + rand_r(&conn->busy_seed) % us;
+	if (us > left)
+		us = left;
 
-	if (sqlite3_changes(ldb) != 1) {
-		line = __LINE__;
-		goto error;
-	}
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+	__atomic_add_fetch(&ctx->busy_wait_ns, ldb_now_ns() - now, __ATOMIC_RELAXED);
 
 	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
 }
 
-int
-ldb_client_apikey_reset(const char *email, const char *apikey, const char *new_apikey)
+/* sqlite3_busy_handler() callback, SQLite retries the lock while it
+ * returns non-zero. */
+static int
+ldb_busy_handler(void *arg, int count)
 {
-	int	ret;
-	int	line;
+	struct ldb_conn	*conn = arg;
 
-	ret = sqlite3_reset(client_apikey_reset_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	(void)count;
+	if (conn->busy_nowait)
+		return (0);
+	return (ldb_busy_wait(conn) == 0);
+}
 
-	ret = sqlite3_bind_text(client_apikey_reset_stmt, 1, new_apikey, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+/* Statement `id' of `conn', reset. Prepared on first use. */
+static sqlite3_stmt *
+ldb_stmt(struct ldb_conn *conn, int id)
+{
+	sqlite3_stmt	*stmt;
+	int		 ret;
+
+	if ((stmt = conn->stmt[id]) != NULL) {
+		sqlite3_reset(stmt);
+		return (stmt);
 	}
 
-	ret = sqlite3_bind_text(client_apikey_reset_stmt, 2, email, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	if (conn->readonly && stmt_tbl[id].readonly == 0) {
+		fprintf(stderr, "%s: %s: not a read-only statement\n", __func__, stmt_tbl[id].name);
+		return (NULL);
 	}
 
-	ret = sqlite3_bind_text(client_apikey_reset_stmt, 3, apikey, -1, NULL);
+	ret = sqlite3_prepare_v3(conn->db, *stmt_tbl[id].sql, -1,
+	    SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
 	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+		fprintf(stderr, "%s: %s: ret=%d, %s\n", __func__, stmt_tbl[id].name, ret,
+		    sqlite3_errmsg(conn->db));
+		return (NULL);
 	}
 
-	ret = sqlite3_step(client_apikey_reset_stmt);
-	if (ret != SQLITE_DONE) {
-		line = __LINE__;
-		goto error;
+	if (sqlite3_bind_parameter_count(stmt) != (int)strlen(stmt_tbl[id].params) ||
+	    sqlite3_column_count(stmt) != stmt_tbl[id].ncol) {
+		fprintf(stderr, "%s: %s: %d parameters and %d columns, not what stmt_tbl says\n",
+		    __func__, stmt_tbl[id].name, sqlite3_bind_parameter_count(stmt),
+		    sqlite3_column_count(stmt));
+		sqlite3_finalize(stmt);
+		return (NULL);
 	}
 
-	if (sqlite3_changes(ldb) != 1) {
-		line = __LINE__;
-		goto error;
-	}
+	conn->stmt[id] = stmt;
 
-	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
+	return (stmt);
 }
 
-int
-ldb_client_recover(const char *email, const char *recover_key)
+static int
+ldb_vbind(struct ldb_conn *conn, int id, sqlite3_stmt **stmtp, va_list ap)
 {
-	int	ret;
-	int	line;
-
-	ret = sqlite3_reset(client_recover_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	sqlite3_stmt	*stmt;
+	const char	*p;
+	int		 ret = SQLITE_OK;
+	int		 i;
+
+	if ((stmt = ldb_stmt(conn, id)) == NULL) {
+		*stmtp = NULL;
+		return (SQLITE_ERROR);
 	}
-
-	ret = sqlite3_bind_text(client_recover_stmt, 1, recover_key, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	*stmtp = stmt;
+
+	for (p = stmt_tbl[id].params, i = 1; *p != '\0' && ret == SQLITE_OK; p++, i++) {
+		switch (*p) {
+		case 't':
+			ret = sqlite3_bind_text(stmt, i, va_arg(ap, const char *), -1, NULL);
+			break;
+		case 'i':
+			ret = sqlite3_bind_int(stmt, i, va_arg(ap, int));
+			break;
+		case 'I':
+			ret = sqlite3_bind_int64(stmt, i, va_arg(ap, sqlite3_int64));
+			break;
+		}
 	}
 
-	ret = sqlite3_bind_text(client_recover_stmt, 2, email, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	return (ret);
+}
 
-	ret = sqlite3_step(client_recover_stmt);
-	if (ret != SQLITE_DONE) {
-		line = __LINE__;
-		goto error;
-	}
+/* Reset statement `id' and bind the arguments, typed by stmt_tbl. The
+ * statement is returned in `stmtp', NULL if it can't be prepared.
+ */
+static int
+ldb_bind(struct ldb_conn *conn, int id, sqlite3_stmt **stmtp, ...)
+{
+	sqlite3_stmt	*stmt;
+	va_list		 ap;
+	int		 ret;
 
-	if (sqlite3_changes(ldb) != 1) {
-		line = __LINE__;
-		goto error;
-	}
+	va_start(ap, stmtp);
+	ret = ldb_vbind(conn, id, &stmt, ap);
+	va_end(ap);
 
-	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
+	if (stmtp != NULL)
+		*stmtp = stmt;
+
+	return (ret);
 }
 
-int
-ldb_client_password_reset(const char *email, const char *password, const char *recover_key)
+/* Same as ldb_bind(), then step once. Returns what sqlite3_step() did. */
+static int
+ldb_run(struct ldb_conn *conn, int id, sqlite3_stmt **stmtp, ...)
 {
-	int	ret;
-	int	line;
-
-	ret = sqlite3_reset(client_password_reset_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	sqlite3_stmt	*stmt;
+	va_list		 ap;
+	int		 ret;
+
+	va_start(ap, stmtp);
+	ret = ldb_vbind(conn, id, &stmt, ap);
+	va_end(ap);
+
+	if (stmtp != NULL)
+		*stmtp = stmt;
+	if (ret != SQLITE_OK)
+		return (ret);
+
+	/* The busy handler already waited for the locks it could. What is
+	 * left, SQLITE_LOCKED or a stale WAL snapshot, is retried here, only
+	 * outside of transactions: within one, the caller must roll back.
+	 */
+	for (;;) {
+		ret = sqlite3_step(stmt);
+		if (ret != SQLITE_BUSY && ret != SQLITE_LOCKED)
+			break;
+		if (sqlite3_get_autocommit(conn->db) == 0 && id != STMT_COMMIT)
+			break;
+		if (ldb_busy_wait(conn) == -1)
+			break;
+		sqlite3_reset(stmt);
 	}
+	/* A statement that failed still holds its read transaction until
+	 * reset, every later write of the connection would find a stale
+	 * snapshot and fail too. */
+	if (ret == SQLITE_BUSY || ret == SQLITE_LOCKED)
+		sqlite3_reset(stmt);
 
-	ret = sqlite3_bind_text(client_password_reset_stmt, 1, password, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	return (ret);
+}
 
-	ret = sqlite3_bind_text(client_password_reset_stmt, 2, email, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+/* FNV-1a of `str', of its ASCII lower case with `lower' the way SQLite's
+ * LOWER() compares emails. For the in-memory tables and shard placement.
+ */
+static uint32_t
+ldb_fnv1a(const char *str, int lower)
+{
+	uint32_t	h = 2166136261U;
+	int		c;
+
+	for (; *str != '\0'; str++) {
+		c = (unsigned char)*str;
+		if (lower && c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		h = (h ^ c) * 16777619U;
 	}
 
-	ret = sqlite3_bind_text(client_password_reset_stmt, 3, recover_key, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	return (h);
+}
 
-	ret = sqlite3_step(client_password_reset_stmt);
-	if (ret != SQLITE_DONE) {
-		line = __LINE__;
-		goto error;
-	}
+/* Lower case `email' into `buf' the way SQLite's LOWER() does, and hash it. */
+static int
+ldb_auth_key(const char *email, char *buf, uint64_t *hash)
+{
+	size_t	i;
 
-	if (sqlite3_changes(ldb) != 1) {
-		line = __LINE__;
-		goto error;
+	for (i = 0; email[i] != '\0'; i++) {
+		if (i == LDB_AUTH_EMAIL_MAX - 1)
+			return (-1);
+		buf[i] = (email[i] >= 'A' && email[i] <= 'Z') ? email[i] + 32 : email[i];
 	}
+	buf[i] = '\0';
+	*hash = ldb_fnv1a(buf, 0);
 
 	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
 }
 
-int
-ldb_network_create(const char *email, const char *uid, const char *description,
-	const char *subnet, const char *netmask,
-	const char *embassy_certificate, const char *embassy_privatekey,
-	const char *passport_certificate, const char *passport_privatekey)
+static struct ldb_auth_shard *
+ldb_auth_shard(struct ldb_ctx *ctx, uint64_t hash, struct ldb_auth_entry **set)
 {
-	int	ret;
-	int	line;
-
-	ret = sqlite3_reset(network_create_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	struct ldb_auth_shard	*shard;
 
-	ret = sqlite3_bind_text(network_create_stmt, 1, email, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	shard = &ctx->auth[hash % LDB_AUTH_SHARDS];
+	*set = &shard->entry[(hash / LDB_AUTH_SHARDS) % (LDB_AUTH_SLOTS / LDB_AUTH_WAYS) * LDB_AUTH_WAYS];
 
-	ret = sqlite3_bind_text(network_create_stmt, 2, uid, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	return (shard);
+}
 
-	ret = sqlite3_bind_text(network_create_stmt, 3, description, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+static void
+ldb_auth_entry_clear(struct ldb_auth_entry *e)
+{
+	free(e->email);
+	free(e->apikey);
+	e->email = e->apikey = NULL;
+	e->hash = 0;
+}
 
-	ret = sqlite3_bind_text(network_create_stmt, 4, subnet, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+static void
+ldb_auth_invalidate(struct ldb_ctx *ctx, const char *email)
+{
+	struct ldb_auth_shard	*shard;
+	struct ldb_auth_entry	*set;
+	char			 key[LDB_AUTH_EMAIL_MAX];
+	uint64_t		 hash;
+	int			 i;
+
+	if (ldb_auth_key(email, key, &hash) == -1)
+		return;
+	shard = ldb_auth_shard(ctx, hash, &set);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	shard->gen++;
+	for (i = 0; i < LDB_AUTH_WAYS; i++) {
+		if (set[i].email != NULL && set[i].hash == hash && strcmp(set[i].email, key) == 0)
+			ldb_auth_entry_clear(&set[i]);
 	}
+	pthread_rwlock_unlock(&shard->lock);
+}
 
-	ret = sqlite3_bind_text(network_create_stmt, 5, netmask, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+/* Queue an invalidation for when the writer's transaction ends. Dropping the
+ * entry before the commit would let a reader cache the old credentials back
+ * from its snapshot. Called with the writer held.
+ */
+static void
+ldb_auth_pending(struct ldb_ctx *ctx, const char *email)
+{
+	char	**pending;
+	char	 *s;
+
+	if (email == NULL)
+		return;
+
+	pending = realloc(ctx->auth_pending, (ctx->auth_npending + 1) * sizeof(*pending));
+	if (pending == NULL || (s = strdup(email)) == NULL) {
+		/* Can't defer it, invalidate now and at least drop
+		 * what's cached. */
+		if (pending != NULL)
+			ctx->auth_pending = pending;
+		ldb_auth_invalidate(ctx, email);
+		return;
 	}
+	ctx->auth_pending = pending;
+	ctx->auth_pending[ctx->auth_npending++] = s;
+}
 
-	ret = sqlite3_bind_text(network_create_stmt, 6, embassy_certificate, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+static void
+ldb_auth_flush(struct ldb_ctx *ctx)
+{
+	int	i;
 
-	ret = sqlite3_bind_text(network_create_stmt, 7, embassy_privatekey, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	for (i = 0; i < ctx->auth_npending; i++) {
+		ldb_auth_invalidate(ctx, ctx->auth_pending[i]);
+		free(ctx->auth_pending[i]);
 	}
+	ctx->auth_npending = 0;
+}
 
-	ret = sqlite3_bind_text(network_create_stmt, 8, passport_certificate, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+/* Check email/apikey of an active client, from the cache or from the client
+ * table through `conn'. Returns 0 if they are valid, -1 otherwise.
+ */
+static int
+ldb_auth(struct ldb_ctx *ctx, struct ldb_conn *conn, const char *email,
+	const char *apikey)
+{
+	struct ldb_auth_shard	*shard = NULL;
+	struct ldb_auth_entry	*set = NULL;
+	struct ldb_auth_entry	*e;
+	sqlite3_stmt		*stmt;
+	char			 key[LDB_AUTH_EMAIL_MAX];
+	uint64_t		 hash;
+	unsigned long		 gen = 0;
+	int			 ret;
+	int			 i;
+
+	if (email == NULL || apikey == NULL)
+		return (-1);
+
+	if (ldb_auth_key(email, key, &hash) == 0) {
+		shard = ldb_auth_shard(ctx, hash, &set);
+
+		pthread_rwlock_rdlock(&shard->lock);
+		for (i = 0; i < LDB_AUTH_WAYS; i++) {
+			e = &set[i];
+			if (e->email != NULL && e->hash == hash &&
+			    strcmp(e->email, key) == 0 && strcmp(e->apikey, apikey) == 0) {
+				pthread_rwlock_unlock(&shard->lock);
+				return (0);
+			}
+		}
+		gen = shard->gen;
+		pthread_rwlock_unlock(&shard->lock);
 	}
 
-	ret = sqlite3_bind_text(network_create_stmt, 9, passport_privatekey, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	ret = ldb_run(conn, STMT_CLIENT_AUTH, &stmt, email, apikey);
+	sqlite3_reset(stmt);
 
-	ret = sqlite3_step(network_create_stmt);
-	if (ret != SQLITE_DONE) {
-		line = __LINE__;
-		goto error;
+	if (ret != SQLITE_ROW) {
+		if (ret != SQLITE_DONE)
+			fprintf(stderr, "%s: ret=%d, %s\n", __func__, ret, sqlite3_errmsg(conn->db));
+		return (-1);
 	}
 
-	if (sqlite3_changes(ldb) != 1) {
-		line = __LINE__;
-		goto error;
+	/* Never cache what an uncommitted transaction can see. */
+	if (shard == NULL || sqlite3_get_autocommit(conn->db) == 0)
+		return (0);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	if (shard->gen == gen) {
+		for (i = 0; i < LDB_AUTH_WAYS; i++) {
+			if (set[i].email == NULL)
+				break;
+		}
+		if (i == LDB_AUTH_WAYS)
+			i = shard->victim++ % LDB_AUTH_WAYS;
+		e = &set[i];
+		ldb_auth_entry_clear(e);
+		e->email = strdup(key);
+		e->apikey = strdup(apikey);
+		if (e->email != NULL && e->apikey != NULL)
+			e->hash = hash;
+		else
+			ldb_auth_entry_clear(e);
 	}
+	pthread_rwlock_unlock(&shard->lock);
 
 	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
 }
 
-int
-ldb_network_get(const char *email, const char *description,
-	const unsigned char **uid, const unsigned char **subnet,
-	const unsigned char **netmask, const unsigned char **ipv4_last)
+static inline uint64_t
+ldb_stats_start(struct ldb_ctx *ctx)
 {
-	int	ret;
-	int	line;
+	if (__atomic_load_n(&ctx->stats_enabled, __ATOMIC_RELAXED) == 0)
+		return (0);
+	return (ldb_now_ns());
+}
 
-	ret = sqlite3_reset(network_get_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+/* Accumulate, and reset, the counters of statement `id' of `conn'. */
+static void
+ldb_stats_stmt(struct ldb_ctx *ctx, struct ldb_conn *conn, int id)
+{
+	struct ldb_stats_stmt_ctr	*c = &ctx->stats_stmt[id];
+	sqlite3_stmt			*stmt;
+
+	if (conn == NULL || (stmt = conn->stmt[id]) == NULL)
+		return;
+
+	__atomic_fetch_add(&c->fullscan_step,
+	    sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1), __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->sort,
+	    sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1), __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->autoindex,
+	    sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1), __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->vm_step,
+	    sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1), __ATOMIC_RELAXED);
+}
 
-	ret = sqlite3_bind_text(network_get_stmt, 1, email, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+/* The free range statements run on behalf of several calls. */
+static void
+ldb_stats_ipv4_range(struct ldb_ctx *ctx, struct ldb_conn *conn, uint64_t t0)
+{
+	if (t0 == 0)
+		return;
+
+	ldb_stats_stmt(ctx, conn, STMT_IPV4_RANGE_FIND);
+	ldb_stats_stmt(ctx, conn, STMT_IPV4_RANGE_LOWEST);
+	ldb_stats_stmt(ctx, conn, STMT_IPV4_RANGE_GET);
+	ldb_stats_stmt(ctx, conn, STMT_IPV4_RANGE_ADD);
+	ldb_stats_stmt(ctx, conn, STMT_IPV4_RANGE_DEL);
+	ldb_stats_stmt(ctx, conn, STMT_IPV4_POOL_DELETE);
+}
 
-	ret = sqlite3_bind_text(network_get_stmt, 2, description, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+/* Record a call started at `t0', and the counters of its statement `id'
+ * when `conn' is known. A no-op unless stats were enabled when it started.
+ */
+static void
+ldb_stats_end(struct ldb_ctx *ctx, struct ldb_conn *conn, int call, int id,
+	uint64_t t0, int ret)
+{
+	struct ldb_stats_call_ctr	*c = &ctx->stats_call[call];
+	uint64_t			 ns;
+	int				 b;
+
+	if (t0 == 0)
+		return;
+
+	ns = ldb_now_ns() - t0;
+	for (b = 0; b < LDB_STATS_BUCKETS - 1 && (ns >> (b + 1)) != 0; b++)
+		;
+
+	__atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+	if (ret == -1)
+		__atomic_fetch_add(&c->errors, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->time_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->hist[b], 1, __ATOMIC_RELAXED);
+
+	if (id >= 0)
+		ldb_stats_stmt(ctx, conn, id);
+}
+
+/* Tables of the change feed, ldb_cdc_func() gets the index. */
+static const char *ldb_cdc_tables[] = { "network", "node" };
+
+static void
+ldb_cdc_func(sqlite3_context *sctx, int argc, sqlite3_value **argv)
+{
+	struct ldb_ctx		*ctx = sqlite3_user_data(sctx);
+	struct ldb_change	*c;
+	const unsigned char	*uid;
+	int			 table;
+	int			 size;
+	int			 len;
+
+	(void)argc;
+	table = sqlite3_value_int(argv[0]);
+	if (table < 0 || table >= (int)(sizeof(ldb_cdc_tables) / sizeof(ldb_cdc_tables[0]))) {
+		sqlite3_result_error(sctx, "ldb_cdc: no such table", -1);
+		return;
 	}
 
-	ret = sqlite3_step(network_get_stmt);
-	if (ret != SQLITE_ROW) {
-		line = __LINE__;
-		goto error;
+	if (ctx->cdc_n == ctx->cdc_size) {
+		size = (ctx->cdc_size > 0) ? ctx->cdc_size * 2 : 64;
+		if ((c = realloc(ctx->cdc, size * sizeof(*c))) == NULL) {
+			sqlite3_result_error_nomem(sctx);
+			return;
+		}
+		ctx->cdc = c;
+		ctx->cdc_size = size;
 	}
 
-	*uid = sqlite3_column_text(network_get_stmt, 0);
-	*subnet = sqlite3_column_text(network_get_stmt, 1);
-	*netmask = sqlite3_column_text(network_get_stmt, 2);
-	*ipv4_last = sqlite3_column_text(network_get_stmt, 3);
+	if ((uid = sqlite3_value_text(argv[2])) == NULL)
+		uid = (const unsigned char *)"";
+	len = sqlite3_value_bytes(argv[2]);
+	if (len > LDB_CHANGE_UID - 1)
+		len = LDB_CHANGE_UID - 1;
+
+	c = &ctx->cdc[ctx->cdc_n++];
+	c->table = ldb_cdc_tables[table];
+	c->op = sqlite3_value_int(argv[1]);
+	memcpy(c->uid, uid, len);
+	c->uid[len] = '\0';
+}
+
+/* The transaction may still fail after the hook, on I/O errors, and then
+ * rolls back: the rows are only published once it's over.
+ */
+static int
+ldb_cdc_commit_hook(void *arg)
+{
+	struct ldb_ctx	*ctx = arg;
 
+	ctx->cdc_commit = 1;
 	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
 }
 
-int
-ldb_network_list(const char *email, const char *apikey,
-	int (*cb)(const unsigned char *, const unsigned char *, void *),
-	void *store)
+static void
+ldb_cdc_rollback_hook(void *arg)
 {
-	int	ret;
-	int	line;
+	struct ldb_ctx	*ctx = arg;
 
-	ret = sqlite3_reset(network_list_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	ctx->cdc_n = 0;
+	ctx->cdc_commit = 0;
+	ctx->cdc_depth = 0;
+}
 
-	ret = sqlite3_bind_text(network_list_stmt, 1, email, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+/* Savepoints started, and released or rolled back, on the writer, so that
+ * the rows staged within one that rolled back are dropped. Savepoints
+ * nested deeper than LDB_CDC_DEPTH keep their rows.
+ */
+static void
+ldb_cdc_mark(struct ldb_conn *conn)
+{
+	struct ldb_ctx	*ctx = conn->ctx;
 
-	ret = sqlite3_bind_text(network_list_stmt, 2, apikey, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	if (conn != &ctx->writer)
+		return;
+	if (ctx->cdc_depth < LDB_CDC_DEPTH)
+		ctx->cdc_mark[ctx->cdc_depth] = ctx->cdc_n;
+	ctx->cdc_depth++;
+}
 
-	//printf("expand: %s\n", sqlite3_expanded_sql(network_list_stmt));
+static void
+ldb_cdc_unmark(struct ldb_conn *conn, int rollback)
+{
+	struct ldb_ctx	*ctx = conn->ctx;
+
+	/* The transaction ended with the savepoint. */
+	if (conn != &ctx->writer || ctx->cdc_depth == 0)
+		return;
+	ctx->cdc_depth--;
+	if (rollback && ctx->cdc_depth < LDB_CDC_DEPTH &&
+	    ctx->cdc_n > ctx->cdc_mark[ctx->cdc_depth])
+		ctx->cdc_n = ctx->cdc_mark[ctx->cdc_depth];
+}
 
-	/* We don't distinguish between a client without a network
-	 * and bad credentials.
-	 */
-	while (sqlite3_step(network_list_stmt) == SQLITE_ROW) {
-		cb(sqlite3_column_text(network_list_stmt, 0),
-		    sqlite3_column_text(network_list_stmt, 1),
-		    store);
+/* Copy the rows of the committed transaction to every ring, those that
+ * don't fit are counted lost, and wake the readers up.
+ */
+static void
+ldb_cdc_publish(struct ldb_ctx *ctx)
+{
+	struct ldb_ring	*r;
+	uint64_t	 head;
+	uint64_t	 tail;
+	int		 i;
+
+	if (ctx->cdc_commit) {
+		LIST_FOREACH(r, &ctx->feeds, entry) {
+			head = r->head;
+			tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+			for (i = 0; i < ctx->cdc_n; i++) {
+				if (head - tail > r->mask) {
+					__atomic_add_fetch(&r->lost, ctx->cdc_n - i, __ATOMIC_RELAXED);
+					break;
+				}
+				r->slot[head & r->mask] = ctx->cdc[i];
+				head++;
+			}
+			__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+			if (r->feed->fd != -1)
+				eventfd_write(r->feed->fd, 1);
+		}
 	}
 
-	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
+	ctx->cdc_n = 0;
+	ctx->cdc_commit = 0;
+	ctx->cdc_depth = 0;
 }
 
-int
-ldb_network_embassy_get(const char *uid, const unsigned char **embassy_passport,
-	const unsigned char **embassy_privatekey, int *embassy_serial)
+static struct ldb_conn *
+ldb_writer(struct ldb_ctx *ctx)
 {
-	int	ret;
-	int	line;
+	pthread_mutex_lock(&ctx->writer_mtx);
+	ldb_busy_reset(&ctx->writer);
+	return (&ctx->writer);
+}
 
-	ret = sqlite3_reset(network_embassy_get_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+/* Check a reader out of the pool for the call, ldb_release() gives it back.
+ * Blocks while every reader is checked out. A call made from a callback of
+ * another, or within ldb_read_begin(), gets the reader the thread already
+ * has. A thread inside ldb_begin() reads from the writer instead.
+ */
+static struct ldb_conn *
+ldb_reader(struct ldb_ctx *ctx)
+{
+	struct ldb_thread	*t;
+	int			 i;
 
-	ret = sqlite3_bind_text(network_embassy_get_stmt, 1, uid, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	if ((t = ldb_thread(ctx)) == NULL)
+		return (NULL);
 
-	//printf("expand: %s\n", sqlite3_expanded_sql(network_embassy_get_stmt));
+	/* Inside a transaction, read our own writes. */
+	if (t->txn)
+		return (ldb_writer(ctx));
 
-	ret = sqlite3_step(network_embassy_get_stmt);
-	if (ret != SQLITE_ROW) {
-		line = __LINE__;
-		goto error;
+	if (t->reader != NULL) {
+		t->depth++;
+		ldb_busy_reset(t->reader);
+		return (t->reader);
 	}
 
-	*embassy_passport = sqlite3_column_text(network_embassy_get_stmt, 0);
-	*embassy_privatekey = sqlite3_column_text(network_embassy_get_stmt, 1);
-	*embassy_serial = sqlite3_column_int(network_embassy_get_stmt, 2);
+	pthread_mutex_lock(&ctx->readers_mtx);
+	for (;;) {
+		for (i = 0; i < ctx->nreaders; i++) {
+			if (ctx->readers[i].bound == 0)
+				break;
+		}
+		if (i < ctx->nreaders)
+			break;
+		pthread_cond_wait(&ctx->readers_cond, &ctx->readers_mtx);
+	}
+	t->reader = &ctx->readers[i];
+	t->reader->bound = 1;
+	pthread_mutex_unlock(&ctx->readers_mtx);
+	t->depth = 1;
+	ldb_busy_reset(t->reader);
 
-	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
+	return (t->reader);
 }
 
-int
-ldb_network_serial_inc(const char *uid)
+/* Give the reader of the thread back to the pool. */
+static void
+ldb_reader_put(struct ldb_ctx *ctx, struct ldb_thread *t)
 {
-	int	ret;
-	int	line;
+	pthread_mutex_lock(&ctx->readers_mtx);
+	t->reader->bound = 0;
+	t->reader = NULL;
+	t->depth = 0;
+	pthread_cond_signal(&ctx->readers_cond);
+	pthread_mutex_unlock(&ctx->readers_mtx);
+}
 
-	ret = sqlite3_reset(network_serial_inc_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+static void
+ldb_release(struct ldb_ctx *ctx, struct ldb_conn *conn)
+{
+	struct ldb_thread	*t;
+
+	/* A reader stays with the thread while a snapshot is pinned. */
+	if (conn != &ctx->writer) {
+		t = pthread_getspecific(ctx->thread_key);
+		if (t != NULL && t->reader == conn && --t->depth == 0 && t->snapshot == 0)
+			ldb_reader_put(ctx, t);
+		return;
 	}
 
-	ret = sqlite3_bind_text(network_serial_inc_stmt, 1, uid, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	if (ctx->auth_npending > 0 && sqlite3_get_autocommit(conn->db))
+		ldb_auth_flush(ctx);
+	if (ctx->cdc_n > 0 && sqlite3_get_autocommit(conn->db))
+		ldb_cdc_publish(ctx);
+	if (sqlite3_total_changes64(conn->db) != ctx->changes) {
+		ctx->changes = sqlite3_total_changes64(conn->db);
+		__atomic_store_n(&ctx->last_write, ldb_now_ns(), __ATOMIC_RELAXED);
 	}
+	pthread_mutex_unlock(&ctx->writer_mtx);
+}
 
-	//printf("expand: %s\n", sqlite3_expanded_sql(network_serial_inc_stmt));
+static void
+ldb_conn_close(struct ldb_conn *conn)
+{
+	int	i;
 
-	ret = sqlite3_step(network_serial_inc_stmt);
-	if (ret != SQLITE_DONE) {
-		line = __LINE__;
-		goto error;
+	for (i = 0; i < STMT_MAX; i++) {
+		sqlite3_finalize(conn->stmt[i]);
+		conn->stmt[i] = NULL;
 	}
 
-	if (sqlite3_changes(ldb) != 1) {
-		line = __LINE__;
-		goto error;
+	sqlite3_close(conn->db);
+	conn->db = NULL;
+}
+
+static const char ldb_b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* PEM of a "label\0DER" blob, 64 columns and \n line endings. */
+static char *
+ldb_pem_encode(const unsigned char *blob, int len, int *pemlen)
+{
+	const unsigned char	*der;
+	char			*pem;
+	char			*o;
+	size_t			 llen;
+	int			 n;
+	int			 i;
+	uint32_t		 v;
+
+	llen = strnlen((const char *)blob, len);
+	if ((int)llen == len)
+		return (NULL);
+	der = blob + llen + 1;
+	n = len - llen - 1;
+
+	/* Both armor lines, 33 + 2 * llen with the NUL, and the base64 with a
+	 * \n every 48 bytes of DER, the last line included. */
+	if ((pem = sqlite3_malloc(2 * llen + 33 + (n + 2) / 3 * 4 + (n + 47) / 48)) == NULL)
+		return (NULL);
+
+	o = pem + sprintf(pem, "-----BEGIN %.*s-----\n", (int)llen, blob);
+	for (i = 0; i < n; i += 3) {
+		v = der[i] << 16;
+		if (i + 1 < n)
+			v |= der[i + 1] << 8;
+		if (i + 2 < n)
+			v |= der[i + 2];
+		*o++ = ldb_b64[v >> 18 & 63];
+		*o++ = ldb_b64[v >> 12 & 63];
+		*o++ = (i + 1 < n) ? ldb_b64[v >> 6 & 63] : '=';
+		*o++ = (i + 2 < n) ? ldb_b64[v & 63] : '=';
+		if ((i / 3 + 1) % 16 == 0 || i + 3 >= n)
+			*o++ = '\n';
 	}
+	o += sprintf(o, "-----END %.*s-----\n", (int)llen, blob);
+	*pemlen = o - pem;
 
-	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
+	return (pem);
 }
 
-int
-ldb_network_ipv4_last_set(const char *uid, const char *ipv4_last)
+/* SQL ldb_der(pem): the "label\0DER" blob of a single PEM block, when
+ * ldb_pem() turns it back into the very same text. Anything else is
+ * returned unchanged.
+ */
+static void
+ldb_der_func(sqlite3_context *sctx, int argc, sqlite3_value **argv)
 {
-	int	ret;
-	int	line;
-
-	ret = sqlite3_reset(network_ipv4_last_set_stmt);
-	if (ret != SQLITE_OK ) {
-		line = __LINE__;
-		goto error;
+	const char		*pem;
+	const char		*label;
+	const char		*end;
+	const char		*q;
+	const char		*p;
+	unsigned char		*blob = NULL;
+	char			*check = NULL;
+	uint32_t		 acc = 0;
+	int			 nbits = 0;
+	int			 len;
+	int			 checklen;
+	int			 n;
+
+	(void)argc;
+	if (sqlite3_value_type(argv[0]) != SQLITE_TEXT)
+		goto raw;
+	pem = (const char *)sqlite3_value_text(argv[0]);
+	len = sqlite3_value_bytes(argv[0]);
+
+	if (strncmp(pem, "-----BEGIN ", 11) != 0)
+		goto raw;
+	label = pem + 11;
+	if ((end = strstr(label, "-----\n")) == NULL)
+		goto raw;
+
+	n = end - label;
+	if ((blob = sqlite3_malloc(len)) == NULL)
+		goto raw;
+	memcpy(blob, label, n);
+	blob[n++] = '\0';
+
+	for (q = end + 6; *q != '\0' && *q != '-'; q++) {
+		if (*q == '\n' || *q == '=')
+			continue;
+		if ((p = strchr(ldb_b64, *q)) == NULL)
+			goto raw;
+		acc = acc << 6 | (p - ldb_b64);
+		nbits += 6;
+		if (nbits >= 8) {
+			nbits -= 8;
+			blob[n++] = acc >> nbits & 0xff;
+		}
 	}
 
-	ret = sqlite3_bind_text(network_ipv4_last_set_stmt, 1, ipv4_last, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	check = ldb_pem_encode(blob, n, &checklen);
+	if (check == NULL || checklen != len || memcmp(check, pem, len) != 0)
+		goto raw;
+
+	sqlite3_free(check);
+	sqlite3_result_blob(sctx, blob, n, sqlite3_free);
+	return;
+raw:
+	sqlite3_free(check);
+	sqlite3_free(blob);
+	sqlite3_result_value(sctx, argv[0]);
+}
 
-	ret = sqlite3_bind_text(network_ipv4_last_set_stmt, 2, uid, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+/* SQL ldb_pem(der): the reverse of ldb_der(). */
+static void
+ldb_pem_func(sqlite3_context *sctx, int argc, sqlite3_value **argv)
+{
+	char	*pem;
+	int	 len;
+
+	(void)argc;
+	if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+		sqlite3_result_value(sctx, argv[0]);
+		return;
 	}
 
-	ret = sqlite3_step(network_ipv4_last_set_stmt);
-	if (ret != SQLITE_DONE) {
-		line = __LINE__;
-		goto error;
+	pem = ldb_pem_encode(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]), &len);
+	if (pem == NULL) {
+		sqlite3_result_error_nomem(sctx);
+		return;
 	}
+	sqlite3_result_text(sctx, pem, len, sqlite3_free);
+}
 
-	if (sqlite3_changes(ldb) != 1) {
-		line = __LINE__;
-		goto error;
+static int
+ldb_pragma(struct ldb_conn *conn, const char *fmt, ...)
+{
+	va_list	 ap;
+	char	*sql;
+	int	 ret;
+
+	va_start(ap, fmt);
+	sql = sqlite3_vmprintf(fmt, ap);
+	va_end(ap);
+	if (sql == NULL)
+		return (SQLITE_NOMEM);
+
+	ret = sqlite3_exec(conn->db, sql, NULL, NULL, NULL);
+	sqlite3_free(sql);
+
+	return (ret);
+}
+
+/* Value of PRAGMA `name' in `val'. */
+static int
+ldb_pragma_int(struct ldb_conn *conn, const char *name, int *val)
+{
+	sqlite3_stmt	*stmt;
+	char		*sql;
+	int		 ret;
+
+	if ((sql = sqlite3_mprintf("PRAGMA %s;", name)) == NULL)
+		return (SQLITE_NOMEM);
+
+	ret = sqlite3_prepare_v2(conn->db, sql, -1, &stmt, NULL);
+	sqlite3_free(sql);
+	if (ret != SQLITE_OK)
+		return (ret);
+	if ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		*val = sqlite3_column_int(stmt, 0);
+		ret = SQLITE_OK;
 	}
+	sqlite3_finalize(stmt);
 
-	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
+	return (ret);
 }
 
-int
-ldb_node_create(const char *network_uid, const char *uid,
-	const char *provkey, const char *description)
+/* Open a connection and apply `opts'. Readers only run the read-only
+ * statements, the writer also is read-only with opts->readonly. page_size
+ * and journal_mode belong to the database, only the writer sets them.
+ */
+static int
+ldb_conn_open(struct ldb_ctx *ctx, struct ldb_conn *conn, const char *filename,
+	int readonly, const struct ldb_options *opts)
 {
-	int	ret;
+	int	ret = SQLITE_OK;
 	int	line;
+	int	flags;
+
+	conn->ctx = ctx;
+	conn->readonly = readonly;
+	conn->busy_seed = (unsigned int)(ldb_now_ns() ^ (uintptr_t)conn);
 
-	ret = sqlite3_reset(node_create_stmt);
+	flags = SQLITE_OPEN_NOMUTEX;
+	flags |= (readonly || opts->readonly) ? SQLITE_OPEN_READONLY :
+	    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+	ret = sqlite3_open_v2(filename, &conn->db, flags, NULL);
 	if (ret != SQLITE_OK) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_bind_text(node_create_stmt, 1, network_uid, -1, NULL);
+	ret = sqlite3_busy_handler(conn->db, ldb_busy_handler, conn);
 	if (ret != SQLITE_OK) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_bind_text(node_create_stmt, 2, uid, -1, NULL);
+	ret = sqlite3_create_function(conn->db, "ldb_der", 1,
+	    SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, ldb_der_func, NULL, NULL);
+	if (ret == SQLITE_OK)
+		ret = sqlite3_create_function(conn->db, "ldb_pem", 1,
+		    SQLITE_UTF8 | SQLITE_DETERMINISTIC | SQLITE_INNOCUOUS, NULL, ldb_pem_func, NULL, NULL);
 	if (ret != SQLITE_OK) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_bind_text(node_create_stmt, 3, provkey, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	/* The writer stages rows for the change feed. */
+	if (readonly == 0) {
+		ret = sqlite3_create_function(conn->db, "ldb_cdc", 3, SQLITE_UTF8,
+		    ctx, ldb_cdc_func, NULL, NULL);
+		if (ret != SQLITE_OK) {
+			line = __LINE__;
+			goto error;
+		}
+		sqlite3_commit_hook(conn->db, ldb_cdc_commit_hook, ctx);
+		sqlite3_rollback_hook(conn->db, ldb_cdc_rollback_hook, ctx);
 	}
 
-	ret = sqlite3_bind_text(node_create_stmt, 4, description, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	if (readonly == 0 && opts->readonly == 0) {
+		/* Before journal_mode, WAL fixes the page size. */
+		if (opts->page_size > 0)
+			ret = ldb_pragma(conn, "PRAGMA page_size=%d;", opts->page_size);
+		if (ret == SQLITE_OK && opts->journal_mode != NULL)
+			ret = ldb_pragma(conn, "PRAGMA journal_mode=%s;", opts->journal_mode);
+		if (ret != SQLITE_OK) {
+			line = __LINE__;
+			goto error;
+		}
 	}
 
-	ret = sqlite3_step(node_create_stmt);
-	if (ret != SQLITE_DONE) {
+	if (opts->synchronous != NULL)
+		ret = ldb_pragma(conn, "PRAGMA synchronous=%s;", opts->synchronous);
+	if (ret == SQLITE_OK && opts->cache_size != 0)
+		ret = ldb_pragma(conn, "PRAGMA cache_size=%d;", opts->cache_size);
+	if (ret == SQLITE_OK && opts->mmap_size > 0)
+		ret = ldb_pragma(conn, "PRAGMA mmap_size=%lld;", (long long)opts->mmap_size);
+	if (ret == SQLITE_OK && opts->temp_store != NULL)
+		ret = ldb_pragma(conn, "PRAGMA temp_store=%s;", opts->temp_store);
+	if (ret != SQLITE_OK) {
 		line = __LINE__;
 		goto error;
 	}
 
 	return (0);
 error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
+	fprintf(stderr, "line:%d %s: ret=%d, %s\n", line, __func__, ret, sqlite3_errmsg(conn->db));
+	ldb_conn_close(conn);
 	return (-1);
 }
 
-int
-ldb_node_delete(const char *node_description, const char *network_description,
-	const char *email, const char *apikey,
-	const unsigned char **node_uid, const unsigned char **network_uid)
+/* Savepoints nest within ldb_begin() transactions and write queue batches,
+ * functions running more than one statement use them to stay atomic.
+ */
+static int
+ldb_savepoint(struct ldb_conn *conn)
 {
 	int	ret;
-	int	line;
 
-	ret = sqlite3_reset(node_delete_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	if ((ret = ldb_run(conn, STMT_SAVEPOINT, NULL)) == SQLITE_DONE)
+		ldb_cdc_mark(conn);
+	return (ret);
+}
 
-	ret = sqlite3_bind_text(node_delete_stmt, 1, node_description, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+static int
+ldb_savepoint_release(struct ldb_conn *conn)
+{
+	int	ret;
 
-	ret = sqlite3_bind_text(node_delete_stmt, 2, network_description, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	if ((ret = ldb_run(conn, STMT_RELEASE, NULL)) == SQLITE_DONE)
+		ldb_cdc_unmark(conn, 0);
+	return (ret);
+}
 
-	ret = sqlite3_bind_text(node_delete_stmt, 3, email, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+static void
+ldb_savepoint_rollback(struct ldb_conn *conn)
+{
+	ldb_run(conn, STMT_ROLLBACK_TO, NULL);
+	ldb_cdc_unmark(conn, 1);
+	ldb_run(conn, STMT_RELEASE, NULL);
+}
 
-	ret = sqlite3_bind_text(node_delete_stmt, 4, apikey, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+/* Id of the network `uid', SQLITE_ROW when found, SQLITE_DONE when not. */
+static int
+ldb_network_id(struct ldb_conn *conn, const char *uid, sqlite3_int64 *id)
+{
+	sqlite3_stmt	*stmt;
+	int		 ret;
 
-	ret = sqlite3_step(node_delete_stmt);
-	if (ret != SQLITE_ROW) {
-		line = __LINE__;
-		goto error;
-	}
+	ret = ldb_run(conn, STMT_NETWORK_ID, &stmt, uid);
+	if (ret == SQLITE_ROW)
+		*id = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
 
-	//printf("expand: %s\n", sqlite3_expanded_sql(node_delete_stmt));
+	return (ret);
+}
 
-	*node_uid = sqlite3_column_text(node_delete_stmt, 0);
-	*network_uid = sqlite3_column_text(node_delete_stmt, 1);
+/* Same for a node of the network `network_id'. */
+static int
+ldb_node_id(struct ldb_conn *conn, const char *uid, sqlite3_int64 network_id,
+	sqlite3_int64 *id)
+{
+	sqlite3_stmt	*stmt;
+	int		 ret;
 
-	return (0);
-error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	return (-1);
+	ret = ldb_run(conn, STMT_NODE_ID, &stmt, uid, network_id);
+	if (ret == SQLITE_ROW)
+		*id = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	return (ret);
 }
 
-int
-ldb_node_status_set(int status, const char *ipsrc,
-	const char *node_uid, const char *network_uid)
+/* A client and everything it owns live in the shard picked by a hash of
+ * its email. Calls naming a network by uid find the shard in the network_shard
+ * table of the directory, cached.
+ */
+static int
+ldb_shard_lookup(struct ldb_ctx *ctx, const char *uid)
 {
-	int	ret;
-	int	line;
-
-	ret = sqlite3_reset(node_status_set_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	struct ldb_thread	*t;
+	struct ldb_dir	*d;
+	struct ldb_dir	*e;
+	struct ldb_conn	*conn;
+	sqlite3_stmt	*stmt;
+	uint64_t	 h;
+	size_t		 len;
+	int		 shard = -1;
+	int		 ret;
+
+	h = ldb_fnv1a(uid, 0);
+
+	pthread_rwlock_rdlock(&ctx->dir_lock);
+	LIST_FOREACH(d, &ctx->dir[h % LDB_DIR_BUCKETS], entry) {
+		if (d->hash == h && strcmp(d->uid, uid) == 0) {
+			shard = d->shard;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&ctx->dir_lock);
+	if (shard != -1)
+		return (shard);
+
+	if ((conn = ldb_reader(ctx)) == NULL)
+		return (-1);
+	ret = ldb_run(conn, STMT_SHARD_GET, &stmt, uid);
+	if (ret == SQLITE_ROW)
+		shard = sqlite3_column_int(stmt, 0);
+	sqlite3_reset(stmt);
+	ldb_release(ctx, conn);
+
+	if (ret != SQLITE_ROW || shard < 0 || shard >= ctx->nshard) {
+		fprintf(stderr, "%s: %s: no such network, ret=%d\n", __func__, uid, ret);
+		return (-1);
 	}
 
-	ret = sqlite3_bind_int(node_status_set_stmt, 1, status);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	/* Not a claim the transaction may still roll back. */
+	if ((t = ldb_thread(ctx)) == NULL || t->txn)
+		return (shard);
+
+	len = strlen(uid) + 1;
+	if ((d = malloc(sizeof(*d) + len)) == NULL)
+		return (shard);
+	d->hash = h;
+	d->shard = shard;
+	memcpy(d->uid, uid, len);
+
+	pthread_rwlock_wrlock(&ctx->dir_lock);
+	LIST_FOREACH(e, &ctx->dir[h % LDB_DIR_BUCKETS], entry) {
+		if (e->hash == h && strcmp(e->uid, uid) == 0)
+			break;
 	}
+	if (e == NULL)
+		LIST_INSERT_HEAD(&ctx->dir[h % LDB_DIR_BUCKETS], d, entry);
+	pthread_rwlock_unlock(&ctx->dir_lock);
+	if (e != NULL)
+		free(d);
 
-	ret = sqlite3_bind_text(node_status_set_stmt, 2, ipsrc, -1, NULL);
-	if (ret != SQLITE_OK) {
+	return (shard);
+}
+
+/* Take network `uid' back out of `shard' when the directory couldn't
+ * commit its claim, no lookup would ever find it.
+ */
+static int
+ldb_shard_network_undo(struct ldb_ctx *shard, const char *uid)
+{
+	struct ldb_conn	*conn;
+	sqlite3_int64	 network_id;
+	int		 own;
+	int		 ret;
+	int		 line;
+
+	if ((conn = ldb_writer(shard)) == NULL)
+		return (-1);
+
+	own = sqlite3_get_autocommit(conn->db);
+	ret = own ? ldb_run(conn, STMT_BEGIN_IMMEDIATE, NULL) : ldb_savepoint(conn);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_bind_text(node_status_set_stmt, 3, node_uid, -1, NULL);
-	if (ret != SQLITE_OK) {
+	ret = ldb_network_id(conn, uid, &network_id);
+	if (ret != SQLITE_ROW) {
 		line = __LINE__;
-		goto error;
+		goto rollback;
 	}
 
-	ret = sqlite3_bind_text(node_status_set_stmt, 4, network_uid, -1, NULL);
-	if (ret != SQLITE_OK) {
+	ret = ldb_run(conn, STMT_IPV4_POOL_DELETE, NULL, network_id);
+	if (ret == SQLITE_DONE)
+		ret = ldb_run(conn, STMT_NETWORK_SECRET_DELETE, NULL, network_id);
+	if (ret == SQLITE_DONE)
+		ret = ldb_run(conn, STMT_NETWORK_DELETE, NULL, network_id);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
-		goto error;
+		goto rollback;
 	}
 
-	ret = sqlite3_step(node_status_set_stmt);
+	ret = own ? ldb_run(conn, STMT_COMMIT, NULL) : ldb_savepoint_release(conn);
 	if (ret != SQLITE_DONE) {
 		line = __LINE__;
-		goto error;
+		goto rollback;
 	}
 
+	ldb_release(shard, conn);
 	return (0);
+rollback:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	if (!own)
+		ldb_savepoint_rollback(conn);
+	else if (sqlite3_get_autocommit(conn->db) == 0)
+		ldb_run(conn, STMT_ROLLBACK, NULL);
+	ldb_release(shard, conn);
+	return (-1);
 error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_release(shard, conn);
 	return (-1);
 }
 
-int
-ldb_ipv4_allocate(const char *network_uid, const char *node_uid, const char *address)
+/* Claim `uid' in the directory, then create the network in the shard of
+ * its client. The claim keeps network uids unique across shards. Within
+ * ldb_begin() the claim is part of the directory's transaction, otherwise
+ * it commits once the shard has the network, and the network is taken
+ * back out of the shard if that COMMIT fails.
+ */
+static int
+ldb_shard_network_create(struct ldb_ctx *ctx, const char *email, const char *uid,
+	const char *description,
+	const char *subnet, const char *netmask,
+	const char *embassy_certificate, const char *embassy_privatekey,
+	const char *passport_certificate, const char *passport_privatekey)
 {
-	int	ret;
-	int	line;
-
-	ret = sqlite3_reset(ipv4_allocate_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	struct ldb_conn	*conn;
+	int		 shard;
+	int		 created = 0;
+	int		 own;
+	int		 ret;
+	int		 line;
+	uint64_t	 t0;
 
-	ret = sqlite3_bind_text(ipv4_allocate_stmt, 1, network_uid, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	shard = ldb_fnv1a(email, 1) % ctx->nshard;
 
-	ret = sqlite3_bind_text(ipv4_allocate_stmt, 2, node_uid, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	t0 = ldb_stats_start(ctx);
 
-	ret = sqlite3_bind_text(ipv4_allocate_stmt, 3, address, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
 
-	ret = sqlite3_bind_text(ipv4_allocate_stmt, 4, node_uid, -1, NULL);
-	if (ret != SQLITE_OK) {
+	own = sqlite3_get_autocommit(conn->db);
+	ret = own ? ldb_run(conn, STMT_BEGIN_IMMEDIATE, NULL) : ldb_savepoint(conn);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_bind_text(ipv4_allocate_stmt, 5, network_uid, -1, NULL);
-	if (ret != SQLITE_OK) {
+	ret = ldb_run(conn, STMT_SHARD_ADD, NULL, uid, shard);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
-		goto error;
+		goto rollback;
 	}
 
-	ret = sqlite3_bind_text(ipv4_allocate_stmt, 6, network_uid, -1, NULL);
-	if (ret != SQLITE_OK) {
+	if (ldb_network_create(ctx->shard[shard], email, uid, description, subnet,
+	    netmask, embassy_certificate, embassy_privatekey,
+	    passport_certificate, passport_privatekey) == -1) {
+		ret = SQLITE_ABORT;
 		line = __LINE__;
-		goto error;
+		goto rollback;
 	}
+	created = 1;
 
-	ret = sqlite3_step(ipv4_allocate_stmt);
+	ret = own ? ldb_run(conn, STMT_COMMIT, NULL) : ldb_savepoint_release(conn);
 	if (ret != SQLITE_DONE) {
 		line = __LINE__;
-		goto error;
+		goto rollback;
 	}
 
+	ldb_stats_end(ctx, conn, CALL_SHARD_NETWORK_CREATE, STMT_SHARD_ADD, t0, 0);
+	ldb_release(ctx, conn);
 	return (0);
-
+rollback:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	if (!own)
+		ldb_savepoint_rollback(conn);
+	else if (sqlite3_get_autocommit(conn->db) == 0)
+		ldb_run(conn, STMT_ROLLBACK, NULL);
+	if (created)
+		ldb_shard_network_undo(ctx->shard[shard], uid);
+	ldb_stats_end(ctx, conn, CALL_SHARD_NETWORK_CREATE, STMT_SHARD_ADD, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
 error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_SHARD_NETWORK_CREATE, STMT_SHARD_ADD, t0, -1);
+	ldb_release(ctx, conn);
 	return (-1);
 }
 
-int
-ldb_ipv4_release(const char *network_uid, const char *node_uid)
+/* The context serving a call, by client `email' or else by `network_uid':
+ * ctx itself without shards, NULL for an unknown network.
+ */
+static struct ldb_ctx *
+ldb_shard(struct ldb_ctx *ctx, const char *email, const char *network_uid)
 {
-	int	ret;
-	int	line;
+	int	i;
 
-	ret = sqlite3_reset(ipv4_release_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	if (ctx->nshard == 0)
+		return (ctx);
+
+	if (email != NULL)
+		return (ctx->shard[ldb_fnv1a(email, 1) % ctx->nshard]);
+
+	if ((i = ldb_shard_lookup(ctx, network_uid)) == -1)
+		return (NULL);
+	return (ctx->shard[i]);
+}
+
+static int
+ipv4_aton(const char *str, sqlite3_int64 *addr)
+{
+	struct in_addr	in;
+
+	if (str == NULL || inet_pton(AF_INET, str, &in) != 1)
+		return (-1);
+	*addr = ntohl(in.s_addr);
+
+	return (0);
+}
+
+/* The node picks the shard and bucket, the network only tells records apart. */
+static uint64_t
+ldb_presence_hash(const char *node_uid, const char *network_uid)
+{
+	return ((uint64_t)ldb_fnv1a(network_uid, 0) << 32 | ldb_fnv1a(node_uid, 0));
+}
+
+/* Called with the shard locked. */
+static struct ldb_presence *
+ldb_presence_find(struct ldb_presence_shard *sh, uint64_t h, const char *node_uid,
+	const char *network_uid)
+{
+	struct ldb_presence	*p;
+
+	LIST_FOREACH(p, &sh->bucket[(h / LDB_PRESENCE_SHARDS) % LDB_PRESENCE_BUCKETS], entry) {
+		if (p->hash == h && strcmp(p->uid, node_uid) == 0 &&
+		    strcmp(p->network_uid, network_uid) == 0)
+			return (p);
 	}
 
-	ret = sqlite3_bind_text(ipv4_release_stmt, 1, network_uid, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	return (NULL);
+}
+
+/* Whether node `node_uid' of `network_uid' exists, -1 on error. */
+static int
+ldb_presence_node(struct ldb_ctx *ctx, const char *node_uid, const char *network_uid)
+{
+	struct ldb_conn	*conn;
+	sqlite3_int64	 network_id;
+	sqlite3_int64	 node_id;
+	int		 ret;
+
+	if ((conn = ldb_reader(ctx)) == NULL)
+		return (-1);
+	ret = ldb_network_id(conn, network_uid, &network_id);
+	if (ret == SQLITE_ROW)
+		ret = ldb_node_id(conn, node_uid, network_id, &node_id);
+	ldb_release(ctx, conn);
+
+	if (ret == SQLITE_ROW)
+		return (1);
+	return (ret == SQLITE_DONE ? 0 : -1);
+}
+
+/* Record a heartbeat, returns -1 if it must go to the database directly:
+ * no presence buffer, inside a transaction, an ipsrc we can't hold, or a
+ * node that isn't buffered yet and can't be found, whose direct write
+ * fails. Nodes leave the buffer once written or deleted, a buffered one
+ * exists.
+ */
+static int
+ldb_presence_set(struct ldb_ctx *ctx, int status, const char *ipsrc,
+	const char *node_uid, const char *network_uid)
+{
+	struct ldb_pr			*pr = ctx->pr;
+	struct ldb_presence_shard	*sh;
+	struct ldb_presence		*p;
+	struct ldb_thread		*t;
+	uint64_t			 h;
+	size_t				 ulen;
+	size_t				 nlen;
+
+	if (pr == NULL || ipsrc == NULL || node_uid == NULL || network_uid == NULL ||
+	    strlen(ipsrc) >= LDB_PRESENCE_IPSRC)
+		return (-1);
+	if ((t = ldb_thread(ctx)) == NULL || t->txn)
+		return (-1);
+
+	h = ldb_presence_hash(node_uid, network_uid);
+	sh = &pr->shard[h % LDB_PRESENCE_SHARDS];
+
+	pthread_mutex_lock(&sh->mtx);
+	p = ldb_presence_find(sh, h, node_uid, network_uid);
+	pthread_mutex_unlock(&sh->mtx);
+	if (p == NULL && ldb_presence_node(ctx, node_uid, network_uid) != 1)
+		return (-1);
+
+	pthread_mutex_lock(&sh->mtx);
+	if ((p = ldb_presence_find(sh, h, node_uid, network_uid)) == NULL) {
+		ulen = strlen(node_uid) + 1;
+		nlen = strlen(network_uid) + 1;
+		if ((p = calloc(1, sizeof(*p) + ulen + nlen)) == NULL) {
+			pthread_mutex_unlock(&sh->mtx);
+			return (-1);
+		}
+		p->hash = h;
+		memcpy(p->uid, node_uid, ulen);
+		p->network_uid = p->uid + ulen;
+		memcpy(p->network_uid, network_uid, nlen);
+		LIST_INSERT_HEAD(&sh->bucket[(h / LDB_PRESENCE_SHARDS) % LDB_PRESENCE_BUCKETS], p, entry);
+	} else if (p->status == status && strcmp(p->ipsrc, ipsrc) == 0) {
+		/* Nothing changed since the last heartbeat. */
+		pthread_mutex_unlock(&sh->mtx);
+		return (0);
 	}
 
-	ret = sqlite3_bind_text(ipv4_release_stmt, 2, node_uid, -1, NULL);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	p->status = status;
+	memcpy(p->ipsrc, ipsrc, strlen(ipsrc) + 1);
+	p->seq = __atomic_add_fetch(&pr->seq, 1, __ATOMIC_RELAXED);
+	if (p->dirty == 0) {
+		p->dirty = 1;
+		LIST_INSERT_HEAD(&sh->dirty, p, dirty_entry);
 	}
+	pthread_mutex_unlock(&sh->mtx);
 
-	ret = sqlite3_step(ipv4_release_stmt);
+	return (0);
+}
+
+/* Buffered status of a node, for the read functions. */
+static int
+ldb_presence_get(struct ldb_ctx *ctx, const char *node_uid, const char *network_uid,
+	int *status)
+{
+	struct ldb_pr			*pr = ctx->pr;
+	struct ldb_presence_shard	*sh;
+	struct ldb_presence		*p;
+	uint64_t			 h;
+	int				 ret = -1;
+
+	if (pr == NULL || node_uid == NULL || network_uid == NULL)
+		return (-1);
+
+	h = ldb_presence_hash(node_uid, network_uid);
+	sh = &pr->shard[h % LDB_PRESENCE_SHARDS];
+
+	pthread_mutex_lock(&sh->mtx);
+	if ((p = ldb_presence_find(sh, h, node_uid, network_uid)) != NULL) {
+		*status = p->status;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&sh->mtx);
+
+	return (ret);
+}
+
+/* Drop a deleted node, or one about to be written directly. Called with
+ * the writer held: a flush running before can't write anything older
+ * afterwards, it checks the buffer under the writer too.
+ */
+static void
+ldb_presence_forget(struct ldb_ctx *ctx, const char *node_uid, const char *network_uid)
+{
+	struct ldb_pr			*pr = ctx->pr;
+	struct ldb_presence_shard	*sh;
+	struct ldb_presence		*p;
+	uint64_t			 h;
+
+	if (pr == NULL || node_uid == NULL || network_uid == NULL)
+		return;
+
+	h = ldb_presence_hash(node_uid, network_uid);
+	sh = &pr->shard[h % LDB_PRESENCE_SHARDS];
+
+	pthread_mutex_lock(&sh->mtx);
+	if ((p = ldb_presence_find(sh, h, node_uid, network_uid)) != NULL) {
+		LIST_REMOVE(p, entry);
+		if (p->dirty)
+			LIST_REMOVE(p, dirty_entry);
+		free(p);
+	}
+	pthread_mutex_unlock(&sh->mtx);
+}
+
+// FIXME create foreign key from network + ON DELETE CASCADE and ON UPDATE CASCADE
+
+int
+ldb_client_create(struct ldb_ctx *ctx, const char *email, const char *password,
+	const char *apikey)
+{
+	struct ldb_conn	*conn;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, email, NULL)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	ret = ldb_run(conn, STMT_CLIENT_CREATE, NULL, email, password, apikey);
 	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
 
+	ldb_stats_end(ctx, conn, CALL_CLIENT_CREATE, STMT_CLIENT_CREATE, t0, 0);
+	ldb_release(ctx, conn);
 	return (0);
-
 error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_CLIENT_CREATE, STMT_CLIENT_CREATE, t0, -1);
+	ldb_release(ctx, conn);
 	return (-1);
 }
 
+/* Check the credentials of an active client, mostly from memory. */
 int
-ldb_ipv4_delete(const char *network_uid)
+ldb_client_auth(struct ldb_ctx *ctx, const char *email, const char *apikey)
 {
-	int	ret;
-	int	line;
+	struct ldb_conn	*conn;
+	uint64_t	 t0;
+	int		 ret;
 
-	ret = sqlite3_reset(ipv4_delete_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	if ((ctx = ldb_shard(ctx, email, NULL)) == NULL)
+		return (-1);
 
-	ret = sqlite3_bind_text(ipv4_delete_stmt, 1, network_uid, -1, NULL);
-	if (ret != SQLITE_OK) {
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_reader(ctx)) == NULL)
+		return (-1);
+	ret = ldb_auth(ctx, conn, email, apikey);
+	ldb_stats_end(ctx, conn, CALL_CLIENT_AUTH, STMT_CLIENT_AUTH, t0, ret);
+	ldb_release(ctx, conn);
+
+	return (ret);
+}
+
+int
+ldb_client_activate(struct ldb_ctx *ctx, const char *email, const char *apikey)
+{
+	struct ldb_conn	*conn;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, email, NULL)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	ret = ldb_run(conn, STMT_CLIENT_ACTIVATE, NULL, email, apikey);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_step(ipv4_delete_stmt);
-	if (ret != SQLITE_DONE) {
+	if (sqlite3_changes(conn->db) != 1) {
 		line = __LINE__;
 		goto error;
 	}
 
+	ldb_auth_pending(ctx, email);
+	ldb_stats_end(ctx, conn, CALL_CLIENT_ACTIVATE, STMT_CLIENT_ACTIVATE, t0, 0);
+	ldb_release(ctx, conn);
 	return (0);
-
 error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_CLIENT_ACTIVATE, STMT_CLIENT_ACTIVATE, t0, -1);
+	ldb_release(ctx, conn);
 	return (-1);
 }
 
 int
-ldb_ipv4_available(const char *network_uid, const unsigned char **ipv4_available)
+ldb_client_apikey_set(struct ldb_ctx *ctx, const char *email, const char *password,
+	const char *apikey)
 {
-	int	ret;
-	int	line;
+	struct ldb_conn	*conn;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
 
-	ret = sqlite3_reset(ipv4_available_stmt);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
-	}
+	if ((ctx = ldb_shard(ctx, email, NULL)) == NULL)
+		return (-1);
 
-	ret = sqlite3_bind_text(ipv4_available_stmt, 1, network_uid, -1, NULL);
-	if (ret != SQLITE_OK) {
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	ret = ldb_run(conn, STMT_CLIENT_APIKEY_SET, NULL, apikey, email, password);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_step(ipv4_available_stmt);
-	if (ret != SQLITE_ROW) {
+	if (sqlite3_changes(conn->db) != 1) {
 		line = __LINE__;
 		goto error;
 	}
 
-	*ipv4_available = sqlite3_column_text(ipv4_available_stmt, 0);
-
+	ldb_auth_pending(ctx, email);
+	ldb_stats_end(ctx, conn, CALL_CLIENT_APIKEY_SET, STMT_CLIENT_APIKEY_SET, t0, 0);
+	ldb_release(ctx, conn);
 	return (0);
-
 error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_CLIENT_APIKEY_SET, STMT_CLIENT_APIKEY_SET, t0, -1);
+	ldb_release(ctx, conn);
 	return (-1);
 }
 
-void
-ldb_fini()
+int
+ldb_client_apikey_reset(struct ldb_ctx *ctx, const char *email, const char *apikey,
+	const char *new_apikey)
 {
-	sqlite3_finalize(client_create_stmt);
-	client_create_stmt = NULL;
+	struct ldb_conn	*conn;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
 
-	sqlite3_finalize(node_delete_stmt);
-	node_delete_stmt = NULL;
+	if ((ctx = ldb_shard(ctx, email, NULL)) == NULL)
+		return (-1);
 
+	t0 = ldb_stats_start(ctx);
 
-	sqlite3_close(ldb);
-	ldb = NULL;
-}
-
-int
-ldb_init(const char *filename)
-{
-	int	ret;
-	int	line;
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
 
-	ret = sqlite3_open(filename, &ldb);
-	if (ret != SQLITE_OK) {
+	ret = ldb_run(conn, STMT_CLIENT_APIKEY_RESET, NULL, new_apikey, email, apikey);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, client_create_sql, -1, &client_create_stmt, 0);
-	if (ret != SQLITE_OK) {
+	if (sqlite3_changes(conn->db) != 1) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, client_activate_sql, -1, &client_activate_stmt, 0);
-	if (ret != SQLITE_OK) {
+	ldb_auth_pending(ctx, email);
+	ldb_stats_end(ctx, conn, CALL_CLIENT_APIKEY_RESET, STMT_CLIENT_APIKEY_RESET, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_CLIENT_APIKEY_RESET, STMT_CLIENT_APIKEY_RESET, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+int
+ldb_client_recover(struct ldb_ctx *ctx, const char *email, const char *recover_key)
+{
+	struct ldb_conn	*conn;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, email, NULL)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	ret = ldb_run(conn, STMT_CLIENT_RECOVER, NULL, recover_key, email);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, client_apikey_set_sql, -1, &client_apikey_set_stmt, 0);
-	if (ret != SQLITE_OK) {
+	if (sqlite3_changes(conn->db) != 1) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, client_apikey_reset_sql, -1, &client_apikey_reset_stmt, 0);
-	if (ret != SQLITE_OK) {
+	ldb_stats_end(ctx, conn, CALL_CLIENT_RECOVER, STMT_CLIENT_RECOVER, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_CLIENT_RECOVER, STMT_CLIENT_RECOVER, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+int
+ldb_client_password_reset(struct ldb_ctx *ctx, const char *email, const char *password,
+	const char *recover_key)
+{
+	struct ldb_conn	*conn;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, email, NULL)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	ret = ldb_run(conn, STMT_CLIENT_PASSWORD_RESET, NULL, password, email, recover_key);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, client_recover_sql, -1, &client_recover_stmt, 0);
-	if (ret != SQLITE_OK) {
+	if (sqlite3_changes(conn->db) != 1) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, client_password_reset_sql, -1, &client_password_reset_stmt, 0);
-	if (ret != SQLITE_OK) {
+	ldb_auth_pending(ctx, email);
+	ldb_stats_end(ctx, conn, CALL_CLIENT_PASSWORD_RESET, STMT_CLIENT_PASSWORD_RESET, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_CLIENT_PASSWORD_RESET, STMT_CLIENT_PASSWORD_RESET, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+int
+ldb_network_create(struct ldb_ctx *ctx, const char *email, const char *uid,
+	const char *description,
+	const char *subnet, const char *netmask,
+	const char *embassy_certificate, const char *embassy_privatekey,
+	const char *passport_certificate, const char *passport_privatekey)
+{
+	struct ldb_conn	*conn;
+	sqlite3_int64	 network_id;
+	sqlite3_int64	 addr;
+	sqlite3_int64	 mask;
+	sqlite3_int64	 first;
+	sqlite3_int64	 last;
+	int		 sp = 0;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if (ctx->nshard > 0)
+		return (ldb_shard_network_create(ctx, email, uid, description, subnet,
+		    netmask, embassy_certificate, embassy_privatekey,
+		    passport_certificate, passport_privatekey));
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	if (ipv4_aton(subnet, &addr) == -1 || ipv4_aton(netmask, &mask) == -1) {
+		ret = SQLITE_MISMATCH;
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, network_create_sql, -1, &network_create_stmt, 0);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	/* The pool holds every host address, all of them for a /31 or /32. */
+	first = addr & mask;
+	last = first | (~mask & 0xffffffff);
+	if (last - first > 1) {
+		first++;
+		last--;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, network_get_sql, -1, &network_get_stmt, 0);
-	if (ret != SQLITE_OK) {
+	ret = ldb_savepoint(conn);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
+	sp = 1;
 
-	ret = sqlite3_prepare_v2(ldb, network_list_sql, -1, &network_list_stmt, 0);
-	if (ret != SQLITE_OK) {
+	ret = ldb_run(conn, STMT_NETWORK_CREATE, NULL, email, uid, description, subnet, netmask);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, network_embassy_get_sql, -1, &network_embassy_get_stmt, 0);
-	if (ret != SQLITE_OK) {
+	/* No such client. */
+	if (sqlite3_changes(conn->db) != 1) {
 		line = __LINE__;
 		goto error;
 	}
+	network_id = sqlite3_last_insert_rowid(conn->db);
 
-	ret = sqlite3_prepare_v2(ldb, network_serial_inc_sql, -1, &network_serial_inc_stmt, 0);
-	if (ret != SQLITE_OK) {
+	ret = ldb_run(conn, STMT_NETWORK_SECRET_CREATE, NULL, network_id, embassy_certificate, embassy_privatekey, passport_certificate, passport_privatekey);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, network_ipv4_last_set_sql, -1, &network_ipv4_last_set_stmt, 0);
-	if (ret != SQLITE_OK ) {
+	ret = ldb_run(conn, STMT_IPV4_RANGE_ADD, NULL, network_id, first, last);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, node_create_sql, -1, &node_create_stmt, 0);
-	if (ret != SQLITE_OK) {
+	ret = ldb_savepoint_release(conn);
+	if (ret != SQLITE_DONE) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, node_delete_sql, -1, &node_delete_stmt, 0);
-	if (ret != SQLITE_OK) {
+	ldb_stats_ipv4_range(ctx, conn, t0);
+	ldb_stats_end(ctx, conn, CALL_NETWORK_CREATE, STMT_NETWORK_CREATE, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	if (sp)
+		ldb_savepoint_rollback(conn);
+	ldb_stats_ipv4_range(ctx, conn, t0);
+	ldb_stats_end(ctx, conn, CALL_NETWORK_CREATE, STMT_NETWORK_CREATE, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+static int
+ldb_network_get_into(struct ldb_ctx *ctx, const char *email, const char *description,
+	const unsigned char **uid, const unsigned char **subnet,
+	const unsigned char **netmask, struct ldb_arena *arena)
+{
+	const unsigned char	**cols[] = { uid, subnet, netmask };
+	struct ldb_thread	*t;
+	struct ldb_conn	*conn;
+	sqlite3_stmt	*stmt;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, email, NULL)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_reader(ctx)) == NULL)
+		return (-1);
+	t = ldb_thread(ctx);
+
+	ret = ldb_run(conn, STMT_NETWORK_GET, &stmt, email, description);
+	if (ret != SQLITE_ROW) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare_v2(ldb, node_status_set_sql, -1, &node_status_set_stmt, 0);
+	ret = ldb_row_take(t, STMT_NETWORK_GET, stmt, arena, cols, 3);
 	if (ret != SQLITE_OK) {
 		line = __LINE__;
 		goto error;
 	}
+	sqlite3_reset(stmt);
 
-	ret = sqlite3_prepare(ldb, ipv4_allocate_sql, -1, &ipv4_allocate_stmt, 0);
-	if (ret != SQLITE_OK) {
-		line = __LINE__;
-		goto error;
+	ldb_stats_end(ctx, conn, CALL_NETWORK_GET, STMT_NETWORK_GET, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_NETWORK_GET, STMT_NETWORK_GET, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+/* The strings stay valid until this thread calls ldb_network_get() again. */
+int
+ldb_network_get(struct ldb_ctx *ctx, const char *email, const char *description,
+	const unsigned char **uid, const unsigned char **subnet,
+	const unsigned char **netmask)
+{
+	return ldb_network_get_into(ctx, email, description, uid, subnet, netmask, NULL);
+}
+
+/* Same, the strings are copied into `arena' and stay valid until it's reset. */
+int
+ldb_network_get_r(struct ldb_ctx *ctx, const char *email, const char *description,
+	const unsigned char **uid, const unsigned char **subnet,
+	const unsigned char **netmask, struct ldb_arena *arena)
+{
+	return ldb_network_get_into(ctx, email, description, uid, subnet, netmask, arena);
+}
+
+int
+ldb_network_list(struct ldb_ctx *ctx, const char *email, const char *apikey,
+	int (*cb)(const unsigned char *, const unsigned char *, void *),
+	void *store)
+{
+	struct ldb_conn	*conn;
+	sqlite3_stmt	*stmt;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, email, NULL)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_reader(ctx)) == NULL)
+		return (-1);
+
+	/* We don't distinguish between a client without a network
+	 * and bad credentials.
+	 */
+	if (ldb_auth(ctx, conn, email, apikey) == -1) {
+		ldb_stats_end(ctx, conn, CALL_NETWORK_LIST, STMT_CLIENT_AUTH, t0, 0);
+		ldb_release(ctx, conn);
+		return (0);
 	}
 
-	ret = sqlite3_prepare(ldb, ipv4_release_sql, -1, &ipv4_release_stmt, 0);
+	ret = ldb_bind(conn, STMT_NETWORK_LIST, &stmt, email);
 	if (ret != SQLITE_OK) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare(ldb, ipv4_delete_sql, -1, &ipv4_delete_stmt, 0);
-	if (ret != SQLITE_OK) {
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		cb(sqlite3_column_text(stmt, 0),
+		    sqlite3_column_text(stmt, 1),
+		    store);
+	}
+	/* Don't hold the read transaction open until the next call. */
+	sqlite3_reset(stmt);
+
+	ldb_stats_end(ctx, conn, CALL_NETWORK_LIST, STMT_NETWORK_LIST, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_NETWORK_LIST, STMT_NETWORK_LIST, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+static int
+ldb_network_embassy_get_into(struct ldb_ctx *ctx, const char *uid,
+	const unsigned char **embassy_passport,
+	const unsigned char **embassy_privatekey, int *embassy_serial,
+	struct ldb_arena *arena)
+{
+	const unsigned char	**cols[] = { embassy_passport, embassy_privatekey };
+	struct ldb_thread	*t;
+	struct ldb_conn	*conn;
+	sqlite3_stmt	*stmt;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, NULL, uid)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_reader(ctx)) == NULL)
+		return (-1);
+	t = ldb_thread(ctx);
+
+	ret = ldb_run(conn, STMT_NETWORK_EMBASSY_GET, &stmt, uid);
+	if (ret != SQLITE_ROW) {
 		line = __LINE__;
 		goto error;
 	}
 
-	ret = sqlite3_prepare(ldb, ipv4_available_sql, -1, &ipv4_available_stmt, 0);
+	*embassy_serial = sqlite3_column_int(stmt, 2);
+
+	ret = ldb_row_take(t, STMT_NETWORK_EMBASSY_GET, stmt, arena, cols, 2);
 	if (ret != SQLITE_OK) {
 		line = __LINE__;
 		goto error;
 	}
+	sqlite3_reset(stmt);
 
+	ldb_stats_end(ctx, conn, CALL_NETWORK_EMBASSY_GET, STMT_NETWORK_EMBASSY_GET, t0, 0);
+	ldb_release(ctx, conn);
 	return (0);
 error:
-	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(ldb), sqlite3_errmsg(ldb));
-	ldb_fini();
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_NETWORK_EMBASSY_GET, STMT_NETWORK_EMBASSY_GET, t0, -1);
+	ldb_release(ctx, conn);
 	return (-1);
 }
 
 int
-network_list_cb(const unsigned char *uid, const unsigned char *description, void *store)
+ldb_network_embassy_get(struct ldb_ctx *ctx, const char *uid,
+	const unsigned char **embassy_passport,
+	const unsigned char **embassy_privatekey, int *embassy_serial)
+{
+	return ldb_network_embassy_get_into(ctx, uid, embassy_passport,
+	    embassy_privatekey, embassy_serial, NULL);
+}
+
+int
+ldb_network_embassy_get_r(struct ldb_ctx *ctx, const char *uid,
+	const unsigned char **embassy_passport,
+	const unsigned char **embassy_privatekey, int *embassy_serial,
+	struct ldb_arena *arena)
+{
+	return ldb_network_embassy_get_into(ctx, uid, embassy_passport,
+	    embassy_privatekey, embassy_serial, arena);
+}
+
+int
+ldb_network_serial_inc(struct ldb_ctx *ctx, const char *uid)
 {
-	printf("network_list_cb> uid:%s, description:%s\n", uid, description);
+	struct ldb_conn	*conn;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, NULL, uid)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	ret = ldb_run(conn, STMT_NETWORK_SERIAL_INC, NULL, uid);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
 
+	if (sqlite3_changes(conn->db) != 1) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ldb_stats_end(ctx, conn, CALL_NETWORK_SERIAL_INC, STMT_NETWORK_SERIAL_INC, t0, 0);
+	ldb_release(ctx, conn);
 	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_NETWORK_SERIAL_INC, STMT_NETWORK_SERIAL_INC, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
 }
 
+/* Hand out the next embassy serial of network `uid'. Serials are reserved
+ * serial_block at a time with a single durable UPDATE, most calls don't
+ * touch the database. A reservation is committed before any of its serials
+ * is handed out, a crash skips the rest of the block but never issues a
+ * serial twice. Not allowed inside ldb_begin(), a rollback would give the
+ * block back.
+ *
+ * serial_mtx only covers the lookup and the counters, never a wait for
+ * the writer: the writer is taken first, as everywhere else, and a block
+ * another thread reserved meanwhile is used rather than reserving again.
+ */
 int
-main(void)
+ldb_network_serial_next(struct ldb_ctx *ctx, const char *uid, sqlite3_int64 *serial)
 {
-	int	ret;
+	struct ldb_serial	*sr;
+	struct ldb_conn	*conn = NULL;
+	sqlite3_stmt	*stmt;
+	sqlite3_int64	 next;
+	uint32_t	 h;
+	size_t		 len;
+	uint64_t	 t0;
+	int		 ret;
+	int		 line;
 
-	printf("%s\n", sqlite3_libversion());
+	if ((ctx = ldb_shard(ctx, NULL, uid)) == NULL)
+		return (-1);
 
-	ret = ldb_init("test.db");
-	printf("ldb_init: %d\n", ret);
+	t0 = ldb_stats_start(ctx);
 
-	ldb_client_create("my_email", "my_password", "my_apikey");
-	ldb_client_activate("my_email", "my_apikey");
-	ldb_client_apikey_set("my_email", "my_password", "set_apikey");
-	ldb_client_apikey_reset("my_email", "set_apikey", "reset_apikey");
-	ldb_client_recover("my_email", "my_recover_key");
-	ldb_client_password_reset("my_email", "new_password", "my_recover_key");
+	len = strlen(uid);
+	h = ldb_fnv1a(uid, 0);
 
-	ldb_network_create("my_email", "my_uid", "my_description", "my_subnet", "my_netmask",
-	    "my_embassy_certificate", "my_embassy_privatekey",
-	    "my_passport_certificate", "my_passport_privatekey");
+	pthread_mutex_lock(&ctx->serial_mtx);
 
-	const unsigned char *uid = NULL;
-	const unsigned char *subnet = NULL;
-	const unsigned char *netmask = NULL;
-	const unsigned char *ipv4_last = NULL;
+	LIST_FOREACH(sr, &ctx->serial[h % LDB_SERIAL_BUCKETS], entry) {
+		if (strcmp(sr->uid, uid) == 0)
+			break;
+	}
 
-	ldb_network_ipv4_last_set("my_uid", "192.168.0.3");
-	ldb_network_get("my_email", "my_description", &uid, &subnet, &netmask, &ipv4_last);
-	printf("uid: %s, subnet: %s, netmask: %s, ipv4_last:%s\n", uid, subnet, netmask, ipv4_last);
+	if (sr != NULL && sr->next < sr->end) {
+		*serial = sr->next++;
+		pthread_mutex_unlock(&ctx->serial_mtx);
+		ldb_stats_end(ctx, NULL, CALL_NETWORK_SERIAL_NEXT, -1, t0, 0);
+		return (0);
+	}
 
-	ldb_network_list("my_email", "reset_apikey", network_list_cb, NULL);
+	if (sr == NULL) {
+		if ((sr = calloc(1, sizeof(*sr) + len + 1)) == NULL) {
+			pthread_mutex_unlock(&ctx->serial_mtx);
+			fprintf(stderr, "%s: calloc\n", __func__);
+			return (-1);
+		}
+		memcpy(sr->uid, uid, len + 1);
+		LIST_INSERT_HEAD(&ctx->serial[h % LDB_SERIAL_BUCKETS], sr, entry);
+	}
 
-	const unsigned char *embassy_passport = NULL;
-	const unsigned char *embassy_privatekey = NULL;
-	int embassy_serial;
+	/* Entries live until ldb_fini(), sr stays valid unlocked. */
+	pthread_mutex_unlock(&ctx->serial_mtx);
 
-	ldb_network_embassy_get("my_uid", &embassy_passport, &embassy_privatekey, &embassy_serial);
-	printf("passport: %s, privatekey:%s, serial:%d\n", embassy_passport, embassy_privatekey, embassy_serial);
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
 
+	if (sqlite3_get_autocommit(conn->db) == 0) {
+		ret = SQLITE_MISUSE;
+		line = __LINE__;
+		goto error;
+	}
 
-	ldb_network_serial_inc("my_uid");
+	/* Reservations are under the writer, one may have been made while
+	 * we waited for it. */
+	pthread_mutex_lock(&ctx->serial_mtx);
+	if (sr->next < sr->end) {
+		*serial = sr->next++;
+		pthread_mutex_unlock(&ctx->serial_mtx);
+		ldb_stats_end(ctx, conn, CALL_NETWORK_SERIAL_NEXT, -1, t0, 0);
+		ldb_release(ctx, conn);
+		return (0);
+	}
+	pthread_mutex_unlock(&ctx->serial_mtx);
 
-	ldb_network_embassy_get("my_uid", &embassy_passport, &embassy_privatekey, &embassy_serial);
-	printf("passport: %s, privatekey:%s, serial:%d\n", embassy_passport, embassy_privatekey, embassy_serial);
+	ret = ldb_run(conn, STMT_NETWORK_SERIAL_RESERVE, &stmt, ctx->serial_block, uid);
+	if (ret != SQLITE_ROW) {
+		line = __LINE__;
+		goto error;
+	}
 
-	ldb_node_create("my_uid", "my_node_uid", "my_provkey", "my_node_description");
-	ldb_node_create("my_uid", "my_node_uid2", "my_provkey", "my_node_description2");
+	next = sqlite3_column_int64(stmt, 0);
 
-	const unsigned char *node_uid = NULL;
-	const unsigned char *network_uid = NULL;
-	ldb_node_delete("my_node_description", "my_description", "my_email", "reset_apikey", &node_uid, &network_uid);
-	printf("deleted node: node_uid:%s, network_uid:%s\n", node_uid, network_uid);
+	/* Finish the statement, the UPDATE commits now. */
+	ret = sqlite3_reset(stmt);
+	if (ret != SQLITE_OK) {
+		line = __LINE__;
+		goto error;
+	}
 
+	pthread_mutex_lock(&ctx->serial_mtx);
+	sr->next = next;
+	sr->end = next + ctx->serial_block;
+	*serial = sr->next++;
+	pthread_mutex_unlock(&ctx->serial_mtx);
 
-	ldb_node_status_set(1, "127.0.0.1", "my_node_uid2", "my_uid");
+	ldb_stats_end(ctx, conn, CALL_NETWORK_SERIAL_NEXT, STMT_NETWORK_SERIAL_RESERVE, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_NETWORK_SERIAL_NEXT, STMT_NETWORK_SERIAL_RESERVE, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
 
-	ldb_ipv4_allocate("my_uid", "my_node_uid2", "192.168.0.1");
-	ldb_ipv4_release("my_uid", "my_node_uid2");
-	ldb_ipv4_delete("my_uid");
+int
+ldb_node_create(struct ldb_ctx *ctx, const char *network_uid, const char *uid,
+	const char *provkey, const char *description)
+{
+	struct ldb_conn	*conn;
+	sqlite3_int64	 network_id;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
 
-	ldb_ipv4_allocate("my_uid", "my_node_uid2", "192.168.0.1");
-	ldb_ipv4_release("my_uid", "my_node_uid2");
+	if ((ctx = ldb_shard(ctx, NULL, network_uid)) == NULL)
+		return (-1);
 
-	const unsigned char *ipv4_available = NULL;
-	ldb_ipv4_available("my_uid", &ipv4_available);
-	printf("next ipv4 available: %s\n", ipv4_available);
+	t0 = ldb_stats_start(ctx);
 
-	ldb_fini();
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
 
-	return 0;
+	ret = ldb_network_id(conn, network_uid, &network_id);
+	if (ret != SQLITE_ROW) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_run(conn, STMT_NODE_CREATE, NULL, network_id, uid, provkey, description);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ldb_stats_end(ctx, conn, CALL_NODE_CREATE, STMT_NODE_CREATE, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_NODE_CREATE, STMT_NODE_CREATE, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+static int
+ldb_node_delete_into(struct ldb_ctx *ctx, const char *node_description,
+	const char *network_description,
+	const char *email, const char *apikey,
+	const unsigned char **node_uid, const unsigned char **network_uid,
+	struct ldb_arena *arena)
+{
+	const unsigned char	**cols[] = { node_uid, network_uid };
+	struct ldb_thread	*t;
+	struct ldb_conn	*conn;
+	sqlite3_stmt	*stmt;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, email, NULL)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((t = ldb_thread(ctx)) == NULL)
+		return (-1);
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	if (ldb_auth(ctx, conn, email, apikey) == -1) {
+		ret = SQLITE_AUTH;
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_run(conn, STMT_NODE_DELETE, &stmt, node_description, network_description, email);
+	if (ret != SQLITE_ROW) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_row_take(t, STMT_NODE_DELETE, stmt, arena, cols, 2);
+	if (ret != SQLITE_OK) {
+		line = __LINE__;
+		goto error;
+	}
+	sqlite3_reset(stmt);
+	ldb_presence_forget(ctx, (const char *)*node_uid, (const char *)*network_uid);
+
+	ldb_stats_end(ctx, conn, CALL_NODE_DELETE, STMT_NODE_DELETE, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_NODE_DELETE, STMT_NODE_DELETE, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+int
+ldb_node_delete(struct ldb_ctx *ctx, const char *node_description,
+	const char *network_description,
+	const char *email, const char *apikey,
+	const unsigned char **node_uid, const unsigned char **network_uid)
+{
+	return ldb_node_delete_into(ctx, node_description, network_description,
+	    email, apikey, node_uid, network_uid, NULL);
+}
+
+int
+ldb_node_delete_r(struct ldb_ctx *ctx, const char *node_description,
+	const char *network_description,
+	const char *email, const char *apikey,
+	const unsigned char **node_uid, const unsigned char **network_uid,
+	struct ldb_arena *arena)
+{
+	return ldb_node_delete_into(ctx, node_description, network_description,
+	    email, apikey, node_uid, network_uid, arena);
+}
+
+/* Stream the nodes of a network to `cb', at most `limit' of them and only
+ * those whose uid sorts after `after' (NULL for the first page). Pass the
+ * uid of the last node seen to get the next page. The strings given to `cb'
+ * are only valid during the call, ipv4 is NULL for a node without an
+ * address. Stops early if `cb' returns non-zero. Returns how many nodes
+ * were passed to `cb', fewer than `limit' on the last page, or -1, also
+ * when `email' and `apikey' don't match.
+ */
+int
+ldb_node_list(struct ldb_ctx *ctx, const char *email, const char *apikey,
+	const char *network_uid, const char *after, int limit,
+	int (*cb)(const unsigned char *, const unsigned char *,
+	    const unsigned char *, const unsigned char *, int,
+	    const unsigned char *, void *),
+	void *store)
+{
+	struct ldb_thread	*t;
+	struct ldb_conn	*conn;
+	sqlite3_stmt	*stmt = NULL;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+	int		 status;
+	int		 overlay;
+	int		 n = 0;
+
+	if ((ctx = ldb_shard(ctx, email, NULL)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_reader(ctx)) == NULL)
+		return (-1);
+
+	if (ldb_auth(ctx, conn, email, apikey) == -1) {
+		ret = SQLITE_AUTH;
+		line = __LINE__;
+		goto error;
+	}
+
+	/* Every uid sorts after the empty string. */
+	ret = ldb_bind(conn, STMT_NODE_LIST, &stmt, network_uid, email,
+	    after ? after : "", limit);
+	if (ret != SQLITE_OK) {
+		line = __LINE__;
+		goto error;
+	}
+
+	/* A pinned snapshot or a transaction reads one database version,
+	 * buffered heartbeats aren't part of it. */
+	t = ldb_thread(ctx);
+	overlay = (t != NULL && t->snapshot == 0 && t->txn == 0);
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		n++;
+		/* A buffered heartbeat is newer than the row. */
+		status = sqlite3_column_int(stmt, 4);
+		if (overlay)
+			ldb_presence_get(ctx, (const char *)sqlite3_column_text(stmt, 0),
+			    network_uid, &status);
+		if (cb(sqlite3_column_text(stmt, 0),
+		    sqlite3_column_text(stmt, 1),
+		    sqlite3_column_text(stmt, 2),
+		    sqlite3_column_text(stmt, 3),
+		    status,
+		    sqlite3_column_text(stmt, 5),
+		    store) != 0) {
+			ret = SQLITE_DONE;
+			break;
+		}
+	}
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+	/* Don't hold the read transaction open until the next page. */
+	sqlite3_reset(stmt);
+
+	ldb_stats_end(ctx, conn, CALL_NODE_LIST, STMT_NODE_LIST, t0, 0);
+	ldb_release(ctx, conn);
+	return (n);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	sqlite3_reset(stmt);
+	ldb_stats_end(ctx, conn, CALL_NODE_LIST, STMT_NODE_LIST, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+int
+ldb_node_status_set(struct ldb_ctx *ctx, int status, const char *ipsrc,
+	const char *node_uid, const char *network_uid)
+{
+	struct ldb_conn	*conn;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, NULL, network_uid)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	/* Heartbeats go through the presence buffer when it runs. */
+	if (ldb_presence_set(ctx, status, ipsrc, node_uid, network_uid) == 0) {
+		ldb_stats_end(ctx, NULL, CALL_NODE_STATUS_SET, -1, t0, 0);
+		return (0);
+	}
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	/* Written directly, a buffered value must not overwrite it later. */
+	ldb_presence_forget(ctx, node_uid, network_uid);
+
+	ret = ldb_run(conn, STMT_NODE_STATUS_SET, NULL, status, ipsrc, node_uid, network_uid);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	/* No such node. */
+	if (sqlite3_changes(conn->db) != 1) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ldb_stats_end(ctx, conn, CALL_NODE_STATUS_SET, STMT_NODE_STATUS_SET, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_NODE_STATUS_SET, STMT_NODE_STATUS_SET, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+/* Take `address' out of the free ranges of the network pool and give it to
+ * `node_uid', a node of that network, or the lowest free address when
+ * `address' is NULL.
+ */
+int
+ldb_ipv4_allocate(struct ldb_ctx *ctx, const char *network_uid, const char *node_uid,
+	const char *address)
+{
+	struct ldb_conn	*conn;
+	sqlite3_stmt	*range;
+	sqlite3_int64	 network_id;
+	sqlite3_int64	 node_id;
+	sqlite3_int64	 addr = 0;
+	sqlite3_int64	 first;
+	sqlite3_int64	 last;
+	int		 sp = 0;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, NULL, network_uid)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	if (address != NULL && ipv4_aton(address, &addr) == -1) {
+		ret = SQLITE_MISMATCH;
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_network_id(conn, network_uid, &network_id);
+	if (ret == SQLITE_ROW)
+		ret = ldb_node_id(conn, node_uid, network_id, &node_id);
+	if (ret != SQLITE_ROW) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_savepoint(conn);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+	sp = 1;
+
+	if (address == NULL) {
+		ret = ldb_run(conn, STMT_IPV4_RANGE_LOWEST, &range, network_id);
+	} else {
+		ret = ldb_run(conn, STMT_IPV4_RANGE_FIND, &range, network_id, addr);
+	}
+	if (ret != SQLITE_ROW) {
+		line = __LINE__;
+		goto error;
+	}
+
+	first = sqlite3_column_int64(range, 0);
+	last = sqlite3_column_int64(range, 1);
+	sqlite3_reset(range);
+
+	if (address == NULL)
+		addr = first;
+
+	/* Not in the pool, or already allocated. */
+	if (addr > last) {
+		ret = SQLITE_CONSTRAINT;
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_run(conn, STMT_IPV4_RANGE_DEL, NULL, network_id, first);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	if (first < addr) {
+		ret = ldb_run(conn, STMT_IPV4_RANGE_ADD, NULL, network_id, first, addr - 1);
+		if (ret != SQLITE_DONE) {
+			line = __LINE__;
+			goto error;
+		}
+	}
+
+	if (addr < last) {
+		ret = ldb_run(conn, STMT_IPV4_RANGE_ADD, NULL, network_id, addr + 1, last);
+		if (ret != SQLITE_DONE) {
+			line = __LINE__;
+			goto error;
+		}
+	}
+
+	ret = ldb_run(conn, STMT_IPV4_ALLOCATE, NULL, network_id, node_id, addr);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_savepoint_release(conn);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ldb_stats_ipv4_range(ctx, conn, t0);
+	ldb_stats_end(ctx, conn, CALL_IPV4_ALLOCATE, STMT_IPV4_ALLOCATE, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	if (sp)
+		ldb_savepoint_rollback(conn);
+	ldb_stats_ipv4_range(ctx, conn, t0);
+	ldb_stats_end(ctx, conn, CALL_IPV4_ALLOCATE, STMT_IPV4_ALLOCATE, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+/* Give `addr' back to the pool of the network, merged with the free ranges
+ * right before and after it. Returns SQLITE_DONE once done.
+ */
+static int
+ldb_ipv4_free(struct ldb_conn *conn, sqlite3_int64 network_id, sqlite3_int64 addr)
+{
+	sqlite3_stmt	*range;
+	sqlite3_int64	 first;
+	sqlite3_int64	 last;
+	int		 ret;
+
+	first = last = addr;
+
+	ret = ldb_run(conn, STMT_IPV4_RANGE_FIND, &range, network_id, addr);
+	if (ret == SQLITE_ROW && sqlite3_column_int64(range, 1) == addr - 1) {
+		first = sqlite3_column_int64(range, 0);
+		sqlite3_reset(range);
+		ret = ldb_run(conn, STMT_IPV4_RANGE_DEL, NULL, network_id, first);
+	}
+	sqlite3_reset(range);
+	if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+		return (ret);
+
+	ret = ldb_run(conn, STMT_IPV4_RANGE_GET, &range, network_id, addr + 1);
+	if (ret == SQLITE_ROW) {
+		last = sqlite3_column_int64(range, 1);
+		sqlite3_reset(range);
+		ret = ldb_run(conn, STMT_IPV4_RANGE_DEL, NULL, network_id, addr + 1);
+	}
+	sqlite3_reset(range);
+	if (ret != SQLITE_DONE)
+		return (ret);
+
+	return (ldb_run(conn, STMT_IPV4_RANGE_ADD, NULL, network_id, first, last));
+}
+
+/* Give the address of `node_uid' back to the pool. */
+int
+ldb_ipv4_release(struct ldb_ctx *ctx, const char *network_uid, const char *node_uid)
+{
+	struct ldb_conn	*conn;
+	sqlite3_stmt	*stmt;
+	sqlite3_int64	 network_id;
+	sqlite3_int64	 node_id;
+	sqlite3_int64	 addr;
+	int		 sp = 0;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, NULL, network_uid)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	ret = ldb_network_id(conn, network_uid, &network_id);
+	if (ret == SQLITE_ROW)
+		ret = ldb_node_id(conn, node_uid, network_id, &node_id);
+	if (ret == SQLITE_ROW)
+		ret = ldb_savepoint(conn);
+	else if (ret == SQLITE_DONE)
+		goto none;
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+	sp = 1;
+
+	ret = ldb_run(conn, STMT_IPV4_RELEASE, &stmt, network_id, node_id);
+	if (ret == SQLITE_DONE) {
+		ldb_savepoint_release(conn);
+		goto none;
+	}
+	if (ret != SQLITE_ROW) {
+		line = __LINE__;
+		goto error;
+	}
+
+	addr = sqlite3_column_int64(stmt, 0);
+	sqlite3_reset(stmt);
+
+	ret = ldb_ipv4_free(conn, network_id, addr);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_savepoint_release(conn);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+none:
+	/* Or nothing allocated to this node. */
+	ldb_stats_ipv4_range(ctx, conn, t0);
+	ldb_stats_end(ctx, conn, CALL_IPV4_RELEASE, STMT_IPV4_RELEASE, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	if (sp)
+		ldb_savepoint_rollback(conn);
+	ldb_stats_ipv4_range(ctx, conn, t0);
+	ldb_stats_end(ctx, conn, CALL_IPV4_RELEASE, STMT_IPV4_RELEASE, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+/* Drop the allocated addresses and the pool of the network. */
+int
+ldb_ipv4_delete(struct ldb_ctx *ctx, const char *network_uid)
+{
+	struct ldb_conn	*conn;
+	sqlite3_int64	 network_id = 0;
+	int		 sp = 0;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, NULL, network_uid)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	/* An unknown network has nothing to delete, id 0 matches no row. */
+	ret = ldb_network_id(conn, network_uid, &network_id);
+	if (ret != SQLITE_ROW && ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_savepoint(conn);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+	sp = 1;
+
+	ret = ldb_run(conn, STMT_IPV4_DELETE, NULL, network_id);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_run(conn, STMT_IPV4_POOL_DELETE, NULL, network_id);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_savepoint_release(conn);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ldb_stats_ipv4_range(ctx, conn, t0);
+	ldb_stats_end(ctx, conn, CALL_IPV4_DELETE, STMT_IPV4_DELETE, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	if (sp)
+		ldb_savepoint_rollback(conn);
+	ldb_stats_ipv4_range(ctx, conn, t0);
+	ldb_stats_end(ctx, conn, CALL_IPV4_DELETE, STMT_IPV4_DELETE, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+static int
+ldb_ipv4_available_into(struct ldb_ctx *ctx, const char *network_uid,
+	const unsigned char **ipv4_available, struct ldb_arena *arena)
+{
+	const unsigned char	**cols[] = { ipv4_available };
+	struct ldb_thread	*t;
+	struct ldb_conn	*conn;
+	sqlite3_stmt	*stmt;
+	int		 ret;
+	uint64_t	 t0;
+	int		 line;
+
+	if ((ctx = ldb_shard(ctx, NULL, network_uid)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_reader(ctx)) == NULL)
+		return (-1);
+	t = ldb_thread(ctx);
+
+	ret = ldb_run(conn, STMT_IPV4_AVAILABLE, &stmt, network_uid);
+	if (ret != SQLITE_ROW) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_row_take(t, STMT_IPV4_AVAILABLE, stmt, arena, cols, 1);
+	if (ret != SQLITE_OK) {
+		line = __LINE__;
+		goto error;
+	}
+	sqlite3_reset(stmt);
+
+	ldb_stats_end(ctx, conn, CALL_IPV4_AVAILABLE, STMT_IPV4_AVAILABLE, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_IPV4_AVAILABLE, STMT_IPV4_AVAILABLE, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+int
+ldb_ipv4_available(struct ldb_ctx *ctx, const char *network_uid,
+	const unsigned char **ipv4_available)
+{
+	return ldb_ipv4_available_into(ctx, network_uid, ipv4_available, NULL);
+}
+
+int
+ldb_ipv4_available_r(struct ldb_ctx *ctx, const char *network_uid,
+	const unsigned char **ipv4_available, struct ldb_arena *arena)
+{
+	return ldb_ipv4_available_into(ctx, network_uid, ipv4_available, arena);
+}
+
+#define LDB_SWEEP_ROWS	64
+
+/* A lease read by ldb_ipv4_sweep(), status is -1 when the node is gone. */
+struct ldb_lease {
+	sqlite3_int64	rowid;
+	sqlite3_int64	network_id;
+	sqlite3_int64	address;
+	int		status;
+	int		expired;
+	int		stale;
+};
+
+/* Walk the leases from where the last call stopped, in a transaction that
+ * lasts about `budget_ms'. Addresses of deleted nodes, and of nodes offline
+ * whose lease is older than `ttl' seconds, go back to the pool. Leases of
+ * online nodes are renewed once they're half that old, so an address is
+ * only taken from a node offline for at least ttl / 2. Returns how many
+ * addresses were released, or -1.
+ */
+int
+ldb_ipv4_sweep(struct ldb_ctx *ctx, int ttl, int budget_ms)
+{
+	struct ldb_lease	 lease[LDB_SWEEP_ROWS];
+	struct ldb_lease	*l;
+	struct ldb_conn		*conn;
+	sqlite3_stmt		*stmt;
+	sqlite3_int64		 cursor;
+	uint64_t		 deadline;
+	uint64_t		 t0;
+	int			 released = 0;
+	int			 ret;
+	int			 line;
+	int			 n;
+	int			 i;
+
+	if (ctx->nshard > 0) {
+		for (i = 0; i < ctx->nshard; i++) {
+			if ((n = ldb_ipv4_sweep(ctx->shard[i], ttl, budget_ms)) == -1)
+				return (-1);
+			released += n;
+		}
+		return (released);
+	}
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+	deadline = ldb_now_ns() + (uint64_t)budget_ms * 1000000ULL;
+	cursor = ctx->sweep_cursor;
+
+	/* Not within ldb_begin(), the transaction is kept short. */
+	if (sqlite3_get_autocommit(conn->db) == 0) {
+		ret = SQLITE_MISUSE;
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_run(conn, STMT_BEGIN_IMMEDIATE, NULL);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	do {
+		/* Copied out first, the rows are changed as we go. */
+		ret = ldb_run(conn, STMT_IPV4_LEASE_SCAN, &stmt, ctx->sweep_cursor, ttl,
+		    ttl / 2, LDB_SWEEP_ROWS);
+		for (n = 0; ret == SQLITE_ROW && n < LDB_SWEEP_ROWS; n++) {
+			l = &lease[n];
+			l->rowid = sqlite3_column_int64(stmt, 0);
+			l->network_id = sqlite3_column_int64(stmt, 1);
+			l->address = sqlite3_column_int64(stmt, 2);
+			l->status = (sqlite3_column_type(stmt, 3) == SQLITE_NULL) ? -1 :
+			    sqlite3_column_int(stmt, 3);
+			l->expired = sqlite3_column_int(stmt, 4);
+			l->stale = sqlite3_column_int(stmt, 5);
+			ret = sqlite3_step(stmt);
+		}
+		sqlite3_reset(stmt);
+		if (ret != SQLITE_DONE) {
+			line = __LINE__;
+			goto rollback;
+		}
+
+		for (i = 0; i < n; i++) {
+			l = &lease[i];
+			ret = SQLITE_DONE;
+			if (l->status == -1 || (l->status == 0 && l->expired)) {
+				ret = ldb_run(conn, STMT_IPV4_LEASE_DEL, NULL, l->rowid);
+				if (ret == SQLITE_DONE)
+					ret = ldb_ipv4_free(conn, l->network_id, l->address);
+				released++;
+			} else if (l->status != 0 && l->stale)
+				ret = ldb_run(conn, STMT_IPV4_LEASE_RENEW, NULL, l->rowid);
+			if (ret != SQLITE_DONE) {
+				line = __LINE__;
+				goto rollback;
+			}
+			ctx->sweep_cursor = l->rowid;
+			if (ldb_now_ns() >= deadline)
+				break;
+		}
+
+		/* Past the last lease, the next call starts over. */
+		if (i == n && n < LDB_SWEEP_ROWS) {
+			ctx->sweep_cursor = 0;
+			break;
+		}
+	} while (ldb_now_ns() < deadline);
+
+	ret = ldb_run(conn, STMT_COMMIT, NULL);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto rollback;
+	}
+
+	ldb_stats_ipv4_range(ctx, conn, t0);
+	ldb_stats_end(ctx, conn, CALL_IPV4_SWEEP, STMT_IPV4_LEASE_SCAN, t0, 0);
+	ldb_release(ctx, conn);
+	return (released);
+rollback:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	if (sqlite3_get_autocommit(conn->db) == 0)
+		ldb_run(conn, STMT_ROLLBACK, NULL);
+	ctx->sweep_cursor = cursor;
+	ldb_stats_ipv4_range(ctx, conn, t0);
+	ldb_stats_end(ctx, conn, CALL_IPV4_SWEEP, STMT_IPV4_LEASE_SCAN, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_IPV4_SWEEP, STMT_IPV4_LEASE_SCAN, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+/* Start a transaction on the writer. The calling thread owns the writer,
+ * every other writer blocks, until ldb_commit() or ldb_rollback().
+ */
+static int
+ldb_txn_begin(struct ldb_ctx *ctx, int mode)
+{
+	struct ldb_thread	*t;
+	struct ldb_conn	*conn;
+	int		 ret;
+	int		 line;
+	uint64_t	 t0;
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((t = ldb_thread(ctx)) == NULL)
+		return (-1);
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	if (t->txn) {
+		ret = SQLITE_MISUSE;
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_run(conn, (mode == LDB_TXN_IMMEDIATE) ? STMT_BEGIN_IMMEDIATE :
+	    STMT_BEGIN_DEFERRED, NULL);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	/* Keep the writer until the transaction ends. */
+	t->txn = 1;
+
+	ldb_stats_end(ctx, conn, CALL_BEGIN, -1, t0, 0);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_BEGIN, -1, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+/* With shards, a transaction on the directory, then one per shard: each
+ * of them commits on its own. The directory comes first, as in
+ * ldb_shard_network_create().
+ */
+int
+ldb_begin(struct ldb_ctx *ctx, int mode)
+{
+	int	i;
+
+	if (ldb_txn_begin(ctx, mode) == -1)
+		return (-1);
+
+	for (i = 0; i < ctx->nshard; i++) {
+		if (ldb_begin(ctx->shard[i], mode) == -1) {
+			ldb_rollback(ctx);
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/* COMMIT or ROLLBACK the transaction started by ldb_begin(). If the
+ * transaction is still open afterwards, SQLITE_BUSY on COMMIT for instance,
+ * the thread keeps the writer and may retry or roll back.
+ */
+static int
+ldb_end(struct ldb_ctx *ctx, int call, int id)
+{
+	struct ldb_thread	*t;
+	struct ldb_conn	*conn;
+	int		 ret;
+	int		 line;
+	uint64_t	 t0;
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((t = ldb_thread(ctx)) == NULL)
+		return (-1);
+	if (t->txn == 0) {
+		fprintf(stderr, "%s: no transaction\n", __func__);
+		return (-1);
+	}
+	conn = &ctx->writer;
+	ldb_busy_reset(conn);
+
+	ret = ldb_run(conn, id, NULL);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	t->txn = 0;
+	ldb_stats_end(ctx, conn, call, -1, t0, 0);
+	ldb_release(ctx, conn);
+
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, call, -1, t0, -1);
+	if (sqlite3_get_autocommit(conn->db)) {
+		t->txn = 0;
+		ldb_release(ctx, conn);
+	}
+	return (-1);
+}
+
+/* ldb_end() on the shards, then on the directory, where the thread still
+ * has a transaction, so that a COMMIT that failed on some of them can be
+ * retried.
+ */
+static int
+ldb_shards_end(struct ldb_ctx *ctx, int call, int id)
+{
+	struct ldb_thread	*t;
+	int			 ret = 0;
+	int			 i;
+
+	for (i = 0; i < ctx->nshard; i++) {
+		if ((t = ldb_thread(ctx->shard[i])) == NULL)
+			ret = -1;
+		else if (t->txn && ldb_end(ctx->shard[i], call, id) == -1)
+			ret = -1;
+	}
+
+	if ((t = ldb_thread(ctx)) == NULL)
+		ret = -1;
+	else if (t->txn && ldb_end(ctx, call, id) == -1)
+		ret = -1;
+
+	return (ret);
+}
+
+int
+ldb_commit(struct ldb_ctx *ctx)
+{
+	if (ctx->nshard > 0)
+		return (ldb_shards_end(ctx, CALL_COMMIT, STMT_COMMIT));
+	return ldb_end(ctx, CALL_COMMIT, STMT_COMMIT);
+}
+
+int
+ldb_rollback(struct ldb_ctx *ctx)
+{
+	if (ctx->nshard > 0)
+		return (ldb_shards_end(ctx, CALL_ROLLBACK, STMT_ROLLBACK));
+	return ldb_end(ctx, CALL_ROLLBACK, STMT_ROLLBACK);
+}
+
+/* Pin the reader of the calling thread to the current version of the
+ * database: its read calls see that version, whatever the writers commit,
+ * until ldb_read_end(). Writers aren't blocked, but the WAL can't be
+ * checkpointed past a pinned version, keep it short. Not within
+ * ldb_begin(), whose reads are consistent already.
+ */
+int
+ldb_read_begin(struct ldb_ctx *ctx)
+{
+	struct ldb_thread	*t;
+	struct ldb_conn	*conn;
+	sqlite3_stmt	*stmt;
+	int		 ret;
+	int		 line;
+	int		 i;
+	uint64_t	 t0;
+
+	/* One version per shard, they aren't pinned at the same instant. */
+	if (ctx->nshard > 0) {
+		for (i = 0; i < ctx->nshard; i++) {
+			if (ldb_read_begin(ctx->shard[i]) == -1) {
+				ldb_read_end(ctx);
+				return (-1);
+			}
+		}
+		return (0);
+	}
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((t = ldb_thread(ctx)) == NULL)
+		return (-1);
+	if (t->txn || t->snapshot) {
+		fprintf(stderr, "%s: already in a transaction\n", __func__);
+		return (-1);
+	}
+	if ((conn = ldb_reader(ctx)) == NULL)
+		return (-1);
+
+	ret = ldb_run(conn, STMT_READ_BEGIN, NULL);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_run(conn, STMT_READ_PIN, &stmt);
+	sqlite3_reset(stmt);
+	if (ret != SQLITE_ROW) {
+		ldb_run(conn, STMT_READ_END, NULL);
+		line = __LINE__;
+		goto error;
+	}
+	t->snapshot = 1;
+
+	ldb_stats_end(ctx, conn, CALL_READ_BEGIN, -1, t0, 0);
+	ldb_release(ctx, conn);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_READ_BEGIN, -1, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+/* Let the reader see new commits again. */
+int
+ldb_read_end(struct ldb_ctx *ctx)
+{
+	struct ldb_thread	*t;
+	struct ldb_conn	*conn;
+	int		 ret;
+	int		 i;
+	uint64_t	 t0;
+
+	if (ctx->nshard > 0) {
+		ret = 0;
+		for (i = 0; i < ctx->nshard; i++) {
+			if ((t = ldb_thread(ctx->shard[i])) == NULL)
+				ret = -1;
+			else if (t->snapshot && ldb_read_end(ctx->shard[i]) == -1)
+				ret = -1;
+		}
+		return (ret);
+	}
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((t = ldb_thread(ctx)) == NULL)
+		return (-1);
+	if (t->snapshot == 0) {
+		fprintf(stderr, "%s: no snapshot\n", __func__);
+		return (-1);
+	}
+	conn = t->reader;
+
+	ret = ldb_run(conn, STMT_READ_END, NULL);
+	if (ret != SQLITE_DONE)
+		fprintf(stderr, "%s: ret=%d, %s\n", __func__, ret, sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_READ_END, -1, t0, ret == SQLITE_DONE ? 0 : -1);
+
+	/* A read transaction holds no change, it's over either way. */
+	if (sqlite3_get_autocommit(conn->db)) {
+		t->snapshot = 0;
+		ldb_reader_put(ctx, t);
+	}
+	return (ret == SQLITE_DONE ? 0 : -1);
+}
+
+/* Insert `n' nodes in `network_uid' in a single transaction, or a savepoint
+ * when the caller already is in one. A row that can't be inserted doesn't
+ * abort the others, `failed[i]', when not NULL, is set for every row that
+ * failed. Returns the number of rows that failed, -1 if the transaction
+ * itself failed and nothing was inserted: a row whose error rolled the
+ * transaction back ends the batch there.
+ */
+int
+ldb_node_create_batch(struct ldb_ctx *ctx, const char *network_uid, int n,
+	const char **uid, const char **provkey, const char **description,
+	int *failed)
+{
+	struct ldb_conn	*conn;
+	sqlite3_stmt	*stmt = NULL;
+	sqlite3_int64	 network_id;
+	int		 nfailed;
+	int		 own;
+	int		 ret;
+	int		 line;
+	int		 i;
+	uint64_t	 t0;
+
+	if ((ctx = ldb_shard(ctx, NULL, network_uid)) == NULL)
+		return (-1);
+
+	t0 = ldb_stats_start(ctx);
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	own = sqlite3_get_autocommit(conn->db);
+	ret = own ? ldb_run(conn, STMT_BEGIN_IMMEDIATE, NULL) : ldb_savepoint(conn);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_network_id(conn, network_uid, &network_id);
+	if (ret != SQLITE_ROW) {
+		line = __LINE__;
+		goto rollback;
+	}
+
+	/* Bindings survive sqlite3_reset(), network_id is bound once. */
+	if ((stmt = ldb_stmt(conn, STMT_NODE_CREATE)) == NULL) {
+		ret = SQLITE_ERROR;
+		line = __LINE__;
+		goto rollback;
+	}
+	ret = sqlite3_bind_int64(stmt, 1, network_id);
+	if (ret != SQLITE_OK) {
+		line = __LINE__;
+		goto rollback;
+	}
+
+	nfailed = 0;
+	for (i = 0; i < n; i++) {
+		sqlite3_reset(stmt);
+
+		ret = sqlite3_bind_text(stmt, 2, uid[i], -1, NULL);
+		if (ret == SQLITE_OK)
+			ret = sqlite3_bind_text(stmt, 3, provkey[i], -1, NULL);
+		if (ret == SQLITE_OK)
+			ret = sqlite3_bind_text(stmt, 4, description[i], -1, NULL);
+		if (ret == SQLITE_OK)
+			ret = sqlite3_step(stmt);
+
+		if (ret != SQLITE_DONE) {
+			fprintf(stderr, "%s: row %d: ret=%d, %s\n", __func__, i, ret, sqlite3_errmsg(conn->db));
+			nfailed++;
+		}
+		if (failed != NULL)
+			failed[i] = (ret != SQLITE_DONE);
+
+		/* SQLITE_FULL, IOERR... may roll the whole transaction back,
+		 * the next rows would then commit one by one. */
+		if (ret != SQLITE_DONE && sqlite3_get_autocommit(conn->db)) {
+			sqlite3_reset(stmt);
+			line = __LINE__;
+			goto error;
+		}
+	}
+	sqlite3_reset(stmt);
+
+	ret = own ? ldb_run(conn, STMT_COMMIT, NULL) : ldb_savepoint_release(conn);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto rollback;
+	}
+
+	ldb_stats_end(ctx, conn, CALL_NODE_CREATE_BATCH, STMT_NODE_CREATE, t0, 0);
+	ldb_release(ctx, conn);
+	return (nfailed);
+rollback:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	sqlite3_reset(stmt);
+	if (own)
+		ldb_run(conn, STMT_ROLLBACK, NULL);
+	else
+		ldb_savepoint_rollback(conn);
+	ldb_stats_end(ctx, conn, CALL_NODE_CREATE_BATCH, STMT_NODE_CREATE, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	ldb_stats_end(ctx, conn, CALL_NODE_CREATE_BATCH, STMT_NODE_CREATE, t0, -1);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+/* Start, or stop, collecting statistics. Off by default, it then costs a
+ * relaxed load per call.
+ */
+void
+ldb_stats_enable(struct ldb_ctx *ctx, int on)
+{
+	int	i;
+
+	for (i = 0; i < ctx->nshard; i++)
+		ldb_stats_enable(ctx->shard[i], on);
+	__atomic_store_n(&ctx->stats_enabled, on != 0, __ATOMIC_RELAXED);
+}
+
+void
+ldb_stats_reset(struct ldb_ctx *ctx)
+{
+	int	i;
+
+	for (i = 0; i < ctx->nshard; i++)
+		ldb_stats_reset(ctx->shard[i]);
+
+	for (i = 0; i < CALL_MAX; i++)
+		memset(&ctx->stats_call[i], 0, sizeof(ctx->stats_call[i]));
+	for (i = 0; i < STMT_MAX; i++)
+		memset(&ctx->stats_stmt[i], 0, sizeof(ctx->stats_stmt[i]));
+	__atomic_store_n(&ctx->busy, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->busy_wait_ns, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->busy_timeouts, 0, __ATOMIC_RELAXED);
+}
+
+static void
+ldb_stats_add(struct ldb_ctx *ctx, struct ldb_stats *st)
+{
+	int	i;
+	int	b;
+
+	for (i = 0; i < CALL_MAX && i < LDB_STATS_MAX; i++) {
+		st->call[i].name = call_names[i];
+		st->call[i].calls += __atomic_load_n(&ctx->stats_call[i].calls, __ATOMIC_RELAXED);
+		st->call[i].errors += __atomic_load_n(&ctx->stats_call[i].errors, __ATOMIC_RELAXED);
+		st->call[i].time_ns += __atomic_load_n(&ctx->stats_call[i].time_ns, __ATOMIC_RELAXED);
+		for (b = 0; b < LDB_STATS_BUCKETS; b++)
+			st->call[i].hist[b] += __atomic_load_n(&ctx->stats_call[i].hist[b], __ATOMIC_RELAXED);
+	}
+	st->ncall = i;
+
+	for (i = 0; i < STMT_MAX && i < LDB_STATS_MAX; i++) {
+		st->stmt[i].name = stmt_tbl[i].name;
+		st->stmt[i].fullscan_step += __atomic_load_n(&ctx->stats_stmt[i].fullscan_step, __ATOMIC_RELAXED);
+		st->stmt[i].sort += __atomic_load_n(&ctx->stats_stmt[i].sort, __ATOMIC_RELAXED);
+		st->stmt[i].autoindex += __atomic_load_n(&ctx->stats_stmt[i].autoindex, __ATOMIC_RELAXED);
+		st->stmt[i].vm_step += __atomic_load_n(&ctx->stats_stmt[i].vm_step, __ATOMIC_RELAXED);
+	}
+	st->nstmt = i;
+
+	st->busy += __atomic_load_n(&ctx->busy, __ATOMIC_RELAXED);
+	st->busy_wait_ns += __atomic_load_n(&ctx->busy_wait_ns, __ATOMIC_RELAXED);
+	st->busy_timeouts += __atomic_load_n(&ctx->busy_timeouts, __ATOMIC_RELAXED);
+}
+
+/* Copy the statistics into `st', summed over the shards. Counters are read
+ * one at a time, the snapshot isn't atomic as a whole.
+ */
+void
+ldb_stats_get(struct ldb_ctx *ctx, struct ldb_stats *st)
+{
+	int	i;
+
+	memset(st, 0, sizeof(*st));
+	ldb_stats_add(ctx, st);
+	for (i = 0; i < ctx->nshard; i++)
+		ldb_stats_add(ctx->shard[i], st);
+}
+
+void
+ldb_arena_init(struct ldb_arena *arena, void *buf, size_t size)
+{
+	arena->buf = buf;
+	arena->size = size;
+	arena->used = 0;
+}
+
+/* Everything handed out from the arena becomes invalid. */
+void
+ldb_arena_reset(struct ldb_arena *arena)
+{
+	arena->used = 0;
+}
+
+/* Run EXPLAIN QUERY PLAN on every statement and report those that scan a
+ * whole table, build an automatic index or sort in a temp B-tree, or don't
+ * match their stmt_tbl entry. Returns how many statements were reported,
+ * or -1.
+ */
+int
+ldb_plan_check(struct ldb_ctx *ctx)
+{
+	struct ldb_conn		*conn;
+	sqlite3_stmt		*stmt = NULL;
+	const unsigned char	*detail;
+	char			*sql = NULL;
+	int			 ret;
+	int			 line;
+	int			 bad = 0;
+	int			 i;
+
+	for (i = 0; i < ctx->nshard; i++) {
+		if ((ret = ldb_plan_check(ctx->shard[i])) == -1)
+			return (-1);
+		bad += ret;
+	}
+
+	if ((conn = ldb_writer(ctx)) == NULL)
+		return (-1);
+
+	for (i = 0; i < STMT_MAX; i++) {
+		/* Preparing it also checks it against stmt_tbl. */
+		if (ldb_stmt(conn, i) == NULL) {
+			bad++;
+			continue;
+		}
+
+		if ((sql = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", *stmt_tbl[i].sql)) == NULL) {
+			ret = SQLITE_NOMEM;
+			line = __LINE__;
+			goto error;
+		}
+		ret = sqlite3_prepare_v2(conn->db, sql, -1, &stmt, 0);
+		if (ret != SQLITE_OK) {
+			line = __LINE__;
+			goto error;
+		}
+
+		/* Columns are id, parent, notused, detail. */
+		while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+			detail = sqlite3_column_text(stmt, 3);
+			if (detail == NULL)
+				continue;
+			if ((strncmp((const char *)detail, "SCAN ", 5) == 0 &&
+			    strcmp((const char *)detail, "SCAN CONSTANT ROW") != 0) ||
+			    strstr((const char *)detail, "AUTOMATIC") != NULL ||
+			    strstr((const char *)detail, "USE TEMP B-TREE") != NULL) {
+				fprintf(stderr, "%s: %s: %s\n", __func__, stmt_tbl[i].name, detail);
+				bad++;
+			}
+		}
+		if (ret != SQLITE_DONE) {
+			line = __LINE__;
+			goto error;
+		}
+
+		sqlite3_finalize(stmt);
+		stmt = NULL;
+		sqlite3_free(sql);
+		sql = NULL;
+	}
+
+	ldb_release(ctx, conn);
+	return (bad);
+
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, %s\n", line, __func__, ret, sqlite3_errmsg(conn->db));
+	sqlite3_finalize(stmt);
+	sqlite3_free(sql);
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+/* Write queue: an optional thread that drains queued writes and commits them
+ * together, one transaction per batch instead of one per statement. A batch
+ * closes when it holds `batch_max' operations or `delay_ms' after its first
+ * operation was queued. Each operation runs in its own savepoint so a failing
+ * one doesn't take the rest of the batch down, its outcome is reported to the
+ * callback, from the queue thread, once the batch is committed.
+ */
+enum {
+	WOP_CLIENT_CREATE,
+	WOP_NODE_CREATE,
+	WOP_NODE_STATUS_SET,
+	WOP_IPV4_ALLOCATE,
+	WOP_IPV4_RELEASE,
+};
+
+#define LDB_WOP_MAXARG	4
+
+struct ldb_wop {
+	TAILQ_ENTRY(ldb_wop)	 entry;
+	int			 op;
+	int			 iarg;
+	const char		*arg[LDB_WOP_MAXARG];
+	void			(*cb)(int, void *);
+	void			*cb_arg;
+	int			 ret;
+};
+
+TAILQ_HEAD(ldb_wop_list, ldb_wop);
+
+struct ldb_wq {
+	struct ldb_ctx		*ctx;
+	pthread_t		 thread;
+	pthread_mutex_t		 mtx;
+	pthread_cond_t		 cond;
+	struct ldb_wop_list	 queue;
+	int			 len;
+	int			 batch_max;
+	int			 delay_ms;
+	int			 stop;
+	struct timespec		 first;
+};
+
+static int
+ldb_wop_run(struct ldb_ctx *ctx, struct ldb_wop *wop)
+{
+	switch (wop->op) {
+	case WOP_CLIENT_CREATE:
+		return ldb_client_create(ctx, wop->arg[0], wop->arg[1], wop->arg[2]);
+	case WOP_NODE_CREATE:
+		return ldb_node_create(ctx, wop->arg[0], wop->arg[1], wop->arg[2], wop->arg[3]);
+	case WOP_NODE_STATUS_SET:
+		return ldb_node_status_set(ctx, wop->iarg, wop->arg[0], wop->arg[1], wop->arg[2]);
+	case WOP_IPV4_ALLOCATE:
+		return ldb_ipv4_allocate(ctx, wop->arg[0], wop->arg[1], wop->arg[2]);
+	case WOP_IPV4_RELEASE:
+		return ldb_ipv4_release(ctx, wop->arg[0], wop->arg[1]);
+	}
+
+	return (-1);
+}
+
+static void
+ldb_wq_commit(struct ldb_wq *wq, struct ldb_wop_list *batch)
+{
+	struct ldb_ctx	*ctx = wq->ctx;
+	struct ldb_conn	*conn;
+	struct ldb_wop	*wop;
+	int		 ret;
+	int		 line;
+
+	conn = ldb_writer(ctx);
+
+	ret = ldb_run(conn, STMT_BEGIN_IMMEDIATE, NULL);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	/* An operation runs only within its own savepoint, a failure rolls
+	 * back what it did and nothing else. */
+	TAILQ_FOREACH(wop, batch, entry) {
+		ret = ldb_savepoint(conn);
+		if (ret != SQLITE_DONE) {
+			fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", __LINE__, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+			wop->ret = -1;
+			continue;
+		}
+		if ((wop->ret = ldb_wop_run(ctx, wop)) == -1) {
+			ldb_savepoint_rollback(conn);
+			continue;
+		}
+		ret = ldb_savepoint_release(conn);
+		if (ret != SQLITE_DONE) {
+			fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", __LINE__, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+			ldb_savepoint_rollback(conn);
+			wop->ret = -1;
+		}
+	}
+
+	ret = ldb_run(conn, STMT_COMMIT, NULL);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ldb_release(ctx, conn);
+	return;
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	if (sqlite3_get_autocommit(conn->db) == 0)
+		ldb_run(conn, STMT_ROLLBACK, NULL);
+	TAILQ_FOREACH(wop, batch, entry)
+		wop->ret = -1;
+	ldb_release(ctx, conn);
+}
+
+static void *
+ldb_wq_loop(void *arg)
+{
+	struct ldb_wq		*wq = arg;
+	struct ldb_wop_list	 batch;
+	struct ldb_wop		*wop;
+	struct timespec		 deadline;
+	int			 n;
+
+	pthread_mutex_lock(&wq->mtx);
+	for (;;) {
+		while (wq->len == 0 && wq->stop == 0)
+			pthread_cond_wait(&wq->cond, &wq->mtx);
+		if (wq->len == 0 && wq->stop)
+			break;
+
+		/* Give the batch a chance to fill up. */
+		deadline = wq->first;
+		deadline.tv_sec += wq->delay_ms / 1000;
+		deadline.tv_nsec += (wq->delay_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (wq->len < wq->batch_max && wq->stop == 0) {
+			if (pthread_cond_timedwait(&wq->cond, &wq->mtx, &deadline) != 0)
+				break;
+		}
+
+		TAILQ_INIT(&batch);
+		for (n = 0; n < wq->batch_max && (wop = TAILQ_FIRST(&wq->queue)) != NULL; n++) {
+			TAILQ_REMOVE(&wq->queue, wop, entry);
+			TAILQ_INSERT_TAIL(&batch, wop, entry);
+		}
+		wq->len -= n;
+		clock_gettime(CLOCK_REALTIME, &wq->first);
+		pthread_mutex_unlock(&wq->mtx);
+
+		ldb_wq_commit(wq, &batch);
+
+		while ((wop = TAILQ_FIRST(&batch)) != NULL) {
+			TAILQ_REMOVE(&batch, wop, entry);
+			if (wop->cb != NULL)
+				wop->cb(wop->ret, wop->cb_arg);
+			free(wop);
+		}
+
+		pthread_mutex_lock(&wq->mtx);
+	}
+	pthread_mutex_unlock(&wq->mtx);
+
+	return (NULL);
+}
+
+/* Copy the operation and its arguments in a single allocation and queue it. */
+static int
+ldb_wq_push(struct ldb_ctx *ctx, int op, int iarg, int nargs, const char **args,
+	void (*cb)(int, void *), void *cb_arg)
+{
+	struct ldb_wq	*wq = ctx->wq;
+	struct ldb_wop	*wop;
+	size_t		 len[LDB_WOP_MAXARG];
+	size_t		 size;
+	char		*p;
+	int		 i;
+
+	if (wq == NULL) {
+		fprintf(stderr, "%s: write queue not started\n", __func__);
+		return (-1);
+	}
+
+	size = sizeof(*wop);
+	for (i = 0; i < nargs; i++) {
+		len[i] = (args[i] != NULL) ? strlen(args[i]) + 1 : 0;
+		size += len[i];
+	}
+
+	if ((wop = calloc(1, size)) == NULL) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		return (-1);
+	}
+	wop->op = op;
+	wop->iarg = iarg;
+	wop->cb = cb;
+	wop->cb_arg = cb_arg;
+
+	p = (char *)(wop + 1);
+	for (i = 0; i < nargs; i++) {
+		if (args[i] == NULL)
+			continue;
+		memcpy(p, args[i], len[i]);
+		wop->arg[i] = p;
+		p += len[i];
+	}
+
+	pthread_mutex_lock(&wq->mtx);
+	if (wq->stop) {
+		pthread_mutex_unlock(&wq->mtx);
+		free(wop);
+		return (-1);
+	}
+	if (wq->len == 0)
+		clock_gettime(CLOCK_REALTIME, &wq->first);
+	TAILQ_INSERT_TAIL(&wq->queue, wop, entry);
+	wq->len++;
+	pthread_cond_signal(&wq->cond);
+	pthread_mutex_unlock(&wq->mtx);
+
+	return (0);
+}
+
+int
+ldb_wq_client_create(struct ldb_ctx *ctx, const char *email, const char *password,
+	const char *apikey, void (*cb)(int, void *), void *cb_arg)
+{
+	const char	*args[] = { email, password, apikey };
+
+	if ((ctx = ldb_shard(ctx, email, NULL)) == NULL)
+		return (-1);
+
+	return ldb_wq_push(ctx, WOP_CLIENT_CREATE, 0, 3, args, cb, cb_arg);
+}
+
+int
+ldb_wq_node_create(struct ldb_ctx *ctx, const char *network_uid, const char *uid,
+	const char *provkey, const char *description,
+	void (*cb)(int, void *), void *cb_arg)
+{
+	const char	*args[] = { network_uid, uid, provkey, description };
+
+	if ((ctx = ldb_shard(ctx, NULL, network_uid)) == NULL)
+		return (-1);
+
+	return ldb_wq_push(ctx, WOP_NODE_CREATE, 0, 4, args, cb, cb_arg);
+}
+
+int
+ldb_wq_node_status_set(struct ldb_ctx *ctx, int status, const char *ipsrc,
+	const char *node_uid, const char *network_uid,
+	void (*cb)(int, void *), void *cb_arg)
+{
+	const char	*args[] = { ipsrc, node_uid, network_uid };
+
+	if ((ctx = ldb_shard(ctx, NULL, network_uid)) == NULL)
+		return (-1);
+
+	return ldb_wq_push(ctx, WOP_NODE_STATUS_SET, status, 3, args, cb, cb_arg);
+}
+
+int
+ldb_wq_ipv4_allocate(struct ldb_ctx *ctx, const char *network_uid, const char *node_uid,
+	const char *address, void (*cb)(int, void *), void *cb_arg)
+{
+	const char	*args[] = { network_uid, node_uid, address };
+
+	if ((ctx = ldb_shard(ctx, NULL, network_uid)) == NULL)
+		return (-1);
+
+	return ldb_wq_push(ctx, WOP_IPV4_ALLOCATE, 0, 3, args, cb, cb_arg);
+}
+
+int
+ldb_wq_ipv4_release(struct ldb_ctx *ctx, const char *network_uid, const char *node_uid,
+	void (*cb)(int, void *), void *cb_arg)
+{
+	const char	*args[] = { network_uid, node_uid };
+
+	if ((ctx = ldb_shard(ctx, NULL, network_uid)) == NULL)
+		return (-1);
+
+	return ldb_wq_push(ctx, WOP_IPV4_RELEASE, 0, 2, args, cb, cb_arg);
+}
+
+/* Stop the queue thread once every queued operation has been committed. */
+void
+ldb_wq_stop(struct ldb_ctx *ctx)
+{
+	struct ldb_wq	*wq = ctx->wq;
+	int		 i;
+
+	for (i = 0; i < ctx->nshard; i++)
+		ldb_wq_stop(ctx->shard[i]);
+	if (wq == NULL)
+		return;
+
+	pthread_mutex_lock(&wq->mtx);
+	wq->stop = 1;
+	pthread_cond_signal(&wq->cond);
+	pthread_mutex_unlock(&wq->mtx);
+
+	pthread_join(wq->thread, NULL);
+
+	pthread_cond_destroy(&wq->cond);
+	pthread_mutex_destroy(&wq->mtx);
+	free(wq);
+	ctx->wq = NULL;
+}
+
+int
+ldb_wq_start(struct ldb_ctx *ctx, int batch_max, int delay_ms)
+{
+	struct ldb_wq	*wq;
+	int		 i;
+
+	/* A queue per shard, the calls are routed before being queued. */
+	if (ctx->nshard > 0) {
+		for (i = 0; i < ctx->nshard; i++) {
+			if (ldb_wq_start(ctx->shard[i], batch_max, delay_ms) == -1) {
+				ldb_wq_stop(ctx);
+				return (-1);
+			}
+		}
+		return (0);
+	}
+
+	if (ctx->wq != NULL || batch_max < 1 || delay_ms < 0)
+		return (-1);
+
+	if ((wq = calloc(1, sizeof(*wq))) == NULL) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		return (-1);
+	}
+	wq->ctx = ctx;
+	wq->batch_max = batch_max;
+	wq->delay_ms = delay_ms;
+	TAILQ_INIT(&wq->queue);
+	pthread_mutex_init(&wq->mtx, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+
+	if (pthread_create(&wq->thread, NULL, ldb_wq_loop, wq) != 0) {
+		fprintf(stderr, "%s: pthread_create\n", __func__);
+		pthread_cond_destroy(&wq->cond);
+		pthread_mutex_destroy(&wq->mtx);
+		free(wq);
+		return (-1);
+	}
+	ctx->wq = wq;
+
+	return (0);
+}
+
+/* Asynchronous calls: the blocking functions run on a pool of worker
+ * threads, each completed call is put on a completion queue and the eventfd
+ * is signalled. The event loop then runs the callbacks with
+ * ldb_async_dispatch(), from its own thread. Results are copied into an
+ * arena of the call, as the *_r functions do.
+ */
+enum {
+	AOP_CLIENT_AUTH,
+	AOP_NETWORK_GET,
+	AOP_NETWORK_EMBASSY_GET,
+	AOP_NODE_CREATE,
+	AOP_NODE_DELETE,
+	AOP_NODE_STATUS_SET,
+	AOP_IPV4_ALLOCATE,
+	AOP_IPV4_RELEASE,
+	AOP_IPV4_AVAILABLE,
+};
+
+#define LDB_AOP_MAXARG	4
+#define LDB_AOP_ARENA	8192
+
+struct ldb_aop {
+	TAILQ_ENTRY(ldb_aop)	 entry;
+	int			 op;
+	int			 iarg;
+	const char		*arg[LDB_AOP_MAXARG];
+	void			(*cb)(const struct ldb_async_result *, void *);
+	void			*cb_arg;
+	struct ldb_async_result	 res;
+	struct ldb_arena	 arena;
+};
+
+TAILQ_HEAD(ldb_aop_list, ldb_aop);
+
+struct ldb_as {
+	struct ldb_ctx		*ctx;
+	pthread_t		*thread;
+	int			 nthread;
+	pthread_mutex_t		 mtx;
+	pthread_cond_t		 cond;
+	struct ldb_aop_list	 queue;
+	struct ldb_aop_list	 done;
+	int			 fd;
+	int			 stop;
+};
+
+static void
+ldb_aop_run(struct ldb_ctx *ctx, struct ldb_aop *aop)
+{
+	struct ldb_async_result	*res = &aop->res;
+
+	switch (aop->op) {
+	case AOP_CLIENT_AUTH:
+		res->ret = ldb_client_auth(ctx, aop->arg[0], aop->arg[1]);
+		break;
+	case AOP_NETWORK_GET:
+		res->ret = ldb_network_get_r(ctx, aop->arg[0], aop->arg[1], &res->str[0],
+		    &res->str[1], &res->str[2], &aop->arena);
+		break;
+	case AOP_NETWORK_EMBASSY_GET:
+		res->ret = ldb_network_embassy_get_r(ctx, aop->arg[0], &res->str[0],
+		    &res->str[1], &res->serial, &aop->arena);
+		break;
+	case AOP_NODE_CREATE:
+		res->ret = ldb_node_create(ctx, aop->arg[0], aop->arg[1], aop->arg[2],
+		    aop->arg[3]);
+		break;
+	case AOP_NODE_DELETE:
+		res->ret = ldb_node_delete_r(ctx, aop->arg[0], aop->arg[1], aop->arg[2],
+		    aop->arg[3], &res->str[0], &res->str[1], &aop->arena);
+		break;
+	case AOP_NODE_STATUS_SET:
+		res->ret = ldb_node_status_set(ctx, aop->iarg, aop->arg[0], aop->arg[1],
+		    aop->arg[2]);
+		break;
+	case AOP_IPV4_ALLOCATE:
+		res->ret = ldb_ipv4_allocate(ctx, aop->arg[0], aop->arg[1], aop->arg[2]);
+		break;
+	case AOP_IPV4_RELEASE:
+		res->ret = ldb_ipv4_release(ctx, aop->arg[0], aop->arg[1]);
+		break;
+	case AOP_IPV4_AVAILABLE:
+		res->ret = ldb_ipv4_available_r(ctx, aop->arg[0], &res->str[0], &aop->arena);
+		break;
+	default:
+		res->ret = -1;
+		break;
+	}
+}
+
+static void *
+ldb_async_loop(void *arg)
+{
+	struct ldb_as	*as = arg;
+	struct ldb_aop	*aop;
+
+	pthread_mutex_lock(&as->mtx);
+	for (;;) {
+		while (TAILQ_EMPTY(&as->queue) && as->stop == 0)
+			pthread_cond_wait(&as->cond, &as->mtx);
+		if ((aop = TAILQ_FIRST(&as->queue)) == NULL)
+			break;
+		TAILQ_REMOVE(&as->queue, aop, entry);
+		pthread_mutex_unlock(&as->mtx);
+
+		ldb_aop_run(as->ctx, aop);
+
+		pthread_mutex_lock(&as->mtx);
+		TAILQ_INSERT_TAIL(&as->done, aop, entry);
+		eventfd_write(as->fd, 1);
+	}
+	pthread_mutex_unlock(&as->mtx);
+
+	return (NULL);
+}
+
+/* Copy the call, its arguments and room for its results in a single
+ * allocation and queue it.
+ */
+static int
+ldb_async_push(struct ldb_ctx *ctx, int op, int iarg, int nargs, const char **args,
+	size_t arena_size, void (*cb)(const struct ldb_async_result *, void *), void *cb_arg)
+{
+	struct ldb_as	*as = ctx->as;
+	struct ldb_aop	*aop;
+	size_t		 len[LDB_AOP_MAXARG];
+	size_t		 size;
+	char		*p;
+	int		 i;
+
+	if (as == NULL) {
+		fprintf(stderr, "%s: asynchronous calls not started\n", __func__);
+		return (-1);
+	}
+
+	size = sizeof(*aop) + arena_size;
+	for (i = 0; i < nargs; i++) {
+		len[i] = (args[i] != NULL) ? strlen(args[i]) + 1 : 0;
+		size += len[i];
+	}
+
+	if ((aop = calloc(1, size)) == NULL) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		return (-1);
+	}
+	aop->op = op;
+	aop->iarg = iarg;
+	aop->cb = cb;
+	aop->cb_arg = cb_arg;
+
+	p = (char *)(aop + 1);
+	ldb_arena_init(&aop->arena, p, arena_size);
+	p += arena_size;
+	for (i = 0; i < nargs; i++) {
+		if (args[i] == NULL)
+			continue;
+		memcpy(p, args[i], len[i]);
+		aop->arg[i] = p;
+		p += len[i];
+	}
+
+	pthread_mutex_lock(&as->mtx);
+	if (as->stop) {
+		pthread_mutex_unlock(&as->mtx);
+		free(aop);
+		return (-1);
+	}
+	TAILQ_INSERT_TAIL(&as->queue, aop, entry);
+	pthread_cond_signal(&as->cond);
+	pthread_mutex_unlock(&as->mtx);
+
+	return (0);
+}
+
+int
+ldb_async_client_auth(struct ldb_ctx *ctx, const char *email, const char *apikey,
+	void (*cb)(const struct ldb_async_result *, void *), void *cb_arg)
+{
+	const char	*args[] = { email, apikey };
+
+	return ldb_async_push(ctx, AOP_CLIENT_AUTH, 0, 2, args, 0, cb, cb_arg);
+}
+
+int
+ldb_async_network_get(struct ldb_ctx *ctx, const char *email, const char *description,
+	void (*cb)(const struct ldb_async_result *, void *), void *cb_arg)
+{
+	const char	*args[] = { email, description };
+
+	return ldb_async_push(ctx, AOP_NETWORK_GET, 0, 2, args, LDB_AOP_ARENA, cb, cb_arg);
+}
+
+int
+ldb_async_network_embassy_get(struct ldb_ctx *ctx, const char *uid,
+	void (*cb)(const struct ldb_async_result *, void *), void *cb_arg)
+{
+	const char	*args[] = { uid };
+
+	return ldb_async_push(ctx, AOP_NETWORK_EMBASSY_GET, 0, 1, args, LDB_AOP_ARENA, cb, cb_arg);
+}
+
+int
+ldb_async_node_create(struct ldb_ctx *ctx, const char *network_uid, const char *uid,
+	const char *provkey, const char *description,
+	void (*cb)(const struct ldb_async_result *, void *), void *cb_arg)
+{
+	const char	*args[] = { network_uid, uid, provkey, description };
+
+	return ldb_async_push(ctx, AOP_NODE_CREATE, 0, 4, args, 0, cb, cb_arg);
+}
+
+int
+ldb_async_node_delete(struct ldb_ctx *ctx, const char *node_description,
+	const char *network_description, const char *email, const char *apikey,
+	void (*cb)(const struct ldb_async_result *, void *), void *cb_arg)
+{
+	const char	*args[] = { node_description, network_description, email, apikey };
+
+	return ldb_async_push(ctx, AOP_NODE_DELETE, 0, 4, args, LDB_AOP_ARENA, cb, cb_arg);
+}
+
+int
+ldb_async_node_status_set(struct ldb_ctx *ctx, int status, const char *ipsrc,
+	const char *node_uid, const char *network_uid,
+	void (*cb)(const struct ldb_async_result *, void *), void *cb_arg)
+{
+	const char	*args[] = { ipsrc, node_uid, network_uid };
+
+	return ldb_async_push(ctx, AOP_NODE_STATUS_SET, status, 3, args, 0, cb, cb_arg);
+}
+
+int
+ldb_async_ipv4_allocate(struct ldb_ctx *ctx, const char *network_uid, const char *node_uid,
+	const char *address, void (*cb)(const struct ldb_async_result *, void *), void *cb_arg)
+{
+	const char	*args[] = { network_uid, node_uid, address };
+
+	return ldb_async_push(ctx, AOP_IPV4_ALLOCATE, 0, 3, args, 0, cb, cb_arg);
+}
+
+int
+ldb_async_ipv4_release(struct ldb_ctx *ctx, const char *network_uid, const char *node_uid,
+	void (*cb)(const struct ldb_async_result *, void *), void *cb_arg)
+{
+	const char	*args[] = { network_uid, node_uid };
+
+	return ldb_async_push(ctx, AOP_IPV4_RELEASE, 0, 2, args, 0, cb, cb_arg);
+}
+
+int
+ldb_async_ipv4_available(struct ldb_ctx *ctx, const char *network_uid,
+	void (*cb)(const struct ldb_async_result *, void *), void *cb_arg)
+{
+	const char	*args[] = { network_uid };
+
+	return ldb_async_push(ctx, AOP_IPV4_AVAILABLE, 0, 1, args, LDB_AOP_ARENA, cb, cb_arg);
+}
+
+/* The eventfd to watch, readable when calls completed. */
+int
+ldb_async_fd(struct ldb_ctx *ctx)
+{
+	return ((ctx->as != NULL) ? ctx->as->fd : -1);
+}
+
+/* Run the callbacks of the completed calls, returns how many. */
+int
+ldb_async_dispatch(struct ldb_ctx *ctx)
+{
+	struct ldb_as		*as = ctx->as;
+	struct ldb_aop_list	 done;
+	struct ldb_aop		*aop;
+	eventfd_t		 v;
+	int			 n = 0;
+
+	if (as == NULL)
+		return (-1);
+
+	/* Before the queue, a call completing meanwhile signals again. */
+	eventfd_read(as->fd, &v);
+
+	TAILQ_INIT(&done);
+	pthread_mutex_lock(&as->mtx);
+	TAILQ_CONCAT(&done, &as->done, entry);
+	pthread_mutex_unlock(&as->mtx);
+
+	while ((aop = TAILQ_FIRST(&done)) != NULL) {
+		TAILQ_REMOVE(&done, aop, entry);
+		if (aop->cb != NULL)
+			aop->cb(&aop->res, aop->cb_arg);
+		free(aop);
+		n++;
+	}
+
+	return (n);
+}
+
+/* Wait for the calls already submitted and run their callbacks, from the
+ * thread that dispatches them.
+ */
+void
+ldb_async_stop(struct ldb_ctx *ctx)
+{
+	struct ldb_as	*as = ctx->as;
+	int		 i;
+
+	if (as == NULL)
+		return;
+
+	pthread_mutex_lock(&as->mtx);
+	as->stop = 1;
+	pthread_cond_broadcast(&as->cond);
+	pthread_mutex_unlock(&as->mtx);
+
+	for (i = 0; i < as->nthread; i++)
+		pthread_join(as->thread[i], NULL);
+
+	ldb_async_dispatch(ctx);
+	ctx->as = NULL;
+
+	close(as->fd);
+	pthread_cond_destroy(&as->cond);
+	pthread_mutex_destroy(&as->mtx);
+	free(as->thread);
+	free(as);
+}
+
+/* Start `nworkers' threads running the ldb_async_* calls. Calls complete
+ * in any order. Workers check readers out of the pool per call like any
+ * thread, more workers than readers only queue their reads behind one
+ * another.
+ */
+int
+ldb_async_start(struct ldb_ctx *ctx, int nworkers)
+{
+	struct ldb_as	*as;
+
+	if (ctx->as != NULL || nworkers < 1)
+		return (-1);
+
+	if ((as = calloc(1, sizeof(*as))) == NULL ||
+	    (as->thread = calloc(nworkers, sizeof(*as->thread))) == NULL) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		free(as);
+		return (-1);
+	}
+	as->ctx = ctx;
+	TAILQ_INIT(&as->queue);
+	TAILQ_INIT(&as->done);
+	pthread_mutex_init(&as->mtx, NULL);
+	pthread_cond_init(&as->cond, NULL);
+	ctx->as = as;
+
+	if ((as->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		fprintf(stderr, "%s: eventfd\n", __func__);
+		ctx->as = NULL;
+		pthread_cond_destroy(&as->cond);
+		pthread_mutex_destroy(&as->mtx);
+		free(as->thread);
+		free(as);
+		return (-1);
+	}
+
+	for (as->nthread = 0; as->nthread < nworkers; as->nthread++) {
+		if (pthread_create(&as->thread[as->nthread], NULL, ldb_async_loop, as) != 0) {
+			fprintf(stderr, "%s: pthread_create\n", __func__);
+			ldb_async_stop(ctx);
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/* A heartbeat taken out of the presence buffer, to be written. */
+struct ldb_presence_rec {
+	LIST_ENTRY(ldb_presence_rec)	 entry;
+	uint64_t			 seq;
+	int				 status;
+	char				 ipsrc[LDB_PRESENCE_IPSRC];
+	char				*network_uid;
+	char				 uid[];
+};
+
+LIST_HEAD(ldb_presence_rec_list, ldb_presence_rec);
+
+/* Mark the heartbeats of a failed flush dirty again. The buffer holds the
+ * latest values, newer than the records if they changed in the meantime.
+ */
+static void
+ldb_presence_redirty(struct ldb_pr *pr, struct ldb_presence_rec_list *recs)
+{
+	struct ldb_presence_shard	*sh;
+	struct ldb_presence_rec		*rec;
+	struct ldb_presence		*p;
+	uint64_t			 h;
+
+	LIST_FOREACH(rec, recs, entry) {
+		h = ldb_presence_hash(rec->uid, rec->network_uid);
+		sh = &pr->shard[h % LDB_PRESENCE_SHARDS];
+		pthread_mutex_lock(&sh->mtx);
+		p = ldb_presence_find(sh, h, rec->uid, rec->network_uid);
+		if (p != NULL && p->dirty == 0) {
+			p->dirty = 1;
+			LIST_INSERT_HEAD(&sh->dirty, p, dirty_entry);
+		}
+		pthread_mutex_unlock(&sh->mtx);
+	}
+}
+
+/* Whether `rec' still is the last change of its node: not written
+ * directly nor changed again since it was copied out. Called with the
+ * writer held, that direct writes take before forgetting the node.
+ */
+static int
+ldb_presence_current(struct ldb_pr *pr, struct ldb_presence_rec *rec)
+{
+	struct ldb_presence_shard	*sh;
+	struct ldb_presence		*p;
+	uint64_t			 h;
+	int				 ret;
+
+	h = ldb_presence_hash(rec->uid, rec->network_uid);
+	sh = &pr->shard[h % LDB_PRESENCE_SHARDS];
+	pthread_mutex_lock(&sh->mtx);
+	p = ldb_presence_find(sh, h, rec->uid, rec->network_uid);
+	ret = (p != NULL && p->seq == rec->seq);
+	pthread_mutex_unlock(&sh->mtx);
+
+	return (ret);
+}
+
+/* Write every changed heartbeat in a single transaction. Shards are only
+ * locked while their dirty rows are copied out, heartbeats keep coming in
+ * during the write. A row changed since, in the buffer or directly, is
+ * skipped: the newer value is dirty or already written. Once committed,
+ * the nodes that didn't change again are evicted, the database holds
+ * their status. Returns how many rows were written, or -1.
+ */
+static int
+ldb_presence_commit(struct ldb_pr *pr)
+{
+	struct ldb_ctx			*ctx = pr->ctx;
+	struct ldb_presence_rec_list	 recs;
+	struct ldb_presence_shard	*sh;
+	struct ldb_presence_rec		*rec;
+	struct ldb_presence		*p;
+	struct ldb_conn			*conn;
+	uint64_t			 h;
+	size_t				 ulen;
+	size_t				 nlen;
+	int				 n = 0;
+	int				 ret;
+	int				 line;
+	int				 i;
+
+	LIST_INIT(&recs);
+	for (i = 0; i < LDB_PRESENCE_SHARDS; i++) {
+		sh = &pr->shard[i];
+		pthread_mutex_lock(&sh->mtx);
+		while ((p = LIST_FIRST(&sh->dirty)) != NULL) {
+			ulen = strlen(p->uid) + 1;
+			nlen = strlen(p->network_uid) + 1;
+			/* Left dirty, the next tick retries. */
+			if ((rec = malloc(sizeof(*rec) + ulen + nlen)) == NULL)
+				break;
+			rec->seq = p->seq;
+			rec->status = p->status;
+			memcpy(rec->ipsrc, p->ipsrc, sizeof(rec->ipsrc));
+			memcpy(rec->uid, p->uid, ulen);
+			rec->network_uid = rec->uid + ulen;
+			memcpy(rec->network_uid, p->network_uid, nlen);
+			LIST_INSERT_HEAD(&recs, rec, entry);
+			LIST_REMOVE(p, dirty_entry);
+			p->dirty = 0;
+			n++;
+		}
+		pthread_mutex_unlock(&sh->mtx);
+	}
+
+	if (n == 0)
+		return (0);
+
+	conn = ldb_writer(ctx);
+
+	ret = ldb_run(conn, STMT_BEGIN_IMMEDIATE, NULL);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	n = 0;
+	LIST_FOREACH(rec, &recs, entry) {
+		if (ldb_presence_current(pr, rec) == 0)
+			continue;
+		ret = ldb_run(conn, STMT_NODE_STATUS_SET, NULL, rec->status, rec->ipsrc,
+		    rec->uid, rec->network_uid);
+		if (ret != SQLITE_DONE) {
+			line = __LINE__;
+			goto error;
+		}
+		n++;
+	}
+
+	ret = ldb_run(conn, STMT_COMMIT, NULL);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	/* Still under the writer: no other flush is writing, and an entry
+	 * still at `rec->seq' has nothing newer to lose.
+	 */
+	while ((rec = LIST_FIRST(&recs)) != NULL) {
+		h = ldb_presence_hash(rec->uid, rec->network_uid);
+		sh = &pr->shard[h % LDB_PRESENCE_SHARDS];
+		pthread_mutex_lock(&sh->mtx);
+		p = ldb_presence_find(sh, h, rec->uid, rec->network_uid);
+		if (p != NULL && p->dirty == 0 && p->seq == rec->seq) {
+			LIST_REMOVE(p, entry);
+			free(p);
+		}
+		pthread_mutex_unlock(&sh->mtx);
+		LIST_REMOVE(rec, entry);
+		free(rec);
+	}
+	ldb_release(ctx, conn);
+	return (n);
+
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	if (sqlite3_get_autocommit(conn->db) == 0)
+		ldb_run(conn, STMT_ROLLBACK, NULL);
+	ldb_release(ctx, conn);
+	ldb_presence_redirty(pr, &recs);
+	while ((rec = LIST_FIRST(&recs)) != NULL) {
+		LIST_REMOVE(rec, entry);
+		free(rec);
+	}
+	return (-1);
+}
+
+static void *
+ldb_presence_loop(void *arg)
+{
+	struct ldb_pr	*pr = arg;
+	struct timespec	 deadline;
+
+	pthread_mutex_lock(&pr->mtx);
+	while (pr->stop == 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += pr->tick_ms / 1000;
+		deadline.tv_nsec += (pr->tick_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (pr->stop == 0) {
+			if (pthread_cond_timedwait(&pr->cond, &pr->mtx, &deadline) != 0)
+				break;
+		}
+		pthread_mutex_unlock(&pr->mtx);
+
+		ldb_presence_commit(pr);
+
+		pthread_mutex_lock(&pr->mtx);
+	}
+	pthread_mutex_unlock(&pr->mtx);
+
+	return (NULL);
+}
+
+/* Write the buffered heartbeats now rather than at the next tick. Returns
+ * how many rows were written, or -1.
+ */
+int
+ldb_presence_flush(struct ldb_ctx *ctx)
+{
+	int	n = 0;
+	int	ret;
+	int	i;
+
+	if (ctx->nshard > 0) {
+		for (i = 0; i < ctx->nshard; i++) {
+			if ((ret = ldb_presence_flush(ctx->shard[i])) == -1)
+				n = -1;
+			else if (n != -1)
+				n += ret;
+		}
+		return (n);
+	}
+
+	if (ctx->pr == NULL)
+		return (0);
+
+	return (ldb_presence_commit(ctx->pr));
+}
+
+/* Flush what's left and stop the presence thread, ldb_node_status_set()
+ * writes directly again.
+ */
+void
+ldb_presence_stop(struct ldb_ctx *ctx)
+{
+	struct ldb_pr		*pr = ctx->pr;
+	struct ldb_presence	*p;
+	int			 i;
+	int			 j;
+
+	for (i = 0; i < ctx->nshard; i++)
+		ldb_presence_stop(ctx->shard[i]);
+	if (pr == NULL)
+		return;
+
+	pthread_mutex_lock(&pr->mtx);
+	pr->stop = 1;
+	pthread_cond_signal(&pr->cond);
+	pthread_mutex_unlock(&pr->mtx);
+
+	pthread_join(pr->thread, NULL);
+
+	ldb_presence_commit(pr);
+	ctx->pr = NULL;
+
+	for (i = 0; i < LDB_PRESENCE_SHARDS; i++) {
+		for (j = 0; j < LDB_PRESENCE_BUCKETS; j++) {
+			while ((p = LIST_FIRST(&pr->shard[i].bucket[j])) != NULL) {
+				LIST_REMOVE(p, entry);
+				free(p);
+			}
+		}
+		pthread_mutex_destroy(&pr->shard[i].mtx);
+	}
+	pthread_cond_destroy(&pr->cond);
+	pthread_mutex_destroy(&pr->mtx);
+	free(pr);
+}
+
+/* Buffer ldb_node_status_set() in memory: repeated heartbeats that change
+ * nothing within a tick are dropped, the others are written every `tick_ms'
+ * in a single transaction. Calls made inside ldb_begin() still write directly. A crash
+ * loses at most a tick of heartbeats.
+ */
+int
+ldb_presence_start(struct ldb_ctx *ctx, int tick_ms)
+{
+	struct ldb_pr	*pr;
+	int		 i;
+	int		 j;
+
+	if (ctx->nshard > 0) {
+		for (i = 0; i < ctx->nshard; i++) {
+			if (ldb_presence_start(ctx->shard[i], tick_ms) == -1) {
+				ldb_presence_stop(ctx);
+				return (-1);
+			}
+		}
+		return (0);
+	}
+
+	if (ctx->pr != NULL || tick_ms < 1)
+		return (-1);
+
+	if ((pr = calloc(1, sizeof(*pr))) == NULL) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		return (-1);
+	}
+	pr->ctx = ctx;
+	pr->tick_ms = tick_ms;
+	pthread_mutex_init(&pr->mtx, NULL);
+	pthread_cond_init(&pr->cond, NULL);
+	for (i = 0; i < LDB_PRESENCE_SHARDS; i++) {
+		pthread_mutex_init(&pr->shard[i].mtx, NULL);
+		LIST_INIT(&pr->shard[i].dirty);
+		for (j = 0; j < LDB_PRESENCE_BUCKETS; j++)
+			LIST_INIT(&pr->shard[i].bucket[j]);
+	}
+
+	if (pthread_create(&pr->thread, NULL, ldb_presence_loop, pr) != 0) {
+		fprintf(stderr, "%s: pthread_create\n", __func__);
+		for (i = 0; i < LDB_PRESENCE_SHARDS; i++)
+			pthread_mutex_destroy(&pr->shard[i].mtx);
+		pthread_cond_destroy(&pr->cond);
+		pthread_mutex_destroy(&pr->mtx);
+		free(pr);
+		return (-1);
+	}
+	ctx->pr = pr;
+
+	return (0);
+}
+
+static void *
+ldb_sweep_loop(void *arg)
+{
+	struct ldb_sw	*sw = arg;
+	struct timespec	 deadline;
+
+	pthread_mutex_lock(&sw->mtx);
+	while (sw->stop == 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += sw->interval_ms / 1000;
+		deadline.tv_nsec += (sw->interval_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (sw->stop == 0) {
+			if (pthread_cond_timedwait(&sw->cond, &sw->mtx, &deadline) != 0)
+				break;
+		}
+		if (sw->stop)
+			break;
+		pthread_mutex_unlock(&sw->mtx);
+
+		ldb_ipv4_sweep(sw->ctx, sw->ttl, sw->budget_ms);
+
+		pthread_mutex_lock(&sw->mtx);
+	}
+	pthread_mutex_unlock(&sw->mtx);
+
+	return (NULL);
+}
+
+void
+ldb_sweep_stop(struct ldb_ctx *ctx)
+{
+	struct ldb_sw	*sw = ctx->sw;
+	int		 i;
+
+	for (i = 0; i < ctx->nshard; i++)
+		ldb_sweep_stop(ctx->shard[i]);
+	if (sw == NULL)
+		return;
+
+	pthread_mutex_lock(&sw->mtx);
+	sw->stop = 1;
+	pthread_cond_signal(&sw->cond);
+	pthread_mutex_unlock(&sw->mtx);
+
+	pthread_join(sw->thread, NULL);
+	ctx->sw = NULL;
+
+	pthread_cond_destroy(&sw->cond);
+	pthread_mutex_destroy(&sw->mtx);
+	free(sw);
+}
+
+/* Reclaim the addresses of deleted and offline nodes in the background,
+ * see ldb_ipv4_sweep(). Each `interval_ms' the writer is held about
+ * `budget_ms', a pass over the leases takes as many intervals as needed.
+ */
+int
+ldb_sweep_start(struct ldb_ctx *ctx, int ttl, int budget_ms, int interval_ms)
+{
+	struct ldb_sw	*sw;
+	int		 i;
+
+	if (ctx->nshard > 0) {
+		for (i = 0; i < ctx->nshard; i++) {
+			if (ldb_sweep_start(ctx->shard[i], ttl, budget_ms, interval_ms) == -1) {
+				ldb_sweep_stop(ctx);
+				return (-1);
+			}
+		}
+		return (0);
+	}
+
+	if (ctx->sw != NULL || ttl < 0 || budget_ms < 0 || interval_ms < 1)
+		return (-1);
+
+	if ((sw = calloc(1, sizeof(*sw))) == NULL) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		return (-1);
+	}
+	sw->ctx = ctx;
+	sw->ttl = ttl;
+	sw->budget_ms = budget_ms;
+	sw->interval_ms = interval_ms;
+	pthread_mutex_init(&sw->mtx, NULL);
+	pthread_cond_init(&sw->cond, NULL);
+
+	if (pthread_create(&sw->thread, NULL, ldb_sweep_loop, sw) != 0) {
+		fprintf(stderr, "%s: pthread_create\n", __func__);
+		pthread_cond_destroy(&sw->cond);
+		pthread_mutex_destroy(&sw->mtx);
+		free(sw);
+		return (-1);
+	}
+	ctx->sw = sw;
+
+	return (0);
+}
+
+static const char *ldb_maint_names[LDB_MAINT_MAX] = {
+	[LDB_MAINT_CHECKPOINT]	= "checkpoint",
+	[LDB_MAINT_OPTIMIZE]	= "optimize",
+	[LDB_MAINT_VACUUM]	= "vacuum",
+};
+
+/* Run one slice of maintenance task `task' with the writer held, so that
+ * it never overlaps a write:
+ *  checkpoint	PASSIVE, then TRUNCATE once every frame is in the database,
+ *		unless a reader still needs the WAL;
+ *  optimize	PRAGMA optimize, ANALYZE limited to a sample of each index;
+ *  vacuum	up to `vacuum_pages' free pages given back, counting those
+ *		the freelist lost; auto_vacuum INCREMENTAL databases only,
+ *		elsewhere the slice doesn't run.
+ * Returns 0, or -1 and the slice counts as an error.
+ */
+static int
+ldb_maint_slice(struct ldb_ctx *ctx, int task, int vacuum_pages)
+{
+	struct ldb_conn	*conn;
+	uint64_t	 t0;
+	uint64_t	 ns;
+	int		 pages = 0;
+	int		 mode;
+	int		 before;
+	int		 after = 0;
+	int		 nlog;
+	int		 nckpt;
+	int		 ret;
+	int		 line;
+
+	conn = ldb_writer(ctx);
+	t0 = ldb_now_ns();
+
+	/* Not within a transaction, nor on a read-only database. */
+	if (sqlite3_get_autocommit(conn->db) == 0 || sqlite3_db_readonly(conn->db, "main")) {
+		ret = SQLITE_MISUSE;
+		line = __LINE__;
+		goto error;
+	}
+
+	switch (task) {
+	case LDB_MAINT_CHECKPOINT:
+		ret = sqlite3_wal_checkpoint_v2(conn->db, NULL, SQLITE_CHECKPOINT_PASSIVE,
+		    &nlog, &nckpt);
+		if (ret != SQLITE_OK) {
+			line = __LINE__;
+			goto error;
+		}
+		if (nckpt > 0)
+			pages = nckpt;
+		if (nlog > 0 && nlog == nckpt) {
+			conn->busy_nowait = 1;
+			ret = sqlite3_wal_checkpoint_v2(conn->db, NULL, SQLITE_CHECKPOINT_TRUNCATE,
+			    NULL, NULL);
+			conn->busy_nowait = 0;
+			if (ret != SQLITE_OK && ret != SQLITE_BUSY) {
+				line = __LINE__;
+				goto error;
+			}
+		}
+		break;
+	case LDB_MAINT_OPTIMIZE:
+		/* Every table, the queries ran on the readers. */
+		ret = ldb_pragma(conn, "PRAGMA analysis_limit=400; PRAGMA optimize(0x10002);");
+		if (ret != SQLITE_OK) {
+			line = __LINE__;
+			goto error;
+		}
+		break;
+	case LDB_MAINT_VACUUM:
+		/* incremental_vacuum does nothing unless auto_vacuum is
+		 * INCREMENTAL, the task doesn't apply to such a file. */
+		ret = ldb_pragma_int(conn, "auto_vacuum", &mode);
+		if (ret != SQLITE_OK) {
+			line = __LINE__;
+			goto error;
+		}
+		if (mode != 2) {
+			ldb_release(ctx, conn);
+			return (0);
+		}
+		ret = ldb_pragma_int(conn, "freelist_count", &before);
+		if (ret == SQLITE_OK && before > 0)
+			ret = ldb_pragma(conn, "PRAGMA incremental_vacuum(%d);",
+			    before < vacuum_pages ? before : vacuum_pages);
+		if (ret == SQLITE_OK)
+			ret = ldb_pragma_int(conn, "freelist_count", &after);
+		if (ret != SQLITE_OK) {
+			line = __LINE__;
+			goto error;
+		}
+		pages = before - after;
+		break;
+	default:
+		ret = SQLITE_MISUSE;
+		line = __LINE__;
+		goto error;
+	}
+
+	ns = ldb_now_ns() - t0;
+	ctx->maint.task[task].runs++;
+	ctx->maint.task[task].pages += pages;
+	ctx->maint.task[task].last_ns = ns;
+	ctx->maint.task[task].total_ns += ns;
+	if (ns > ctx->maint.task[task].max_ns)
+		ctx->maint.task[task].max_ns = ns;
+	ldb_release(ctx, conn);
+	return (0);
+error:
+	fprintf(stderr, "line:%d %s: %s: ret=%d, %s\n", line, __func__,
+	    (task >= 0 && task < LDB_MAINT_MAX) ? ldb_maint_names[task] : "?", ret,
+	    sqlite3_errmsg(conn->db));
+	if (task >= 0 && task < LDB_MAINT_MAX)
+		ctx->maint.task[task].errors++;
+	ldb_release(ctx, conn);
+	return (-1);
+}
+
+/* Run a slice of every maintenance task now, idle or not. */
+int
+ldb_maint_run(struct ldb_ctx *ctx, int vacuum_pages)
+{
+	int	ret = 0;
+	int	task;
+	int	i;
+
+	for (i = 0; i < ctx->nshard; i++) {
+		if (ldb_maint_run(ctx->shard[i], vacuum_pages) == -1)
+			ret = -1;
+	}
+
+	for (task = 0; task < LDB_MAINT_MAX; task++) {
+		if (ldb_maint_slice(ctx, task, vacuum_pages) == -1)
+			ret = -1;
+	}
+
+	return (ret);
+}
+
+/* What maintenance did so far, summed over the shards. */
+void
+ldb_maint_report(struct ldb_ctx *ctx, struct ldb_maint_report *report)
+{
+	struct ldb_maint_report	 shard;
+	struct ldb_conn		*conn;
+	int			 task;
+	int			 i;
+
+	conn = ldb_writer(ctx);
+	*report = ctx->maint;
+	ldb_release(ctx, conn);
+	for (task = 0; task < LDB_MAINT_MAX; task++)
+		report->task[task].name = ldb_maint_names[task];
+
+	for (i = 0; i < ctx->nshard; i++) {
+		ldb_maint_report(ctx->shard[i], &shard);
+		for (task = 0; task < LDB_MAINT_MAX; task++) {
+			report->task[task].runs += shard.task[task].runs;
+			report->task[task].errors += shard.task[task].errors;
+			report->task[task].pages += shard.task[task].pages;
+			report->task[task].total_ns += shard.task[task].total_ns;
+			if (shard.task[task].max_ns > report->task[task].max_ns)
+				report->task[task].max_ns = shard.task[task].max_ns;
+			if (shard.task[task].last_ns != 0)
+				report->task[task].last_ns = shard.task[task].last_ns;
+		}
+	}
+}
+
+static void *
+ldb_maint_loop(void *arg)
+{
+	struct ldb_mt	*mt = arg;
+	struct ldb_ctx	*ctx = mt->ctx;
+	struct timespec	 deadline;
+	uint64_t	 idle;
+
+	idle = (uint64_t)mt->idle_ms * 1000000ULL;
+
+	pthread_mutex_lock(&mt->mtx);
+	while (mt->stop == 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += mt->idle_ms / 1000;
+		deadline.tv_nsec += (mt->idle_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (mt->stop == 0) {
+			if (pthread_cond_timedwait(&mt->cond, &mt->mtx, &deadline) != 0)
+				break;
+		}
+		if (mt->stop)
+			break;
+		pthread_mutex_unlock(&mt->mtx);
+
+		if (ldb_now_ns() - __atomic_load_n(&ctx->last_write, __ATOMIC_RELAXED) >= idle) {
+			ldb_maint_slice(ctx, mt->next, mt->vacuum_pages);
+			mt->next = (mt->next + 1) % LDB_MAINT_MAX;
+		}
+
+		pthread_mutex_lock(&mt->mtx);
+	}
+	pthread_mutex_unlock(&mt->mtx);
+
+	return (NULL);
+}
+
+void
+ldb_maint_stop(struct ldb_ctx *ctx)
+{
+	struct ldb_mt	*mt = ctx->mt;
+	int		 i;
+
+	for (i = 0; i < ctx->nshard; i++)
+		ldb_maint_stop(ctx->shard[i]);
+	if (mt == NULL)
+		return;
+
+	pthread_mutex_lock(&mt->mtx);
+	mt->stop = 1;
+	pthread_cond_signal(&mt->cond);
+	pthread_mutex_unlock(&mt->mtx);
+
+	pthread_join(mt->thread, NULL);
+	ctx->mt = NULL;
+
+	pthread_cond_destroy(&mt->cond);
+	pthread_mutex_destroy(&mt->mtx);
+	free(mt);
+}
+
+/* Checkpoint, analyze and vacuum from a background thread while the
+ * database is idle: after `idle_ms' without a write, a slice of the next
+ * task, see ldb_maint_slice(). The directory and each shard have their own.
+ */
+int
+ldb_maint_start(struct ldb_ctx *ctx, int idle_ms, int vacuum_pages)
+{
+	struct ldb_mt	*mt;
+	int		 i;
+
+	for (i = 0; i < ctx->nshard; i++) {
+		if (ldb_maint_start(ctx->shard[i], idle_ms, vacuum_pages) == -1) {
+			ldb_maint_stop(ctx);
+			return (-1);
+		}
+	}
+
+	if (ctx->mt != NULL || idle_ms < 1 || vacuum_pages < 0) {
+		ldb_maint_stop(ctx);
+		return (-1);
+	}
+
+	if ((mt = calloc(1, sizeof(*mt))) == NULL) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		ldb_maint_stop(ctx);
+		return (-1);
+	}
+	mt->ctx = ctx;
+	mt->idle_ms = idle_ms;
+	mt->vacuum_pages = vacuum_pages;
+	pthread_mutex_init(&mt->mtx, NULL);
+	pthread_cond_init(&mt->cond, NULL);
+
+	if (pthread_create(&mt->thread, NULL, ldb_maint_loop, mt) != 0) {
+		fprintf(stderr, "%s: pthread_create\n", __func__);
+		pthread_cond_destroy(&mt->cond);
+		pthread_mutex_destroy(&mt->mtx);
+		free(mt);
+		ldb_maint_stop(ctx);
+		return (-1);
+	}
+	ctx->mt = mt;
+
+	return (0);
+}
+
+static void *
+ldb_backup_loop(void *arg)
+{
+	struct ldb_bk	*bk = arg;
+	struct ldb_ctx	*ctx = bk->ctx;
+	struct ldb_conn	*conn;
+	struct timespec	 deadline;
+	uint64_t	 elapsed;
+	int		 copied;
+	int		 ret;
+
+	for (;;) {
+		conn = ldb_writer(ctx);
+		ret = sqlite3_backup_step(bk->backup, bk->pages);
+		ldb_release(ctx, conn);
+
+		pthread_mutex_lock(&bk->mtx);
+		elapsed = ldb_now_ns() - bk->start;
+		bk->progress.pagecount = sqlite3_backup_pagecount(bk->backup);
+		bk->progress.remaining = sqlite3_backup_remaining(bk->backup);
+		bk->progress.elapsed_ns = elapsed;
+		copied = bk->progress.pagecount - bk->progress.remaining;
+		if (elapsed > 0)
+			bk->progress.bytes_per_sec = (uint64_t)copied * bk->page_size *
+			    1000000000ULL / elapsed;
+
+		if (ret == SQLITE_DONE || bk->stop ||
+		    (ret != SQLITE_OK && ret != SQLITE_BUSY && ret != SQLITE_LOCKED)) {
+			pthread_mutex_unlock(&bk->mtx);
+			break;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += bk->sleep_ms / 1000;
+		deadline.tv_nsec += (bk->sleep_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (bk->stop == 0) {
+			if (pthread_cond_timedwait(&bk->cond, &bk->mtx, &deadline) != 0)
+				break;
+		}
+		pthread_mutex_unlock(&bk->mtx);
+	}
+
+	conn = ldb_writer(ctx);
+	sqlite3_backup_finish(bk->backup);
+	ldb_release(ctx, conn);
+	bk->backup = NULL;
+
+	if (ret != SQLITE_DONE && bk->stop == 0)
+		fprintf(stderr, "%s: ret=%d, %s\n", __func__, ret, sqlite3_errmsg(bk->db));
+
+	pthread_mutex_lock(&bk->mtx);
+	bk->progress.done = 1;
+	bk->progress.ret = (ret == SQLITE_DONE) ? 0 : -1;
+	pthread_mutex_unlock(&bk->mtx);
+
+	return (NULL);
+}
+
+/* Copy the database to `filename' from a background thread, `pages' pages
+ * at a time with the writer locked, sleeping `sleep_ms' in between so the
+ * writes carry on. The copy is consistent as of when it completes. One
+ * backup at a time; ldb_backup_wait() or ldb_backup_stop() ends it. Shards
+ * are copied alongside, named as ldb_init_opts() expects them.
+ */
+int
+ldb_backup_start(struct ldb_ctx *ctx, const char *filename, int pages, int sleep_ms)
+{
+	struct ldb_bk	*bk;
+	struct ldb_conn	*conn;
+	sqlite3_stmt	*stmt;
+	char		*name;
+	int		 ret;
+	int		 i;
+
+	if (ctx->bk != NULL || pages < 1 || sleep_ms < 0)
+		return (-1);
+
+	if ((bk = calloc(1, sizeof(*bk))) == NULL) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		return (-1);
+	}
+	bk->ctx = ctx;
+	bk->pages = pages;
+	bk->sleep_ms = sleep_ms;
+	pthread_mutex_init(&bk->mtx, NULL);
+	pthread_cond_init(&bk->cond, NULL);
+
+	ret = sqlite3_open_v2(filename, &bk->db,
+	    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
+	if (ret != SQLITE_OK) {
+		fprintf(stderr, "%s: %s: %s\n", __func__, filename, sqlite3_errmsg(bk->db));
+		goto error;
+	}
+
+	conn = ldb_writer(ctx);
+	if (sqlite3_prepare_v2(conn->db, "PRAGMA page_size", -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			bk->page_size = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+	bk->backup = sqlite3_backup_init(bk->db, "main", conn->db, "main");
+	ldb_release(ctx, conn);
+	if (bk->backup == NULL) {
+		fprintf(stderr, "%s: %s: %s\n", __func__, filename, sqlite3_errmsg(bk->db));
+		goto error;
+	}
+
+	bk->start = ldb_now_ns();
+	if (pthread_create(&bk->thread, NULL, ldb_backup_loop, bk) != 0) {
+		fprintf(stderr, "%s: pthread_create\n", __func__);
+		conn = ldb_writer(ctx);
+		sqlite3_backup_finish(bk->backup);
+		ldb_release(ctx, conn);
+		goto error;
+	}
+	ctx->bk = bk;
+
+	for (i = 0; i < ctx->nshard; i++) {
+		if ((name = sqlite3_mprintf("%s-shard%d", filename, i)) == NULL ||
+		    ldb_backup_start(ctx->shard[i], name, pages, sleep_ms) == -1) {
+			sqlite3_free(name);
+			ldb_backup_stop(ctx);
+			return (-1);
+		}
+		sqlite3_free(name);
+	}
+
+	return (0);
+
+error:
+	sqlite3_close(bk->db);
+	pthread_cond_destroy(&bk->cond);
+	pthread_mutex_destroy(&bk->mtx);
+	free(bk);
+	return (-1);
+}
+
+/* Progress of the running or finished backup, -1 when there is none.
+ * Summed over the shards, done once they all are.
+ */
+int
+ldb_backup_progress(struct ldb_ctx *ctx, struct ldb_backup_progress *progress)
+{
+	struct ldb_backup_progress	 p;
+	struct ldb_bk			*bk = ctx->bk;
+	int				 i;
+
+	if (bk == NULL)
+		return (-1);
+
+	pthread_mutex_lock(&bk->mtx);
+	*progress = bk->progress;
+	pthread_mutex_unlock(&bk->mtx);
+
+	for (i = 0; i < ctx->nshard; i++) {
+		if (ldb_backup_progress(ctx->shard[i], &p) == -1)
+			continue;
+		progress->pagecount += p.pagecount;
+		progress->remaining += p.remaining;
+		progress->bytes_per_sec += p.bytes_per_sec;
+		if (p.elapsed_ns > progress->elapsed_ns)
+			progress->elapsed_ns = p.elapsed_ns;
+		progress->done &= p.done;
+		if (p.done && p.ret == -1)
+			progress->ret = -1;
+	}
+
+	return (0);
+}
+
+/* Wait for the backup to complete. Returns 0 if the copy is whole. */
+int
+ldb_backup_wait(struct ldb_ctx *ctx)
+{
+	struct ldb_bk	*bk = ctx->bk;
+	int		 ret = 0;
+	int		 i;
+
+	if (bk == NULL)
+		return (-1);
+
+	for (i = 0; i < ctx->nshard; i++) {
+		if (ctx->shard[i]->bk != NULL && ldb_backup_wait(ctx->shard[i]) == -1)
+			ret = -1;
+	}
+
+	pthread_join(bk->thread, NULL);
+	ctx->bk = NULL;
+
+	if (bk->progress.ret == -1)
+		ret = -1;
+	sqlite3_close(bk->db);
+	pthread_cond_destroy(&bk->cond);
+	pthread_mutex_destroy(&bk->mtx);
+	free(bk);
+
+	return (ret);
+}
+
+/* Abandon the backup after the current step, the copy is incomplete. */
+void
+ldb_backup_stop(struct ldb_ctx *ctx)
+{
+	struct ldb_bk	*bk = ctx->bk;
+	int		 i;
+
+	for (i = 0; i < ctx->nshard; i++)
+		ldb_backup_stop(ctx->shard[i]);
+	if (bk == NULL)
+		return;
+
+	pthread_mutex_lock(&bk->mtx);
+	bk->stop = 1;
+	pthread_cond_signal(&bk->cond);
+	pthread_mutex_unlock(&bk->mtx);
+
+	ldb_backup_wait(ctx);
+}
+
+/* Create, or drop, the triggers staging the changed rows. */
+static int
+ldb_cdc_triggers(struct ldb_conn *conn, int create)
+{
+	static const struct {
+		const char	*name;
+		int		 op;
+		const char	*row;
+	} ops[] = {
+		{ "INSERT", SQLITE_INSERT, "new" },
+		{ "UPDATE", SQLITE_UPDATE, "new" },
+		{ "DELETE", SQLITE_DELETE, "old" },
+	};
+	size_t	i;
+	size_t	j;
+	int	ret = SQLITE_OK;
+
+	for (i = 0; i < sizeof(ldb_cdc_tables) / sizeof(ldb_cdc_tables[0]); i++) {
+		for (j = 0; j < sizeof(ops) / sizeof(ops[0]); j++) {
+			if (create)
+				ret = ldb_pragma(conn, "CREATE TEMP TRIGGER ldb_cdc_%s_%s "
+				    "AFTER %s ON main.%s BEGIN SELECT ldb_cdc(%d, %d, %s.uid); END;",
+				    ldb_cdc_tables[i], ops[j].name, ops[j].name, ldb_cdc_tables[i],
+				    (int)i, ops[j].op, ops[j].row);
+			else
+				ret = ldb_pragma(conn, "DROP TRIGGER IF EXISTS temp.ldb_cdc_%s_%s;",
+				    ldb_cdc_tables[i], ops[j].name);
+			if (ret != SQLITE_OK)
+				return (ret);
+		}
+	}
+
+	return (SQLITE_OK);
+}
+
+/* Add `r' to the rings the writer of `ctx' publishes to. The first feed
+ * creates the triggers, outside of any transaction that could undo them.
+ */
+static int
+ldb_feed_attach(struct ldb_ctx *ctx, struct ldb_ring *r)
+{
+	struct ldb_conn	*conn;
+	int		 ret;
+
+	conn = ldb_writer(ctx);
+	if (LIST_EMPTY(&ctx->feeds)) {
+		if (sqlite3_get_autocommit(conn->db) == 0) {
+			fprintf(stderr, "%s: in a transaction\n", __func__);
+			ldb_release(ctx, conn);
+			return (-1);
+		}
+		if ((ret = ldb_cdc_triggers(conn, 1)) != SQLITE_OK) {
+			fprintf(stderr, "%s: ret=%d, %s\n", __func__, ret, sqlite3_errmsg(conn->db));
+			ldb_cdc_triggers(conn, 0);
+			ldb_release(ctx, conn);
+			return (-1);
+		}
+	}
+	r->ctx = ctx;
+	LIST_INSERT_HEAD(&ctx->feeds, r, entry);
+	ldb_release(ctx, conn);
+
+	return (0);
+}
+
+static void
+ldb_feed_detach(struct ldb_ring *r)
+{
+	struct ldb_ctx	*ctx = r->ctx;
+	struct ldb_conn	*conn;
+
+	conn = ldb_writer(ctx);
+	LIST_REMOVE(r, entry);
+	if (LIST_EMPTY(&ctx->feeds))
+		ldb_cdc_triggers(conn, 0);
+	ldb_release(ctx, conn);
+	r->ctx = NULL;
+}
+
+/* Subscribe to the changes committed from now on, `size' of them can wait
+ * in the feed, one ring per shard. With `wakeup', ldb_feed_fd() is an
+ * eventfd to poll for them.
+ */
+struct ldb_feed *
+ldb_feed_open(struct ldb_ctx *ctx, int size, int wakeup)
+{
+	struct ldb_feed	*feed;
+	struct ldb_ring	*r;
+	uint64_t	 slots;
+	int		 nring;
+	int		 i;
+
+	if (size < 1)
+		return (NULL);
+	for (slots = 1; slots < (uint64_t)size; slots <<= 1)
+		;
+
+	nring = (ctx->nshard > 0) ? ctx->nshard : 1;
+	if ((feed = calloc(1, sizeof(*feed) + nring * sizeof(*r))) == NULL) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		return (NULL);
+	}
+	feed->fd = -1;
+
+	if (wakeup && (feed->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		fprintf(stderr, "%s: eventfd\n", __func__);
+		goto error;
+	}
+
+	for (i = 0; i < nring; i++) {
+		r = &feed->ring[i];
+		r->feed = feed;
+		r->mask = slots - 1;
+		if ((r->slot = calloc(slots, sizeof(*r->slot))) == NULL) {
+			fprintf(stderr, "%s: calloc\n", __func__);
+			goto error;
+		}
+		if (ldb_feed_attach((ctx->nshard > 0) ? ctx->shard[i] : ctx, r) == -1) {
+			free(r->slot);
+			goto error;
+		}
+		feed->nring++;
+	}
+
+	return (feed);
+error:
+	ldb_feed_close(feed);
+	return (NULL);
+}
+
+void
+ldb_feed_close(struct ldb_feed *feed)
+{
+	int	i;
+
+	if (feed == NULL)
+		return;
+
+	for (i = 0; i < feed->nring; i++) {
+		ldb_feed_detach(&feed->ring[i]);
+		free(feed->ring[i].slot);
+	}
+	if (feed->fd != -1)
+		close(feed->fd);
+	free(feed);
+}
+
+int
+ldb_feed_fd(struct ldb_feed *feed)
+{
+	return (feed->fd);
+}
+
+/* Take up to `max' changes out of the feed, returns how many. Changes of a
+ * shard come in commit order, shards take turns.
+ */
+int
+ldb_feed_read(struct ldb_feed *feed, struct ldb_change *changes, int max)
+{
+	struct ldb_ring	*r;
+	eventfd_t	 v;
+	uint64_t	 head;
+	uint64_t	 tail;
+	int		 more = 0;
+	int		 n = 0;
+	int		 i;
+
+	/* Before the rings, a change published meanwhile wakes up again. */
+	if (feed->fd != -1)
+		eventfd_read(feed->fd, &v);
+
+	for (i = 0; i < feed->nring; i++) {
+		r = &feed->ring[(feed->next + i) % feed->nring];
+		tail = r->tail;
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		while (tail != head && n < max)
+			changes[n++] = r->slot[tail++ & r->mask];
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		if (tail != head)
+			more = 1;
+	}
+	feed->next = (feed->next + 1) % feed->nring;
+
+	if (more && feed->fd != -1)
+		eventfd_write(feed->fd, 1);
+
+	return (n);
+}
+
+/* Changes that didn't fit in the feed since it was opened. When it grows,
+ * the reader missed some and should look at the database again.
+ */
+uint64_t
+ldb_feed_lost(struct ldb_feed *feed)
+{
+	uint64_t	lost = 0;
+	int		i;
+
+	for (i = 0; i < feed->nring; i++)
+		lost += __atomic_load_n(&feed->ring[i].lost, __ATOMIC_RELAXED);
+
+	return (lost);
+}
+
+void
+ldb_fini(struct ldb_ctx *ctx)
+{
+	struct ldb_thread	*t;
+	struct ldb_serial	*sr;
+	struct ldb_dir		*d;
+	int			 i;
+	int			 j;
+
+	if (ctx == NULL)
+		return;
+
+	ldb_async_stop(ctx);
+	ldb_wq_stop(ctx);
+	ldb_presence_stop(ctx);
+	ldb_sweep_stop(ctx);
+	ldb_maint_stop(ctx);
+	ldb_backup_stop(ctx);
+
+	for (i = 0; i < ctx->nshard; i++)
+		ldb_fini(ctx->shard[i]);
+	free(ctx->shard);
+	for (i = 0; i < LDB_DIR_BUCKETS; i++) {
+		while ((d = LIST_FIRST(&ctx->dir[i])) != NULL) {
+			LIST_REMOVE(d, entry);
+			free(d);
+		}
+	}
+	pthread_rwlock_destroy(&ctx->dir_lock);
+
+	/* Threads still alive keep their key value, no destructor will run
+	 * for them once the key is deleted. */
+	pthread_key_delete(ctx->thread_key);
+	while ((t = LIST_FIRST(&ctx->threads)) != NULL) {
+		LIST_REMOVE(t, entry);
+		ldb_thread_free(t);
+	}
+
+	for (i = 0; i < ctx->nreaders; i++)
+		ldb_conn_close(&ctx->readers[i]);
+	free(ctx->readers);
+
+	ldb_conn_close(&ctx->writer);
+
+	for (i = 0; i < LDB_AUTH_SHARDS; i++) {
+		for (j = 0; j < LDB_AUTH_SLOTS; j++)
+			ldb_auth_entry_clear(&ctx->auth[i].entry[j]);
+		pthread_rwlock_destroy(&ctx->auth[i].lock);
+	}
+	ldb_auth_flush(ctx);
+	free(ctx->auth_pending);
+	free(ctx->cdc);
+
+	for (i = 0; i < LDB_SERIAL_BUCKETS; i++) {
+		while ((sr = LIST_FIRST(&ctx->serial[i])) != NULL) {
+			LIST_REMOVE(sr, entry);
+			free(sr);
+		}
+	}
+	pthread_mutex_destroy(&ctx->serial_mtx);
+
+	pthread_cond_destroy(&ctx->readers_cond);
+	pthread_mutex_destroy(&ctx->readers_mtx);
+	pthread_mutex_destroy(&ctx->writer_mtx);
+	free(ctx);
+}
+
+/* Named sets of options, "durable" is what ldb_init() uses. */
+static const struct {
+	const char		*name;
+	struct ldb_options	 opts;
+} ldb_presets[] = {
+	/* Every commit is fsynced. */
+	{ "durable", {
+		.journal_mode = "WAL",
+		.synchronous = "FULL",
+		.busy_timeout = 5000,
+		.nreaders = 4,
+		.serial_block = LDB_SERIAL_BLOCK,
+	} },
+	/* A power loss may roll back the last commits, never corrupts. Large
+	 * page cache and the database mapped in memory. */
+	{ "throughput", {
+		.journal_mode = "WAL",
+		.synchronous = "NORMAL",
+		.cache_size = -65536,
+		.mmap_size = 256LL * 1024 * 1024,
+		.temp_store = "MEMORY",
+		.busy_timeout = 5000,
+		.nreaders = 8,
+		.serial_block = LDB_SERIAL_BLOCK,
+	} },
+	/* Read-only copy of a database, every write fails. */
+	{ "readonly-replica", {
+		.cache_size = -65536,
+		.mmap_size = 1024LL * 1024 * 1024,
+		.temp_store = "MEMORY",
+		.busy_timeout = 5000,
+		.nreaders = 8,
+		.readonly = 1,
+		.serial_block = LDB_SERIAL_BLOCK,
+	} },
+};
+
+/* Fill `opts' with preset `name'. Returns -1 if there is no such preset. */
+int
+ldb_options_preset(struct ldb_options *opts, const char *name)
+{
+	size_t	i;
+
+	for (i = 0; i < sizeof(ldb_presets) / sizeof(ldb_presets[0]); i++) {
+		if (strcmp(ldb_presets[i].name, name) == 0) {
+			*opts = ldb_presets[i].opts;
+			return (0);
+		}
+	}
+
+	fprintf(stderr, "%s: no preset %s\n", __func__, name);
+	return (-1);
+}
+
+/* Open `filename' with the "durable" preset and `nreaders' readers. */
+struct ldb_ctx *
+ldb_init(const char *filename, int nreaders)
+{
+	struct ldb_options	opts;
+
+	ldb_options_preset(&opts, "durable");
+	opts.nreaders = nreaders;
+
+	return (ldb_init_opts(filename, &opts));
+}
+
+/* Give a shard without tables those of the directory, with its indexes and
+ * triggers. auto_vacuum goes first: journal_mode already wrote the file, a
+ * VACUUM of the still empty file applies it.
+ */
+static int
+ldb_shard_schema(struct ldb_ctx *ctx, struct ldb_ctx *shard)
+{
+	struct ldb_conn	*conn = &shard->writer;
+	sqlite3_stmt	*stmt = NULL;
+	int		 ret;
+	int		 line;
+
+	ret = sqlite3_prepare_v2(conn->db, "SELECT count(*) FROM sqlite_schema;", -1, &stmt, NULL);
+	if (ret == SQLITE_OK)
+		ret = sqlite3_step(stmt);
+	if (ret != SQLITE_ROW) {
+		line = __LINE__;
+		goto error;
+	}
+	if (sqlite3_column_int(stmt, 0) > 0) {
+		sqlite3_finalize(stmt);
+		return (0);
+	}
+	sqlite3_finalize(stmt);
+
+	ret = sqlite3_prepare_v2(ctx->writer.db, "PRAGMA auto_vacuum;", -1, &stmt, NULL);
+	if (ret == SQLITE_OK)
+		ret = sqlite3_step(stmt);
+	if (ret != SQLITE_ROW) {
+		line = __LINE__;
+		goto error;
+	}
+	ret = ldb_pragma(conn, "PRAGMA auto_vacuum=%d;", sqlite3_column_int(stmt, 0));
+	if (ret == SQLITE_OK)
+		ret = ldb_pragma(conn, "VACUUM;");
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (ret != SQLITE_OK) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = ldb_run(conn, STMT_BEGIN_IMMEDIATE, NULL);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto error;
+	}
+
+	ret = sqlite3_prepare_v2(ctx->writer.db, "SELECT sql FROM sqlite_schema "
+	    "WHERE sql IS NOT NULL AND name NOT LIKE 'sqlite\\_%' ESCAPE '\\' "
+	    "ORDER BY rowid;", -1, &stmt, NULL);
+	if (ret != SQLITE_OK) {
+		line = __LINE__;
+		goto rollback;
+	}
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		ret = ldb_pragma(conn, "%s;", sqlite3_column_text(stmt, 0));
+		if (ret != SQLITE_OK) {
+			line = __LINE__;
+			goto rollback;
+		}
+	}
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto rollback;
+	}
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	ret = ldb_run(conn, STMT_COMMIT, NULL);
+	if (ret != SQLITE_DONE) {
+		line = __LINE__;
+		goto rollback;
+	}
+
+	return (0);
+rollback:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	sqlite3_finalize(stmt);
+	ldb_run(conn, STMT_ROLLBACK, NULL);
+	return (-1);
+error:
+	fprintf(stderr, "line:%d %s: ret=%d, changes=%d, %s\n", line, __func__, ret, sqlite3_changes(conn->db), sqlite3_errmsg(conn->db));
+	sqlite3_finalize(stmt);
+	return (-1);
+}
+
+/* Open `filename' with one writer connection and a pool of opts->nreaders
+ * read-only connections. A read call checks a reader out for its duration,
+ * or until ldb_read_end() when it pins a snapshot, and waits for one when
+ * they are all in use.
+ */
+struct ldb_ctx *
+ldb_init_opts(const char *filename, const struct ldb_options *opts)
+{
+	struct ldb_ctx		*ctx;
+	struct ldb_options	 shard_opts;
+	pthread_mutexattr_t	 attr;
+	char			*name;
+	int			 nreaders = opts->nreaders;
+	int			 i;
+
+	if (nreaders < 1) {
+		fprintf(stderr, "%s: nreaders must be at least 1\n", __func__);
+		return (NULL);
+	}
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		return (NULL);
+	}
+
+	/* Recursive so that a thread holding the writer, for instance
+	 * during a transaction, can still call the ldb_* functions. */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&ctx->writer_mtx, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	pthread_mutex_init(&ctx->readers_mtx, NULL);
+	pthread_cond_init(&ctx->readers_cond, NULL);
+	for (i = 0; i < LDB_AUTH_SHARDS; i++)
+		pthread_rwlock_init(&ctx->auth[i].lock, NULL);
+	pthread_mutex_init(&ctx->serial_mtx, NULL);
+	ctx->serial_block = (opts->serial_block > 0) ? opts->serial_block : LDB_SERIAL_BLOCK;
+	ctx->busy_deadline = (uint64_t)opts->busy_timeout * 1000000ULL;
+	for (i = 0; i < LDB_SERIAL_BUCKETS; i++)
+		LIST_INIT(&ctx->serial[i]);
+	pthread_key_create(&ctx->thread_key, ldb_thread_exit);
+	LIST_INIT(&ctx->threads);
+	pthread_rwlock_init(&ctx->dir_lock, NULL);
+	for (i = 0; i < LDB_DIR_BUCKETS; i++)
+		LIST_INIT(&ctx->dir[i]);
+	LIST_INIT(&ctx->feeds);
+
+	/* The writer goes first, it sets the journal mode. */
+	if (ldb_conn_open(ctx, &ctx->writer, filename, 0, opts) == -1)
+		goto error;
+
+	if ((ctx->readers = calloc(nreaders, sizeof(*ctx->readers))) == NULL) {
+		fprintf(stderr, "%s: calloc\n", __func__);
+		goto error;
+	}
+	ctx->nreaders = nreaders;
+
+	for (i = 0; i < nreaders; i++) {
+		if (ldb_conn_open(ctx, &ctx->readers[i], filename, 1, opts) == -1)
+			goto error;
+	}
+
+	/* `filename' is then the directory, shard i is `filename'-shard<i>. */
+	if (opts->shards > 1) {
+		if ((ctx->shard = calloc(opts->shards, sizeof(*ctx->shard))) == NULL) {
+			fprintf(stderr, "%s: calloc\n", __func__);
+			goto error;
+		}
+		shard_opts = *opts;
+		shard_opts.shards = 0;
+		for (i = 0; i < opts->shards; i++) {
+			if ((name = sqlite3_mprintf("%s-shard%d", filename, i)) == NULL)
+				goto error;
+			ctx->shard[i] = ldb_init_opts(name, &shard_opts);
+			sqlite3_free(name);
+			if (ctx->shard[i] == NULL)
+				goto error;
+			ctx->nshard++;
+			if (opts->readonly == 0 &&
+			    ldb_shard_schema(ctx, ctx->shard[i]) == -1)
+				goto error;
+		}
+	}
+
+	return (ctx);
+error:
+	ldb_fini(ctx);
+	return (NULL);
 }
@@ -0,0 +1,276 @@
+#ifndef LDB_H
+#define LDB_H
+
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ldb_ctx;
+
+#define LDB_TXN_DEFERRED	0
+#define LDB_TXN_IMMEDIATE	1
+
+/* Caller-owned memory for the *_r functions. They copy their results into
+ * it, the strings stay valid until the arena is reset and cost no malloc.
+ * A call whose results don't fit fails and leaves the arena as it was.
+ */
+struct ldb_arena {
+	char	*buf;
+	size_t	 size;
+	size_t	 used;
+};
+
+void	ldb_arena_init(struct ldb_arena *, void *, size_t);
+void	ldb_arena_reset(struct ldb_arena *);
+
+/* Connection settings. NULL strings and zeroes keep SQLite's defaults. */
+struct ldb_options {
+	const char	*journal_mode;	/* WAL, DELETE... */
+	const char	*synchronous;	/* OFF, NORMAL, FULL, EXTRA */
+	int		 cache_size;	/* pages, or KiB when negative */
+	sqlite3_int64	 mmap_size;	/* bytes */
+	const char	*temp_store;	/* DEFAULT, FILE, MEMORY */
+	int		 page_size;	/* new databases only */
+	int		 busy_timeout;	/* milliseconds a call waits on locks */
+	int		 nreaders;
+	int		 readonly;
+	int		 serial_block;	/* serials reserved at once */
+	int		 shards;	/* database files, see below */
+};
+
+/* With opts->shards > 1, clients and what they own are spread over the
+ * files `filename'-shard0, -shard1... by hash of the email. `filename'
+ * holds the directory of networks and is created from schemas, a shard
+ * without tables gets the schema of the directory. Calls are routed,
+ * transactions span the directory and every shard, read snapshots every
+ * shard, but commit and pin each file on its own.
+ */
+
+int		 ldb_options_preset(struct ldb_options *, const char *);
+struct ldb_ctx	*ldb_init_opts(const char *, const struct ldb_options *);
+struct ldb_ctx	*ldb_init(const char *, int);
+void		 ldb_fini(struct ldb_ctx *);
+
+/* Snapshot of the statistics. hist[b] counts calls that took [2^b, 2^(b+1))
+ * nanoseconds, the last bucket everything above.
+ */
+#define LDB_STATS_BUCKETS	32
+#define LDB_STATS_MAX		64
+
+struct ldb_stats {
+	int	ncall;
+	struct {
+		const char	*name;
+		uint64_t	 calls;
+		uint64_t	 errors;
+		uint64_t	 time_ns;
+		uint64_t	 hist[LDB_STATS_BUCKETS];
+	} call[LDB_STATS_MAX];
+
+	int	nstmt;
+	struct {
+		const char	*name;
+		uint64_t	 fullscan_step;
+		uint64_t	 sort;
+		uint64_t	 autoindex;
+		uint64_t	 vm_step;
+	} stmt[LDB_STATS_MAX];
+
+	/* Lock contention, collected even when the statistics are off:
+	 * calls that found the database locked, time spent waiting for it,
+	 * and calls that gave up at the deadline. */
+	uint64_t	busy;
+	uint64_t	busy_wait_ns;
+	uint64_t	busy_timeouts;
+};
+
+void	ldb_stats_enable(struct ldb_ctx *, int);
+void	ldb_stats_reset(struct ldb_ctx *);
+void	ldb_stats_get(struct ldb_ctx *, struct ldb_stats *);
+
+int	ldb_plan_check(struct ldb_ctx *);
+
+int	ldb_begin(struct ldb_ctx *, int);
+int	ldb_commit(struct ldb_ctx *);
+int	ldb_rollback(struct ldb_ctx *);
+
+/* Read calls of the thread between these see a single database version. */
+int	ldb_read_begin(struct ldb_ctx *);
+int	ldb_read_end(struct ldb_ctx *);
+
+int	ldb_client_create(struct ldb_ctx *, const char *, const char *, const char *);
+int	ldb_client_auth(struct ldb_ctx *, const char *, const char *);
+int	ldb_client_activate(struct ldb_ctx *, const char *, const char *);
+int	ldb_client_apikey_set(struct ldb_ctx *, const char *, const char *, const char *);
+int	ldb_client_apikey_reset(struct ldb_ctx *, const char *, const char *, const char *);
+int	ldb_client_recover(struct ldb_ctx *, const char *, const char *);
+int	ldb_client_password_reset(struct ldb_ctx *, const char *, const char *, const char *);
+
+int	ldb_network_create(struct ldb_ctx *, const char *, const char *, const char *,
+	    const char *, const char *, const char *, const char *,
+	    const char *, const char *);
+int	ldb_network_get(struct ldb_ctx *, const char *, const char *,
+	    const unsigned char **, const unsigned char **, const unsigned char **);
+int	ldb_network_get_r(struct ldb_ctx *, const char *, const char *,
+	    const unsigned char **, const unsigned char **, const unsigned char **,
+	    struct ldb_arena *);
+int	ldb_network_list(struct ldb_ctx *, const char *, const char *,
+	    int (*)(const unsigned char *, const unsigned char *, void *), void *);
+int	ldb_network_embassy_get(struct ldb_ctx *, const char *,
+	    const unsigned char **, const unsigned char **, int *);
+int	ldb_network_embassy_get_r(struct ldb_ctx *, const char *,
+	    const unsigned char **, const unsigned char **, int *, struct ldb_arena *);
+/* The serial of ldb_network_embassy_get() is the highest one issued or
+ * reserved: ldb_network_serial_inc() issues it, ldb_network_serial_next()
+ * hands out serials below it from a reserved block.
+ */
+int	ldb_network_serial_inc(struct ldb_ctx *, const char *);
+int	ldb_network_serial_next(struct ldb_ctx *, const char *, sqlite3_int64 *);
+
+int	ldb_node_create(struct ldb_ctx *, const char *, const char *, const char *,
+	    const char *);
+int	ldb_node_create_batch(struct ldb_ctx *, const char *, int, const char **,
+	    const char **, const char **, int *);
+int	ldb_node_delete(struct ldb_ctx *, const char *, const char *, const char *,
+	    const char *, const unsigned char **, const unsigned char **);
+int	ldb_node_delete_r(struct ldb_ctx *, const char *, const char *, const char *,
+	    const char *, const unsigned char **, const unsigned char **,
+	    struct ldb_arena *);
+int	ldb_node_list(struct ldb_ctx *, const char *, const char *, const char *,
+	    const char *, int, int (*)(const unsigned char *, const unsigned char *,
+	    const unsigned char *, const unsigned char *, int, const unsigned char *,
+	    void *), void *);
+int	ldb_node_status_set(struct ldb_ctx *, int, const char *, const char *,
+	    const char *);
+
+int	ldb_ipv4_allocate(struct ldb_ctx *, const char *, const char *, const char *);
+int	ldb_ipv4_release(struct ldb_ctx *, const char *, const char *);
+int	ldb_ipv4_delete(struct ldb_ctx *, const char *);
+int	ldb_ipv4_available(struct ldb_ctx *, const char *, const unsigned char **);
+int	ldb_ipv4_available_r(struct ldb_ctx *, const char *, const unsigned char **,
+	    struct ldb_arena *);
+int	ldb_ipv4_sweep(struct ldb_ctx *, int, int);
+
+/* Write queue, the callback gets the result of the operation. */
+int	ldb_wq_start(struct ldb_ctx *, int, int);
+void	ldb_wq_stop(struct ldb_ctx *);
+int	ldb_wq_client_create(struct ldb_ctx *, const char *, const char *,
+	    const char *, void (*)(int, void *), void *);
+int	ldb_wq_node_create(struct ldb_ctx *, const char *, const char *,
+	    const char *, const char *, void (*)(int, void *), void *);
+int	ldb_wq_node_status_set(struct ldb_ctx *, int, const char *, const char *,
+	    const char *, void (*)(int, void *), void *);
+int	ldb_wq_ipv4_allocate(struct ldb_ctx *, const char *, const char *,
+	    const char *, void (*)(int, void *), void *);
+int	ldb_wq_ipv4_release(struct ldb_ctx *, const char *, const char *,
+	    void (*)(int, void *), void *);
+
+/* Asynchronous calls, run by worker threads. Once the eventfd is readable,
+ * ldb_async_dispatch() runs the callbacks of the completed calls. The
+ * result holds what the blocking call returned, its strings in the order
+ * of its parameters and the serial of ldb_network_embassy_get().
+ */
+struct ldb_async_result {
+	int			 ret;
+	const unsigned char	*str[3];	/* valid during the callback */
+	int			 serial;
+};
+
+int	ldb_async_start(struct ldb_ctx *, int);
+void	ldb_async_stop(struct ldb_ctx *);
+int	ldb_async_fd(struct ldb_ctx *);
+int	ldb_async_dispatch(struct ldb_ctx *);
+int	ldb_async_client_auth(struct ldb_ctx *, const char *, const char *,
+	    void (*)(const struct ldb_async_result *, void *), void *);
+int	ldb_async_network_get(struct ldb_ctx *, const char *, const char *,
+	    void (*)(const struct ldb_async_result *, void *), void *);
+int	ldb_async_network_embassy_get(struct ldb_ctx *, const char *,
+	    void (*)(const struct ldb_async_result *, void *), void *);
+int	ldb_async_node_create(struct ldb_ctx *, const char *, const char *,
+	    const char *, const char *,
+	    void (*)(const struct ldb_async_result *, void *), void *);
+int	ldb_async_node_delete(struct ldb_ctx *, const char *, const char *,
+	    const char *, const char *,
+	    void (*)(const struct ldb_async_result *, void *), void *);
+int	ldb_async_node_status_set(struct ldb_ctx *, int, const char *, const char *,
+	    const char *, void (*)(const struct ldb_async_result *, void *), void *);
+int	ldb_async_ipv4_allocate(struct ldb_ctx *, const char *, const char *,
+	    const char *, void (*)(const struct ldb_async_result *, void *), void *);
+int	ldb_async_ipv4_release(struct ldb_ctx *, const char *, const char *,
+	    void (*)(const struct ldb_async_result *, void *), void *);
+int	ldb_async_ipv4_available(struct ldb_ctx *, const char *,
+	    void (*)(const struct ldb_async_result *, void *), void *);
+
+/* Presence buffer for ldb_node_status_set(), flushed every tick. */
+int	ldb_presence_start(struct ldb_ctx *, int);
+void	ldb_presence_stop(struct ldb_ctx *);
+int	ldb_presence_flush(struct ldb_ctx *);
+
+/* Lease sweeper, ldb_ipv4_sweep() run from a background thread. */
+int	ldb_sweep_start(struct ldb_ctx *, int, int, int);
+void	ldb_sweep_stop(struct ldb_ctx *);
+
+/* Maintenance: WAL checkpoints, PRAGMA optimize and incremental vacuum, run
+ * in slices while the database is idle. The report tells how long they took.
+ * Vacuum only runs on auto_vacuum=INCREMENTAL files, its runs stay at 0
+ * elsewhere.
+ */
+#define LDB_MAINT_CHECKPOINT	0
+#define LDB_MAINT_OPTIMIZE	1
+#define LDB_MAINT_VACUUM	2
+#define LDB_MAINT_MAX		3
+
+struct ldb_maint_report {
+	struct {
+		const char	*name;
+		uint64_t	 runs;
+		uint64_t	 errors;
+		uint64_t	 pages;		/* checkpointed, or freed */
+		uint64_t	 last_ns;
+		uint64_t	 max_ns;
+		uint64_t	 total_ns;
+	} task[LDB_MAINT_MAX];
+};
+
+int	ldb_maint_start(struct ldb_ctx *, int, int);
+void	ldb_maint_stop(struct ldb_ctx *);
+int	ldb_maint_run(struct ldb_ctx *, int);
+void	ldb_maint_report(struct ldb_ctx *, struct ldb_maint_report *);
+
+/* Online backup, copied in steps from a background thread. */
+struct ldb_backup_progress {
+	int		pagecount;
+	int		remaining;
+	uint64_t	elapsed_ns;
+	uint64_t	bytes_per_sec;
+	int		done;
+	int		ret;		/* once done, 0 if the copy is whole */
+};
+
+int	ldb_backup_start(struct ldb_ctx *, const char *, int, int);
+int	ldb_backup_progress(struct ldb_ctx *, struct ldb_backup_progress *);
+int	ldb_backup_wait(struct ldb_ctx *);
+void	ldb_backup_stop(struct ldb_ctx *);
+
+/* Change feed: the network and node rows inserted, updated or deleted by
+ * committed transactions. A feed is read by a single thread and must be
+ * closed before ldb_fini(). A reader falling behind loses the changes that
+ * don't fit, see ldb_feed_lost().
+ */
+#define LDB_CHANGE_UID	64
+
+struct ldb_change {
+	const char	*table;			/* "network", "node" */
+	int		 op;			/* SQLITE_INSERT, _UPDATE, _DELETE */
+	char		 uid[LDB_CHANGE_UID];	/* truncated if longer */
+};
+
+struct ldb_feed;
+
+struct ldb_feed	*ldb_feed_open(struct ldb_ctx *, int, int);
+void		 ldb_feed_close(struct ldb_feed *);
+int		 ldb_feed_fd(struct ldb_feed *);
+int		 ldb_feed_read(struct ldb_feed *, struct ldb_change *, int);
+uint64_t	 ldb_feed_lost(struct ldb_feed *);
+
+#endif
@@ -0,0 +1,561 @@
+/* Micro-benchmark of the ldb_* entry points.
+ *
+ * Fills a fresh database with clients, networks and nodes, then times each
+ * function on random rows and prints ops/sec and latency percentiles as JSON.
+ *
+ * usage: ldb_bench [-c clients] [-n networks] [-N nodes] [-i iterations]
+ *	[-s schemas] [-f database] [-r seed] [-p tick_ms] [-P preset] [-S shards]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ldb.h"
+
+struct bench {
+	const char	*name;
+	int		 (*fn)(struct ldb_ctx *, int);
+};
+
+static int	 nclients = 1000;
+static int	 nnetworks = 1000;
+static int	 nnodes = 10000;
+static int	 iterations = 10000;
+static int	 presence_ms = 0;
+static int	 shards = 0;
+static uint64_t	 rnd_state = 1;
+
+static uint64_t
+rnd(void)
+{
+	/* xorshift64* */
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+	return (rnd_state * 2685821657736338717ULL);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+client_name(int i, char *email, char *apikey)
+{
+	sprintf(email, "client%d@bench", i);
+	sprintf(apikey, "apikey%d", i);
+}
+
+/* Network i belongs to client i, a client owns a single network. */
+static void
+network_name(int i, char *uid, char *description)
+{
+	sprintf(uid, "network%d", i);
+	sprintf(description, "description%d", i);
+}
+
+/* Node i lives in network i % nnetworks. */
+static void
+node_name(int i, char *uid, char *description)
+{
+	sprintf(uid, "node%d", i);
+	sprintf(description, "node_description%d", i);
+}
+
+static int
+network_list_cb(const unsigned char *uid, const unsigned char *description, void *arg)
+{
+	(void)uid;
+	(void)description;
+	(*(int *)arg)++;
+	return (0);
+}
+
+static int
+bench_client_auth(struct ldb_ctx *ctx, int it)
+{
+	char	email[64], apikey[64];
+
+	(void)it;
+	client_name(rnd() % nclients, email, apikey);
+	return ldb_client_auth(ctx, email, apikey);
+}
+
+static int
+bench_network_list(struct ldb_ctx *ctx, int it)
+{
+	char	email[64], apikey[64];
+	int	n = 0;
+
+	(void)it;
+	client_name(rnd() % nclients, email, apikey);
+	return ldb_network_list(ctx, email, apikey, network_list_cb, &n);
+}
+
+static int
+node_list_cb(const unsigned char *uid, const unsigned char *description,
+	const unsigned char *provkey, const unsigned char *ipv4, int status,
+	const unsigned char *date, void *arg)
+{
+	(void)uid;
+	(void)description;
+	(void)provkey;
+	(void)ipv4;
+	(void)status;
+	(void)date;
+	(void)arg;
+	return (0);
+}
+
+/* First page of a network's nodes, as a UI would show it. */
+static int
+bench_node_list(struct ldb_ctx *ctx, int it)
+{
+	char	email[64], apikey[64];
+	char	uid[64], description[64];
+	int	i;
+
+	(void)it;
+	i = rnd() % nnetworks;
+	client_name(i, email, apikey);
+	network_name(i, uid, description);
+	return (ldb_node_list(ctx, email, apikey, uid, NULL, 100, node_list_cb, NULL) == -1 ? -1 : 0);
+}
+
+static int
+bench_network_get(struct ldb_ctx *ctx, int it)
+{
+	const unsigned char	*uid, *subnet, *netmask;
+	char			 email[64], apikey[64];
+	char			 network_uid[64], description[64];
+	int			 i;
+
+	(void)it;
+	i = rnd() % nnetworks;
+	client_name(i, email, apikey);
+	network_name(i, network_uid, description);
+	return ldb_network_get(ctx, email, description, &uid, &subnet, &netmask);
+}
+
+static int
+bench_network_embassy_get(struct ldb_ctx *ctx, int it)
+{
+	const unsigned char	*certificate, *privatekey;
+	char			 uid[64], description[64];
+	int			 serial;
+
+	(void)it;
+	network_name(rnd() % nnetworks, uid, description);
+	return ldb_network_embassy_get(ctx, uid, &certificate, &privatekey, &serial);
+}
+
+static int
+bench_network_serial_next(struct ldb_ctx *ctx, int it)
+{
+	char		uid[64], description[64];
+	sqlite3_int64	serial;
+
+	(void)it;
+	network_name(rnd() % nnetworks, uid, description);
+	return ldb_network_serial_next(ctx, uid, &serial);
+}
+
+static int
+bench_node_status_set(struct ldb_ctx *ctx, int it)
+{
+	char	uid[64], description[64];
+	char	network_uid[64], network_description[64];
+	int	i;
+
+	i = rnd() % nnodes;
+	node_name(i, uid, description);
+	network_name(i % nnetworks, network_uid, network_description);
+	return ldb_node_status_set(ctx, it & 1, "10.10.10.10", uid, network_uid);
+}
+
+static int
+bench_ipv4_available(struct ldb_ctx *ctx, int it)
+{
+	const unsigned char	*address;
+	char			 uid[64], description[64];
+
+	(void)it;
+	network_name(rnd() % nnetworks, uid, description);
+	return ldb_ipv4_available(ctx, uid, &address);
+}
+
+/* Every node got an address when populated: release that of node `it',
+ * ipv4_allocate gives one back in the same order. */
+static int
+bench_ipv4_release(struct ldb_ctx *ctx, int it)
+{
+	char	uid[64], description[64];
+	char	node_uid[64], node_description[64];
+
+	node_name(it % nnodes, node_uid, node_description);
+	network_name((it % nnodes) % nnetworks, uid, description);
+	return ldb_ipv4_release(ctx, uid, node_uid);
+}
+
+static int
+bench_ipv4_allocate(struct ldb_ctx *ctx, int it)
+{
+	char	uid[64], description[64];
+	char	node_uid[64], node_description[64];
+
+	node_name(it % nnodes, node_uid, node_description);
+	network_name((it % nnodes) % nnetworks, uid, description);
+	return ldb_ipv4_allocate(ctx, uid, node_uid, NULL);
+}
+
+/* Extra nodes, removed again by ldb_node_delete. */
+static int
+bench_node_create(struct ldb_ctx *ctx, int it)
+{
+	char	uid[64], description[64];
+	char	network_uid[64], network_description[64];
+
+	node_name(nnodes + it, uid, description);
+	network_name(it % nnetworks, network_uid, network_description);
+	return ldb_node_create(ctx, network_uid, uid, "provkey", description);
+}
+
+static int
+bench_node_delete(struct ldb_ctx *ctx, int it)
+{
+	const unsigned char	*node_uid, *network_uid;
+	char			 uid[64], description[64];
+	char			 net_uid[64], net_description[64];
+	char			 email[64], apikey[64];
+
+	node_name(nnodes + it, uid, description);
+	network_name(it % nnetworks, net_uid, net_description);
+	client_name(it % nnetworks, email, apikey);
+	return ldb_node_delete(ctx, description, net_description, email, apikey,
+	    &node_uid, &network_uid);
+}
+
+static const struct bench benches[] = {
+	{ "ldb_client_auth",		bench_client_auth },
+	{ "ldb_network_list",		bench_network_list },
+	{ "ldb_network_get",		bench_network_get },
+	{ "ldb_network_embassy_get",	bench_network_embassy_get },
+	{ "ldb_network_serial_next",	bench_network_serial_next },
+	{ "ldb_node_list",		bench_node_list },
+	{ "ldb_ipv4_available",		bench_ipv4_available },
+	{ "ldb_ipv4_release",		bench_ipv4_release },
+	{ "ldb_ipv4_allocate",		bench_ipv4_allocate },
+	{ "ldb_node_status_set",	bench_node_status_set },
+	{ "ldb_node_create",		bench_node_create },
+	{ "ldb_node_delete",		bench_node_delete },
+};
+
+static int
+schema_load(const char *database, const char *schemas)
+{
+	sqlite3	*db;
+	FILE	*fp;
+	char	*sql;
+	long	 size;
+	int	 ret;
+
+	if ((fp = fopen(schemas, "r")) == NULL) {
+		perror(schemas);
+		return (-1);
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	if ((sql = calloc(1, size + 1)) == NULL || fread(sql, 1, size, fp) != (size_t)size) {
+		fclose(fp);
+		free(sql);
+		return (-1);
+	}
+	fclose(fp);
+
+	if (sqlite3_open(database, &db) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", database, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		free(sql);
+		return (-1);
+	}
+	ret = sqlite3_exec(db, sql, NULL, NULL, NULL);
+	if (ret != SQLITE_OK)
+		fprintf(stderr, "%s: %s\n", schemas, sqlite3_errmsg(db));
+	sqlite3_close(db);
+	free(sql);
+
+	return (ret == SQLITE_OK ? 0 : -1);
+}
+
+/* Commit every `chunk' rows, one transaction for a million rows would grow
+ * the WAL for nothing. */
+static int
+populate(struct ldb_ctx *ctx)
+{
+	const char	**uids, **provkeys, **descriptions;
+	char		 email[64], apikey[64];
+	char		 uid[64], description[64];
+	char		 network_uid[64], network_description[64];
+	char		*names;
+	int		 chunk = 10000;
+	int		 i, j, n, net;
+
+	for (i = 0; i < nclients; i++) {
+		if (i % chunk == 0 && ldb_begin(ctx, LDB_TXN_IMMEDIATE) == -1)
+			return (-1);
+		client_name(i, email, apikey);
+		if (ldb_client_create(ctx, email, "password", apikey) == -1 ||
+		    ldb_client_activate(ctx, email, apikey) == -1)
+			return (-1);
+		if ((i % chunk == chunk - 1 || i == nclients - 1) && ldb_commit(ctx) == -1)
+			return (-1);
+	}
+
+	for (i = 0; i < nnetworks; i++) {
+		if (i % chunk == 0 && ldb_begin(ctx, LDB_TXN_IMMEDIATE) == -1)
+			return (-1);
+		client_name(i, email, apikey);
+		network_name(i, uid, description);
+		if (ldb_network_create(ctx, email, uid, description, "10.0.0.0", "255.255.0.0",
+		    "embassy_certificate", "embassy_privatekey",
+		    "passport_certificate", "passport_privatekey") == -1)
+			return (-1);
+		if ((i % chunk == chunk - 1 || i == nnetworks - 1) && ldb_commit(ctx) == -1)
+			return (-1);
+	}
+
+	/* Nodes of a network are i, i + nnetworks, i + 2 * nnetworks... */
+	n = (nnodes + nnetworks - 1) / nnetworks;
+	uids = calloc(n, sizeof(*uids));
+	provkeys = calloc(n, sizeof(*provkeys));
+	descriptions = calloc(n, sizeof(*descriptions));
+	names = calloc(n, 128);
+	if (uids == NULL || provkeys == NULL || descriptions == NULL || names == NULL)
+		return (-1);
+
+	for (net = 0; net < nnetworks && net < nnodes; net++) {
+		if (net % (chunk / n + 1) == 0 && ldb_begin(ctx, LDB_TXN_IMMEDIATE) == -1)
+			return (-1);
+		for (j = 0, i = net; i < nnodes; i += nnetworks, j++) {
+			node_name(i, names + j * 128, names + j * 128 + 64);
+			uids[j] = names + j * 128;
+			descriptions[j] = names + j * 128 + 64;
+			provkeys[j] = "provkey";
+		}
+		network_name(net, network_uid, network_description);
+		if (ldb_node_create_batch(ctx, network_uid, j, uids, provkeys, descriptions, NULL) != 0)
+			return (-1);
+		for (i = 0; i < j; i++) {
+			if (ldb_ipv4_allocate(ctx, network_uid, uids[i], NULL) == -1)
+				return (-1);
+		}
+		if ((net % (chunk / n + 1) == chunk / n || net == nnetworks - 1 || net == nnodes - 1) &&
+		    ldb_commit(ctx) == -1)
+			return (-1);
+	}
+
+	free(uids);
+	free(provkeys);
+	free(descriptions);
+	free(names);
+
+	return (0);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t	x = *(const uint64_t *)a;
+	uint64_t	y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static double
+percentile_us(uint64_t *lat, int n, double p)
+{
+	int	i;
+
+	i = (int)(p * (n - 1) + 0.5);
+	return (lat[i] / 1000.0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct ldb_ctx	*ctx;
+	struct ldb_stats st;
+	const char	*database = "bench.db";
+	const char	*schemas = "schemas";
+	const char	*preset = "durable";
+	struct ldb_options opts;
+	uint64_t	*lat;
+	uint64_t	 start, total, t;
+	char		 file[1024];
+	char		 path[sizeof(file) + 4];
+	size_t		 b;
+	int		 errors;
+	int		 ch;
+	int		 i;
+
+	while ((ch = getopt(argc, argv, "c:n:N:i:s:f:r:p:P:S:")) != -1) {
+		switch (ch) {
+		case 'c':
+			nclients = atoi(optarg);
+			break;
+		case 'n':
+			nnetworks = atoi(optarg);
+			break;
+		case 'N':
+			nnodes = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			schemas = optarg;
+			break;
+		case 'f':
+			database = optarg;
+			break;
+		case 'r':
+			rnd_state = strtoull(optarg, NULL, 10) | 1;
+			break;
+		case 'p':
+			presence_ms = atoi(optarg);
+			break;
+		case 'P':
+			preset = optarg;
+			break;
+		case 'S':
+			shards = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c clients] [-n networks] [-N nodes] "
+			    "[-i iterations] [-s schemas] [-f database] [-r seed] [-p tick_ms] "
+			    "[-P preset] [-S shards]\n", argv[0]);
+			return (1);
+		}
+	}
+	if (nclients < 1 || nnetworks < 1 || nnodes < 1 || iterations < 1) {
+		fprintf(stderr, "counts must be positive\n");
+		return (1);
+	}
+	if (nnetworks > nclients) {
+		fprintf(stderr, "a client owns a single network, networks > clients\n");
+		return (1);
+	}
+
+	/* The directory, then the shards. */
+	for (i = -1; i < shards; i++) {
+		if (i == -1)
+			snprintf(file, sizeof(file), "%s", database);
+		else
+			snprintf(file, sizeof(file), "%s-shard%d", database, i);
+		unlink(file);
+		snprintf(path, sizeof(path), "%s-wal", file);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s-shm", file);
+		unlink(path);
+
+		/* ldb_init_opts() gives the shards the directory's schema. */
+		if (i == -1 && schema_load(file, schemas) == -1)
+			return (1);
+	}
+	if (ldb_options_preset(&opts, preset) == -1)
+		return (1);
+	opts.nreaders = 1;
+	opts.shards = shards;
+	if ((ctx = ldb_init_opts(database, &opts)) == NULL)
+		return (1);
+
+	start = now_ns();
+	if (populate(ctx) == -1) {
+		fprintf(stderr, "populate failed\n");
+		ldb_fini(ctx);
+		return (1);
+	}
+	total = now_ns() - start;
+
+	/* Heartbeats through the presence buffer, written every tick. */
+	if (presence_ms > 0 && ldb_presence_start(ctx, presence_ms) == -1) {
+		ldb_fini(ctx);
+		return (1);
+	}
+
+	printf("{\n");
+	printf("  \"sqlite\": \"%s\",\n", sqlite3_libversion());
+	printf("  \"clients\": %d,\n", nclients);
+	printf("  \"preset\": \"%s\",\n", preset);
+	printf("  \"presence_ms\": %d,\n", presence_ms);
+	printf("  \"shards\": %d,\n", shards);
+	printf("  \"networks\": %d,\n", nnetworks);
+	printf("  \"nodes\": %d,\n", nnodes);
+	printf("  \"iterations\": %d,\n", iterations);
+	printf("  \"populate_sec\": %.3f,\n", total / 1e9);
+	printf("  \"results\": [\n");
+
+	if ((lat = calloc(iterations, sizeof(*lat))) == NULL)
+		return (1);
+
+	ldb_stats_enable(ctx, 1);
+
+	for (b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+		errors = 0;
+		start = now_ns();
+		for (i = 0; i < iterations; i++) {
+			t = now_ns();
+			if (benches[b].fn(ctx, i) == -1)
+				errors++;
+			lat[i] = now_ns() - t;
+		}
+		total = now_ns() - start;
+
+		qsort(lat, iterations, sizeof(*lat), cmp_u64);
+		printf("    {\"name\": \"%s\", \"ops\": %d, \"errors\": %d, "
+		    "\"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+		    "\"p999_us\": %.2f}%s\n",
+		    benches[b].name, iterations, errors,
+		    iterations / (total / 1e9),
+		    percentile_us(lat, iterations, 0.50),
+		    percentile_us(lat, iterations, 0.99),
+		    percentile_us(lat, iterations, 0.999),
+		    (b + 1 < sizeof(benches) / sizeof(benches[0])) ? "," : "");
+		fflush(stdout);
+	}
+	printf("  ],\n");
+
+	/* What the statements did over all the runs above. */
+	ldb_stats_get(ctx, &st);
+	printf("  \"statements\": [\n");
+	for (i = 0; i < st.nstmt; i++) {
+		printf("    {\"name\": \"%s\", \"fullscan_step\": %llu, \"sort\": %llu, "
+		    "\"autoindex\": %llu, \"vm_step\": %llu}%s\n",
+		    st.stmt[i].name,
+		    (unsigned long long)st.stmt[i].fullscan_step,
+		    (unsigned long long)st.stmt[i].sort,
+		    (unsigned long long)st.stmt[i].autoindex,
+		    (unsigned long long)st.stmt[i].vm_step,
+		    (i + 1 < st.nstmt) ? "," : "");
+	}
+	printf("  ],\n");
+	printf("  \"busy\": {\"events\": %llu, \"wait_ms\": %.3f, \"timeouts\": %llu}\n",
+	    (unsigned long long)st.busy, st.busy_wait_ns / 1e6,
+	    (unsigned long long)st.busy_timeouts);
+	printf("}\n");
+
+	free(lat);
+	ldb_fini(ctx);
+
+	return (0);
+}
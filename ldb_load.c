@@ -0,0 +1,703 @@
+/* Multi-process load generator.
+ *
+ * Fills a fresh database, then for each concurrency level forks that many
+ * processes, each running `threads' threads that call a mix of
+ * ldb_client_auth, ldb_network_list, ldb_node_status_set and a release and
+ * allocation of an address, for `seconds'. Every process has its own
+ * connections, so they contend on the file locks as separate controller and
+ * API processes do. Prints throughput, latency percentiles and lock
+ * contention per level as JSON.
+ *
+ * usage: ldb_load [-c clients] [-n networks] [-N nodes] [-l levels]
+ *	[-t threads] [-d seconds] [-m auth,list,heartbeat,ipv4]
+ *	[-s schemas] [-f database] [-r seed] [-P preset]
+ */
+
+#include <sys/wait.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ldb.h"
+
+/* Latencies in log-linear buckets: 16 per power of two, about 6% wide. */
+#define HIST_SUB	16
+#define HIST_BUCKETS	1024
+
+#define MAX_LEVELS	16
+
+enum {
+	OP_AUTH,
+	OP_LIST,
+	OP_HEARTBEAT,
+	OP_IPV4,
+	OP_MAX
+};
+
+static const char *op_names[OP_MAX] = {
+	[OP_AUTH]	= "client_auth",
+	[OP_LIST]	= "network_list",
+	[OP_HEARTBEAT]	= "node_status_set",
+	[OP_IPV4]	= "ipv4_release_allocate",
+};
+
+/* What a process measured, sent to the parent through a pipe. */
+struct result {
+	uint64_t	ops[OP_MAX];
+	uint64_t	errors[OP_MAX];
+	uint64_t	hist[OP_MAX][HIST_BUCKETS];
+	uint64_t	busy;
+	uint64_t	busy_wait_ns;
+	uint64_t	busy_timeouts;
+};
+
+struct worker {
+	pthread_t	 thread;
+	struct ldb_ctx	*ctx;
+	int		 id;		/* among every worker of the level */
+	int		 nworkers;
+	uint64_t	 rnd_state;
+	uint64_t	 deadline;
+	struct result	*res;
+};
+
+static int		 nclients = 1000;
+static int		 nnetworks = 1000;
+static int		 nnodes = 10000;
+static int		 nthreads = 1;
+static int		 seconds = 5;
+static int		 mix[OP_MAX] = { 40, 20, 30, 10 };
+static uint64_t		 seed = 1;
+static pthread_mutex_t	 res_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+rnd(uint64_t *state)
+{
+	/* xorshift64* */
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (*state * 2685821657736338717ULL);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static int
+hist_bucket(uint64_t v)
+{
+	int	e;
+
+	if (v < HIST_SUB)
+		return ((int)v);
+	e = 63 - __builtin_clzll(v);
+	return ((e - 3) * HIST_SUB + (int)((v >> (e - 4)) & (HIST_SUB - 1)));
+}
+
+/* Middle of bucket `b', in ns. */
+static double
+hist_value(int b)
+{
+	int	e;
+	int	sub;
+
+	if (b < HIST_SUB)
+		return (b);
+	e = b / HIST_SUB + 3;
+	sub = b % HIST_SUB;
+	return ((double)((uint64_t)(HIST_SUB + sub) << (e - 4)) +
+	    (double)(1ULL << (e - 4)) / 2);
+}
+
+static double
+hist_percentile_us(const uint64_t *hist, uint64_t n, double p)
+{
+	uint64_t	rank;
+	uint64_t	seen = 0;
+	int		b;
+
+	if (n == 0)
+		return (0);
+	rank = (uint64_t)(p * (n - 1) + 0.5);
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen > rank)
+			break;
+	}
+	return (hist_value(b) / 1000.0);
+}
+
+static void
+client_name(int i, char *email, char *apikey)
+{
+	sprintf(email, "client%d@load", i);
+	sprintf(apikey, "apikey%d", i);
+}
+
+/* Network i belongs to client i, a client owns a single network. */
+static void
+network_name(int i, char *uid, char *description)
+{
+	sprintf(uid, "network%d", i);
+	sprintf(description, "description%d", i);
+}
+
+/* Node i lives in network i % nnetworks. */
+static void
+node_name(int i, char *uid, char *description)
+{
+	sprintf(uid, "node%d", i);
+	sprintf(description, "node_description%d", i);
+}
+
+static int
+network_list_cb(const unsigned char *uid, const unsigned char *description, void *arg)
+{
+	(void)uid;
+	(void)description;
+	(void)arg;
+	return (0);
+}
+
+static int
+op_auth(struct worker *w)
+{
+	char	email[64], apikey[64];
+
+	client_name(rnd(&w->rnd_state) % nclients, email, apikey);
+	return ldb_client_auth(w->ctx, email, apikey);
+}
+
+static int
+op_list(struct worker *w)
+{
+	char	email[64], apikey[64];
+
+	client_name(rnd(&w->rnd_state) % nclients, email, apikey);
+	return ldb_network_list(w->ctx, email, apikey, network_list_cb, NULL);
+}
+
+static int
+op_heartbeat(struct worker *w)
+{
+	char		uid[64], description[64];
+	char		network_uid[64], network_description[64];
+	uint64_t	r;
+	int		i;
+
+	r = rnd(&w->rnd_state);
+	i = r % nnodes;
+	node_name(i, uid, description);
+	network_name(i % nnetworks, network_uid, network_description);
+	return ldb_node_status_set(w->ctx, (r >> 32) & 1, "10.10.10.10", uid, network_uid);
+}
+
+/* Only the nodes i % nworkers == id, two workers never race on an address. */
+static int
+op_ipv4(struct worker *w)
+{
+	char	uid[64], description[64];
+	char	node_uid[64], node_description[64];
+	int	i;
+
+	i = rnd(&w->rnd_state) % nnodes;
+	i -= i % w->nworkers;
+	i += w->id;
+	if (i >= nnodes)
+		i = w->id;
+	if (i >= nnodes)
+		return (0);
+
+	node_name(i, node_uid, node_description);
+	network_name(i % nnetworks, uid, description);
+	if (ldb_ipv4_release(w->ctx, uid, node_uid) == -1)
+		return (-1);
+	return ldb_ipv4_allocate(w->ctx, uid, node_uid, NULL);
+}
+
+static int (*ops[OP_MAX])(struct worker *) = {
+	[OP_AUTH]	= op_auth,
+	[OP_LIST]	= op_list,
+	[OP_HEARTBEAT]	= op_heartbeat,
+	[OP_IPV4]	= op_ipv4,
+};
+
+static void *
+worker_loop(void *arg)
+{
+	struct worker	*w = arg;
+	struct result	*res;
+	uint64_t	 t;
+	int		 total = 0;
+	int		 pick;
+	int		 op;
+	int		 ret;
+
+	if ((res = calloc(1, sizeof(*res))) == NULL)
+		return (NULL);
+
+	for (op = 0; op < OP_MAX; op++)
+		total += mix[op];
+
+	while ((t = now_ns()) < w->deadline) {
+		pick = rnd(&w->rnd_state) % total;
+		for (op = 0; pick >= mix[op]; op++)
+			pick -= mix[op];
+
+		ret = ops[op](w);
+		t = now_ns() - t;
+
+		res->ops[op]++;
+		if (ret == -1)
+			res->errors[op]++;
+		res->hist[op][hist_bucket(t)]++;
+	}
+
+	pthread_mutex_lock(&res_mtx);
+	for (op = 0; op < OP_MAX; op++) {
+		w->res->ops[op] += res->ops[op];
+		w->res->errors[op] += res->errors[op];
+		for (t = 0; t < HIST_BUCKETS; t++)
+			w->res->hist[op][t] += res->hist[op][t];
+	}
+	pthread_mutex_unlock(&res_mtx);
+	free(res);
+
+	return (NULL);
+}
+
+/* A process of the level: open the database, say we're ready, wait for the
+ * parent to close `go', run the threads and write the results to `out'.
+ */
+static int
+child(const char *database, const char *preset, int proc, int nprocs, int go, int out)
+{
+	struct ldb_options	 opts;
+	struct ldb_stats	*st;
+	struct ldb_ctx		*ctx;
+	struct worker		*w;
+	struct result		*res;
+	uint64_t		 deadline;
+	char			 c = 0;
+	int			 i;
+
+	if (ldb_options_preset(&opts, preset) == -1)
+		return (1);
+	opts.nreaders = nthreads;
+	if ((ctx = ldb_init_opts(database, &opts)) == NULL)
+		return (1);
+
+	w = calloc(nthreads, sizeof(*w));
+	res = calloc(1, sizeof(*res));
+	st = calloc(1, sizeof(*st));
+	if (w == NULL || res == NULL || st == NULL)
+		return (1);
+
+	if (write(out, &c, 1) != 1)
+		return (1);
+	while (read(go, &c, 1) > 0)
+		;
+	deadline = now_ns() + (uint64_t)seconds * 1000000000ULL;
+
+	for (i = 0; i < nthreads; i++) {
+		w[i].ctx = ctx;
+		w[i].id = proc * nthreads + i;
+		w[i].nworkers = nprocs * nthreads;
+		w[i].rnd_state = (seed + 0x9e3779b97f4a7c15ULL * (w[i].id + 1)) | 1;
+		w[i].deadline = deadline;
+		w[i].res = res;
+		if (pthread_create(&w[i].thread, NULL, worker_loop, &w[i]) != 0)
+			return (1);
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(w[i].thread, NULL);
+
+	ldb_stats_get(ctx, st);
+	res->busy = st->busy;
+	res->busy_wait_ns = st->busy_wait_ns;
+	res->busy_timeouts = st->busy_timeouts;
+	ldb_fini(ctx);
+
+	if (write(out, res, sizeof(*res)) != (ssize_t)sizeof(*res))
+		return (1);
+
+	return (0);
+}
+
+/* Read exactly `len' bytes, the results come in several pipe buffers. */
+static int
+read_full(int fd, void *buf, size_t len)
+{
+	char	*p = buf;
+	ssize_t	 n;
+
+	while (len > 0) {
+		if ((n = read(fd, p, len)) <= 0)
+			return (-1);
+		p += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+/* Run `nprocs' processes together, their results summed in `sum'. */
+static int
+level(const char *database, const char *preset, int nprocs, struct result *sum,
+	uint64_t *elapsed)
+{
+	struct result	*res;
+	pid_t		 pid[64];
+	int		 out[64];
+	int		 go[2];
+	int		 fds[2];
+	int		 ret = 0;
+	int		 status;
+	uint64_t	 start;
+	char		 c;
+	int		 i;
+	int		 op;
+	int		 b;
+
+	if ((res = calloc(1, sizeof(*res))) == NULL)
+		return (-1);
+	memset(sum, 0, sizeof(*sum));
+
+	if (pipe(go) == -1) {
+		perror("pipe");
+		free(res);
+		return (-1);
+	}
+
+	for (i = 0; i < nprocs; i++) {
+		if (pipe(fds) == -1) {
+			perror("pipe");
+			return (-1);
+		}
+		fflush(stdout);
+		if ((pid[i] = fork()) == -1) {
+			perror("fork");
+			return (-1);
+		}
+		if (pid[i] == 0) {
+			close(go[1]);
+			close(fds[0]);
+			_exit(child(database, preset, i, nprocs, go[0], fds[1]));
+		}
+		close(fds[1]);
+		out[i] = fds[0];
+	}
+	close(go[0]);
+
+	/* Everybody opened the database, go. */
+	for (i = 0; i < nprocs; i++) {
+		if (read(out[i], &c, 1) != 1)
+			ret = -1;
+	}
+	start = now_ns();
+	close(go[1]);
+
+	for (i = 0; i < nprocs; i++) {
+		if (read_full(out[i], res, sizeof(*res)) == -1) {
+			ret = -1;
+		} else {
+			for (op = 0; op < OP_MAX; op++) {
+				sum->ops[op] += res->ops[op];
+				sum->errors[op] += res->errors[op];
+				for (b = 0; b < HIST_BUCKETS; b++)
+					sum->hist[op][b] += res->hist[op][b];
+			}
+			sum->busy += res->busy;
+			sum->busy_wait_ns += res->busy_wait_ns;
+			sum->busy_timeouts += res->busy_timeouts;
+		}
+		close(out[i]);
+	}
+	*elapsed = now_ns() - start;
+
+	for (i = 0; i < nprocs; i++) {
+		if (waitpid(pid[i], &status, 0) == -1 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0)
+			ret = -1;
+	}
+
+	free(res);
+	return (ret);
+}
+
+static int
+schema_load(const char *database, const char *schemas)
+{
+	sqlite3	*db;
+	FILE	*fp;
+	char	*sql;
+	long	 size;
+	int	 ret;
+
+	if ((fp = fopen(schemas, "r")) == NULL) {
+		perror(schemas);
+		return (-1);
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	if ((sql = calloc(1, size + 1)) == NULL || fread(sql, 1, size, fp) != (size_t)size) {
+		fclose(fp);
+		free(sql);
+		return (-1);
+	}
+	fclose(fp);
+
+	if (sqlite3_open(database, &db) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", database, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		free(sql);
+		return (-1);
+	}
+	ret = sqlite3_exec(db, sql, NULL, NULL, NULL);
+	if (ret != SQLITE_OK)
+		fprintf(stderr, "%s: %s\n", schemas, sqlite3_errmsg(db));
+	sqlite3_close(db);
+	free(sql);
+
+	return (ret == SQLITE_OK ? 0 : -1);
+}
+
+/* Clients, their networks, and nodes holding an address each. */
+static int
+populate(struct ldb_ctx *ctx)
+{
+	char	email[64], apikey[64];
+	char	uid[64], description[64];
+	char	network_uid[64], network_description[64];
+	int	chunk = 10000;
+	int	i;
+
+	if (ldb_begin(ctx, LDB_TXN_IMMEDIATE) == -1)
+		return (-1);
+	for (i = 0; i < nclients; i++) {
+		client_name(i, email, apikey);
+		if (ldb_client_create(ctx, email, "password", apikey) == -1 ||
+		    ldb_client_activate(ctx, email, apikey) == -1)
+			return (-1);
+	}
+	for (i = 0; i < nnetworks; i++) {
+		client_name(i, email, apikey);
+		network_name(i, uid, description);
+		if (ldb_network_create(ctx, email, uid, description, "10.0.0.0", "255.255.0.0",
+		    "embassy_certificate", "embassy_privatekey",
+		    "passport_certificate", "passport_privatekey") == -1)
+			return (-1);
+	}
+	if (ldb_commit(ctx) == -1)
+		return (-1);
+
+	for (i = 0; i < nnodes; i++) {
+		if (i % chunk == 0 && ldb_begin(ctx, LDB_TXN_IMMEDIATE) == -1)
+			return (-1);
+		node_name(i, uid, description);
+		network_name(i % nnetworks, network_uid, network_description);
+		if (ldb_node_create(ctx, network_uid, uid, "provkey", description) == -1 ||
+		    ldb_ipv4_allocate(ctx, network_uid, uid, NULL) == -1)
+			return (-1);
+		if ((i % chunk == chunk - 1 || i == nnodes - 1) && ldb_commit(ctx) == -1)
+			return (-1);
+	}
+
+	return (0);
+}
+
+static int
+parse_list(const char *str, int *v, int max)
+{
+	char	*end;
+	int	 n = 0;
+
+	while (*str != '\0' && n < max) {
+		v[n++] = strtol(str, &end, 10);
+		if (end == str || (*end != ',' && *end != '\0'))
+			return (-1);
+		str = (*end == ',') ? end + 1 : end;
+	}
+
+	return (n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct ldb_options	 opts;
+	struct ldb_ctx		*ctx;
+	struct result		*sum, *all;
+	const char		*database = "load.db";
+	const char		*schemas = "schemas";
+	const char		*preset = "durable";
+	uint64_t		 elapsed;
+	uint64_t		 ops, errors;
+	char			 path[1024];
+	int			 levels[MAX_LEVELS] = { 1, 2, 4, 8, 16 };
+	int			 nlevels = 5;
+	int			 ch;
+	int			 l, op, b;
+
+	while ((ch = getopt(argc, argv, "c:n:N:l:t:d:m:s:f:r:P:")) != -1) {
+		switch (ch) {
+		case 'c':
+			nclients = atoi(optarg);
+			break;
+		case 'n':
+			nnetworks = atoi(optarg);
+			break;
+		case 'N':
+			nnodes = atoi(optarg);
+			break;
+		case 'l':
+			nlevels = parse_list(optarg, levels, MAX_LEVELS);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 'm':
+			if (parse_list(optarg, mix, OP_MAX) != OP_MAX)
+				nlevels = -1;
+			break;
+		case 's':
+			schemas = optarg;
+			break;
+		case 'f':
+			database = optarg;
+			break;
+		case 'r':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'P':
+			preset = optarg;
+			break;
+		default:
+			nlevels = -1;
+			break;
+		}
+	}
+	for (l = 0; l < nlevels; l++) {
+		if (levels[l] < 1 || levels[l] > 64)
+			nlevels = -1;
+	}
+	for (op = 0, b = 0; op < OP_MAX; op++) {
+		if (mix[op] < 0)
+			nlevels = -1;
+		b += mix[op];
+	}
+	if (nlevels < 1 || b == 0 || nclients < 1 || nnetworks < 1 || nnodes < 1 ||
+	    nthreads < 1 || seconds < 1) {
+		fprintf(stderr, "usage: %s [-c clients] [-n networks] [-N nodes] "
+		    "[-l levels] [-t threads] [-d seconds] [-m auth,list,heartbeat,ipv4] "
+		    "[-s schemas] [-f database] [-r seed] [-P preset]\n", argv[0]);
+		return (1);
+	}
+	if (nnetworks > nclients) {
+		fprintf(stderr, "a client owns a single network, networks > clients\n");
+		return (1);
+	}
+
+	unlink(database);
+	snprintf(path, sizeof(path), "%s-wal", database);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s-shm", database);
+	unlink(path);
+	if (schema_load(database, schemas) == -1)
+		return (1);
+
+	if (ldb_options_preset(&opts, preset) == -1)
+		return (1);
+	opts.nreaders = 1;
+	if ((ctx = ldb_init_opts(database, &opts)) == NULL)
+		return (1);
+	if (populate(ctx) == -1) {
+		fprintf(stderr, "populate failed\n");
+		ldb_fini(ctx);
+		return (1);
+	}
+	/* Nothing open across fork(). */
+	ldb_fini(ctx);
+
+	if ((sum = calloc(1, sizeof(*sum))) == NULL || (all = calloc(1, sizeof(*all))) == NULL)
+		return (1);
+
+	printf("{\n");
+	printf("  \"sqlite\": \"%s\",\n", sqlite3_libversion());
+	printf("  \"preset\": \"%s\",\n", preset);
+	printf("  \"clients\": %d,\n", nclients);
+	printf("  \"networks\": %d,\n", nnetworks);
+	printf("  \"nodes\": %d,\n", nnodes);
+	printf("  \"threads\": %d,\n", nthreads);
+	printf("  \"seconds\": %d,\n", seconds);
+	printf("  \"mix\": {");
+	for (op = 0; op < OP_MAX; op++)
+		printf("\"%s\": %d%s", op_names[op], mix[op], (op + 1 < OP_MAX) ? ", " : "");
+	printf("},\n");
+	printf("  \"levels\": [\n");
+
+	for (l = 0; l < nlevels; l++) {
+		if (level(database, preset, levels[l], sum, &elapsed) == -1) {
+			fprintf(stderr, "level %d failed\n", levels[l]);
+			return (1);
+		}
+
+		memset(all->hist[0], 0, sizeof(all->hist[0]));
+		ops = errors = 0;
+		for (op = 0; op < OP_MAX; op++) {
+			ops += sum->ops[op];
+			errors += sum->errors[op];
+			for (b = 0; b < HIST_BUCKETS; b++)
+				all->hist[0][b] += sum->hist[op][b];
+		}
+
+		printf("    {\"processes\": %d, \"workers\": %d, \"ops\": %llu, "
+		    "\"errors\": %llu, \"ops_per_sec\": %.1f, "
+		    "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f,\n",
+		    levels[l], levels[l] * nthreads, (unsigned long long)ops,
+		    (unsigned long long)errors, ops / (elapsed / 1e9),
+		    hist_percentile_us(all->hist[0], ops, 0.50),
+		    hist_percentile_us(all->hist[0], ops, 0.99),
+		    hist_percentile_us(all->hist[0], ops, 0.999));
+		printf("     \"busy\": {\"events\": %llu, \"wait_ms\": %.3f, \"timeouts\": %llu},\n",
+		    (unsigned long long)sum->busy, sum->busy_wait_ns / 1e6,
+		    (unsigned long long)sum->busy_timeouts);
+		printf("     \"calls\": [\n");
+		for (op = 0; op < OP_MAX; op++) {
+			printf("       {\"name\": \"%s\", \"ops\": %llu, \"errors\": %llu, "
+			    "\"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+			    "\"p999_us\": %.2f}%s\n",
+			    op_names[op], (unsigned long long)sum->ops[op],
+			    (unsigned long long)sum->errors[op],
+			    sum->ops[op] / (elapsed / 1e9),
+			    hist_percentile_us(sum->hist[op], sum->ops[op], 0.50),
+			    hist_percentile_us(sum->hist[op], sum->ops[op], 0.99),
+			    hist_percentile_us(sum->hist[op], sum->ops[op], 0.999),
+			    (op + 1 < OP_MAX) ? "," : "");
+		}
+		printf("     ]}%s\n", (l + 1 < nlevels) ? "," : "");
+		fflush(stdout);
+	}
+	printf("  ]\n");
+	printf("}\n");
+
+	free(sum);
+	free(all);
+
+	return (0);
+}
@@ -0,0 +1,391 @@
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ldb.h"
+
+int
+network_list_cb(const unsigned char *uid, const unsigned char *description, void *store)
+{
+	(void)store;
+	printf("network_list_cb> uid:%s, description:%s\n", uid, description);
+
+	return (0);
+}
+
+int
+node_list_cb(const unsigned char *uid, const unsigned char *description,
+	const unsigned char *provkey, const unsigned char *ipv4, int status,
+	const unsigned char *date, void *store)
+{
+	(void)provkey;
+	(void)date;
+	printf("node_list_cb> uid:%s, description:%s, ipv4:%s, status:%d\n",
+	    uid, description, ipv4 ? (const char *)ipv4 : "-", status);
+	snprintf(store, 64, "%s", uid);
+
+	return (0);
+}
+
+/* First column of the first row of `sql' in `file', -1 on error. */
+int
+db_count(const char *file, const char *sql)
+{
+	sqlite3		*db;
+	sqlite3_stmt	*stmt;
+	int		 n = -1;
+
+	if (sqlite3_open(file, &db) != SQLITE_OK)
+		return (-1);
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			n = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+	sqlite3_close(db);
+
+	return (n);
+}
+
+void
+wq_cb(int ret, void *arg)
+{
+	printf("wq_cb> %s: %d\n", (const char *)arg, ret);
+}
+
+void
+async_cb(const struct ldb_async_result *res, void *arg)
+{
+	printf("async %s: %d %s %s %s\n", (char *)arg, res->ret,
+	    res->str[0] ? (char *)res->str[0] : "-",
+	    res->str[1] ? (char *)res->str[1] : "-",
+	    res->str[2] ? (char *)res->str[2] : "-");
+}
+
+int
+main(void)
+{
+	struct ldb_ctx	*ctx;
+	int		 ret;
+
+	printf("%s\n", sqlite3_libversion());
+
+	ctx = ldb_init("test.db", 4);
+	printf("ldb_init: %p\n", ctx);
+	if (ctx == NULL)
+		return 1;
+
+	/* A statement that scans or sorts fails the run. */
+	ret = ldb_plan_check(ctx);
+	printf("plan_check: %d\n", ret);
+	if (ret != 0) {
+		ldb_fini(ctx);
+		return 1;
+	}
+
+	/* Shards: a directory COMMIT that fails takes the network back out
+	 * of its shard. A reader of the directory, in rollback journal mode,
+	 * keeps that COMMIT from getting its lock. */
+	const char *shard_files[] = { "test-dir.db", "test-dir.db-journal",
+	    "test-dir.db-shard0", "test-dir.db-shard0-journal",
+	    "test-dir.db-shard1", "test-dir.db-shard1-journal" };
+	for (size_t k = 0; k < sizeof(shard_files) / sizeof(shard_files[0]); k++)
+		unlink(shard_files[k]);
+	sqlite3 *lock_db;
+	sqlite3_open("test.db", &lock_db);
+	sqlite3_exec(lock_db, "VACUUM INTO 'test-dir.db';", NULL, NULL, NULL);
+	sqlite3_close(lock_db);
+
+	struct ldb_options shard_opts;
+	ldb_options_preset(&shard_opts, "durable");
+	shard_opts.journal_mode = "DELETE";
+	shard_opts.busy_timeout = 50;
+	shard_opts.nreaders = 1;
+	shard_opts.shards = 2;
+	struct ldb_ctx *shard_ctx = ldb_init_opts("test-dir.db", &shard_opts);
+	if (shard_ctx == NULL)
+		return 1;
+	ldb_client_create(shard_ctx, "my_shard_email", "my_password", "my_apikey");
+
+	sqlite3_open("test-dir.db", &lock_db);
+	sqlite3_exec(lock_db, "BEGIN; SELECT count(*) FROM network_shard;", NULL, NULL, NULL);
+	ret = ldb_network_create(shard_ctx, "my_shard_email", "my_shard_uid", "my_description",
+	    "10.0.0.0", "255.255.255.0", "my_embassy_certificate", "my_embassy_privatekey",
+	    "my_passport_certificate", "my_passport_privatekey");
+	sqlite3_exec(lock_db, "COMMIT;", NULL, NULL, NULL);
+	sqlite3_close(lock_db);
+	int orphans = db_count("test-dir.db-shard0", "SELECT count(*) FROM network;") +
+	    db_count("test-dir.db-shard1", "SELECT count(*) FROM network;");
+	printf("shard network_create, directory locked: ret=%d, shard networks=%d\n", ret, orphans);
+	if (ret != -1 || orphans != 0)
+		return 1;
+	ret = ldb_network_create(shard_ctx, "my_shard_email", "my_shard_uid", "my_description",
+	    "10.0.0.0", "255.255.255.0", "my_embassy_certificate", "my_embassy_privatekey",
+	    "my_passport_certificate", "my_passport_privatekey");
+	printf("shard network_create: %d\n", ret);
+	if (ret != 0)
+		return 1;
+	ldb_fini(shard_ctx);
+
+	ldb_client_create(ctx, "my_email", "my_password", "my_apikey");
+	ldb_client_activate(ctx, "my_email", "my_apikey");
+	ldb_client_apikey_set(ctx, "my_email", "my_password", "set_apikey");
+	printf("client_auth: %d\n", ldb_client_auth(ctx, "my_email", "set_apikey"));
+	ldb_client_apikey_reset(ctx, "my_email", "set_apikey", "reset_apikey");
+	printf("client_auth: %d\n", ldb_client_auth(ctx, "my_email", "set_apikey"));
+	ldb_client_recover(ctx, "my_email", "my_recover_key");
+	ldb_client_password_reset(ctx, "my_email", "new_password", "my_recover_key");
+
+	ldb_network_create(ctx, "my_email", "my_uid", "my_description", "192.168.0.0", "255.255.255.0",
+	    "my_embassy_certificate", "my_embassy_privatekey",
+	    "my_passport_certificate", "my_passport_privatekey");
+
+	const unsigned char *uid = NULL;
+	const unsigned char *subnet = NULL;
+	const unsigned char *netmask = NULL;
+
+	ldb_network_get(ctx, "my_email", "my_description", &uid, &subnet, &netmask);
+	printf("uid: %s, subnet: %s, netmask: %s\n", uid, subnet, netmask);
+
+	struct ldb_arena arena;
+	char arena_buf[256];
+	const unsigned char *ipv4 = NULL;
+
+	ldb_arena_init(&arena, arena_buf, sizeof(arena_buf));
+	ldb_network_get_r(ctx, "my_email", "my_description", &uid, &subnet, &netmask, &arena);
+	ldb_ipv4_available_r(ctx, "my_uid", &ipv4, &arena);
+	printf("arena: uid: %s, subnet: %s, netmask: %s, ipv4: %s, used: %zu\n",
+	    uid, subnet, netmask, ipv4, arena.used);
+	ldb_arena_reset(&arena);
+
+	ldb_network_list(ctx, "my_email", "reset_apikey", network_list_cb, NULL);
+	printf("client_auth: %d\n", ldb_client_auth(ctx, "MY_email", "reset_apikey"));
+
+	const unsigned char *embassy_passport = NULL;
+	const unsigned char *embassy_privatekey = NULL;
+	int embassy_serial;
+
+	ldb_network_embassy_get(ctx, "my_uid", &embassy_passport, &embassy_privatekey, &embassy_serial);
+	printf("passport: %s, privatekey:%s, serial:%d\n", embassy_passport, embassy_privatekey, embassy_serial);
+
+
+	/* 100 bytes of DER, not a multiple of a 48 bytes line. */
+	const char *pem = "-----BEGIN CERTIFICATE-----\n"
+	    "AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8gISIjJCUmJygpKissLS4v\n"
+	    "MDEyMzQ1Njc4OTo7PD0+P0BBQkNERUZHSElKS0xNTk9QUVJTVFVWV1hZWltcXV5f\n"
+	    "YGFiYw==\n"
+	    "-----END CERTIFICATE-----\n";
+
+	ldb_client_create(ctx, "my_pem_email", "my_password", "my_pem_apikey");
+	ldb_network_create(ctx, "my_pem_email", "my_pem_uid", "my_pem_description", "10.0.0.0", "255.255.255.0",
+	    pem, "my_embassy_privatekey", "my_passport_certificate", "my_passport_privatekey");
+	ldb_network_embassy_get(ctx, "my_pem_uid", &embassy_passport, &embassy_privatekey, &embassy_serial);
+	if (embassy_passport == NULL || strcmp((const char *)embassy_passport, pem) != 0) {
+		printf("pem round trip: %s\n", embassy_passport);
+		return 1;
+	}
+	printf("pem round trip: ok\n");
+
+	/* serial_inc and serial_next, interleaved, never issue a serial twice. */
+	sqlite3_int64 serial = 0;
+	sqlite3_int64 issued[6];
+	int i, j;
+	for (i = 0; i < 6; i++) {
+		if (i % 3 == 0) {
+			ldb_network_serial_inc(ctx, "my_uid");
+			ldb_network_embassy_get(ctx, "my_uid", &embassy_passport, &embassy_privatekey, &embassy_serial);
+			serial = embassy_serial;
+		} else
+			ldb_network_serial_next(ctx, "my_uid", &serial);
+		printf("serial: %lld\n", serial);
+		for (j = 0; j < i; j++) {
+			if (issued[j] == serial) {
+				printf("serial %lld issued twice\n", serial);
+				return 1;
+			}
+		}
+		issued[i] = serial;
+	}
+
+	ldb_network_embassy_get(ctx, "my_uid", &embassy_passport, &embassy_privatekey, &embassy_serial);
+	printf("passport: %s, privatekey:%s, serial:%d\n", embassy_passport, embassy_privatekey, embassy_serial);
+
+	ldb_read_begin(ctx);
+	ldb_network_serial_inc(ctx, "my_uid");
+	ldb_network_embassy_get(ctx, "my_uid", &embassy_passport, &embassy_privatekey, &embassy_serial);
+	printf("snapshot serial:%d\n", embassy_serial);
+	ldb_read_end(ctx);
+	ldb_network_embassy_get(ctx, "my_uid", &embassy_passport, &embassy_privatekey, &embassy_serial);
+	printf("serial:%d\n", embassy_serial);
+
+	ldb_node_create(ctx, "my_uid", "my_node_uid", "my_provkey", "my_node_description");
+	ldb_node_create(ctx, "my_uid", "my_node_uid2", "my_provkey", "my_node_description2");
+
+	const unsigned char *node_uid = NULL;
+	const unsigned char *network_uid = NULL;
+	ldb_node_delete(ctx, "my_node_description", "my_description", "my_email", "reset_apikey", &node_uid, &network_uid);
+	printf("deleted node: node_uid:%s, network_uid:%s\n", node_uid, network_uid);
+
+
+	ldb_node_status_set(ctx, 1, "127.0.0.1", "my_node_uid2", "my_uid");
+
+	const char *batch_uid[] = { "my_node_uid4", "my_node_uid5", "my_node_uid2" };
+	const char *batch_provkey[] = { "my_provkey", "my_provkey", "my_provkey" };
+	const char *batch_description[] = { "my_node_description4", "my_node_description5", "my_node_description2" };
+	int batch_failed[3];
+
+	ldb_begin(ctx, LDB_TXN_IMMEDIATE);
+	ret = ldb_node_create_batch(ctx, "my_uid", 3, batch_uid, batch_provkey, batch_description, batch_failed);
+	printf("node_create_batch: %d failed, [%d %d %d]\n", ret, batch_failed[0], batch_failed[1], batch_failed[2]);
+	ldb_commit(ctx);
+
+	/* A row that rolls the whole transaction back fails the batch, the
+	 * rows after it aren't committed on their own. */
+	sqlite3 *db;
+	sqlite3_open("test.db", &db);
+	sqlite3_exec(db, "CREATE TRIGGER my_batch_abort BEFORE INSERT ON node "
+	    "WHEN NEW.description = 'my_batch_abort' "
+	    "BEGIN SELECT RAISE(ROLLBACK, 'my_batch_abort'); END;", NULL, NULL, NULL);
+	const char *abort_uid[] = { "my_batch_uid1", "my_batch_uid2", "my_batch_uid3" };
+	const char *abort_description[] = { "my_batch_description1", "my_batch_abort", "my_batch_description3" };
+	ret = ldb_node_create_batch(ctx, "my_uid", 3, abort_uid, batch_provkey, abort_description, NULL);
+	sqlite3_exec(db, "DROP TRIGGER my_batch_abort;", NULL, NULL, NULL);
+	sqlite3_stmt *stmt;
+	sqlite3_prepare_v2(db, "SELECT count(*) FROM node WHERE uid LIKE 'my_batch_uid%';", -1, &stmt, NULL);
+	sqlite3_step(stmt);
+	printf("node_create_batch abort: ret=%d, rows=%d\n", ret, sqlite3_column_int(stmt, 0));
+	if (ret != -1 || sqlite3_column_int(stmt, 0) != 0)
+		return 1;
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	ldb_wq_start(ctx, 128, 5);
+	ldb_wq_node_create(ctx, "my_uid", "my_node_uid3", "my_provkey", "my_node_description3", wq_cb, "node_create");
+	ldb_wq_node_create(ctx, "my_uid", "my_node_uid3", "my_provkey", "my_node_description3", wq_cb, "node_create dup");
+	ldb_wq_node_status_set(ctx, 1, "127.0.0.2", "my_node_uid3", "my_uid", wq_cb, "node_status_set");
+	ldb_wq_stop(ctx);
+
+	const unsigned char *ipv4_available = NULL;
+
+	ldb_ipv4_allocate(ctx, "my_uid", "my_node_uid2", "192.168.0.2");
+	ldb_ipv4_allocate(ctx, "my_uid", "my_node_uid3", NULL);
+	ldb_ipv4_allocate(ctx, "my_uid", "my_node_uid4", NULL);
+	ldb_ipv4_available(ctx, "my_uid", &ipv4_available);
+	printf("next ipv4 available: %s\n", ipv4_available);
+
+	char after[64] = "";
+	do {
+		ret = ldb_node_list(ctx, "my_email", "reset_apikey", "my_uid", after, 2, node_list_cb, after);
+		printf("node_list: %d\n", ret);
+	} while (ret == 2);
+	/* A rejected apikey isn't an empty last page. */
+	after[0] = '\0';
+	ret = ldb_node_list(ctx, "my_email", "bad_apikey", "my_uid", after, 2, node_list_cb, after);
+	printf("node_list, bad apikey: %d\n", ret);
+	if (ret != -1)
+		return 1;
+
+	ldb_presence_start(ctx, 1000);
+	ldb_node_status_set(ctx, 0, "127.0.0.1", "my_node_uid2", "my_uid");
+	ldb_node_status_set(ctx, 0, "127.0.0.1", "my_node_uid2", "my_uid");
+	ldb_node_status_set(ctx, 1, "127.0.0.3", "my_node_uid5", "my_uid");
+	after[0] = '\0';
+	ldb_node_list(ctx, "my_email", "reset_apikey", "my_uid", after, 10, node_list_cb, after);
+	printf("presence_flush: %d\n", ldb_presence_flush(ctx));
+	/* Flushed nodes left the buffer, the repeat is buffered and written again. */
+	ldb_node_status_set(ctx, 1, "127.0.0.3", "my_node_uid5", "my_uid");
+	ret = ldb_presence_flush(ctx);
+	printf("presence_flush: %d\n", ret);
+	if (ret != 1)
+		return 1;
+	ldb_presence_stop(ctx);
+
+	ldb_ipv4_release(ctx, "my_uid", "my_node_uid2");
+	ldb_ipv4_release(ctx, "my_uid", "my_node_uid3");
+	ldb_ipv4_available(ctx, "my_uid", &ipv4_available);
+	printf("next ipv4 available: %s\n", ipv4_available);
+
+	struct ldb_backup_progress progress;
+	unlink("test-backup.db");
+	ldb_backup_start(ctx, "test-backup.db", 1, 0);
+	ldb_node_status_set(ctx, 0, "127.0.0.4", "my_node_uid5", "my_uid");
+	do {
+		usleep(1000);
+		ldb_backup_progress(ctx, &progress);
+	} while (progress.done == 0);
+	printf("backup: %d pages, ret=%d\n", progress.pagecount, progress.ret);
+	ldb_backup_wait(ctx);
+
+	struct ldb_feed *feed;
+	struct ldb_change changes[8];
+	feed = ldb_feed_open(ctx, 8, 1);
+	ldb_node_create(ctx, "my_uid", "my_node_uid6", "my_provkey", "my_node_description6");
+	ldb_node_status_set(ctx, 1, "127.0.0.6", "my_node_uid6", "my_uid");
+	ldb_begin(ctx, LDB_TXN_IMMEDIATE);
+	ldb_node_create(ctx, "my_uid", "my_node_uid7", "my_provkey", "my_node_description7");
+	ldb_rollback(ctx);
+	ldb_node_delete(ctx, "my_node_description6", "my_description", "my_email", "reset_apikey", &node_uid, &network_uid);
+	struct pollfd pfd = { ldb_feed_fd(feed), POLLIN, 0 };
+	printf("feed poll: %d\n", poll(&pfd, 1, 0));
+	ret = ldb_feed_read(feed, changes, 8);
+	for (i = 0; i < ret; i++)
+		printf("feed: %s %d %s\n", changes[i].table, changes[i].op, changes[i].uid);
+	printf("feed poll: %d, lost: %llu\n", poll(&pfd, 1, 0),
+	    (unsigned long long)ldb_feed_lost(feed));
+	ldb_feed_close(feed);
+
+	ldb_node_create(ctx, "my_uid", "my_node_uid8", "my_provkey", "my_node_description8");
+	ldb_ipv4_allocate(ctx, "my_uid", "my_node_uid8", NULL);
+	ldb_node_delete(ctx, "my_node_description8", "my_description", "my_email", "reset_apikey", &node_uid, &network_uid);
+	printf("ipv4_sweep: %d\n", ldb_ipv4_sweep(ctx, 3600, 5));
+	ldb_ipv4_available(ctx, "my_uid", &ipv4_available);
+	printf("next ipv4 available: %s\n", ipv4_available);
+
+	int pending = 3;
+	ldb_async_start(ctx, 1);
+	ldb_async_network_get(ctx, "my_email", "my_description", async_cb, "network_get");
+	ldb_async_node_create(ctx, "my_uid", "my_node_uid9", "my_provkey", "my_node_description9", async_cb, "node_create");
+	ldb_async_ipv4_available(ctx, "my_uid", async_cb, "ipv4_available");
+	pfd.fd = ldb_async_fd(ctx);
+	while (pending > 0 && poll(&pfd, 1, 1000) == 1)
+		pending -= ldb_async_dispatch(ctx);
+	ldb_async_stop(ctx);
+
+	struct ldb_maint_report report;
+	sqlite3 *free_db;
+	sqlite3_open("test.db", &free_db);
+	sqlite3_exec(free_db, "CREATE TABLE my_free AS WITH RECURSIVE r(i) AS "
+	    "(SELECT 1 UNION ALL SELECT i + 1 FROM r WHERE i < 200) "
+	    "SELECT randomblob(1000) FROM r; DROP TABLE my_free;", NULL, NULL, NULL);
+	sqlite3_close(free_db);
+	int freelist = db_count("test.db", "PRAGMA freelist_count;");
+	printf("maint_run: %d\n", ldb_maint_run(ctx, 100));
+	ldb_maint_report(ctx, &report);
+	for (i = 0; i < LDB_MAINT_MAX; i++)
+		printf("maint: %s runs:%llu errors:%llu pages:%llu\n", report.task[i].name,
+		    (unsigned long long)report.task[i].runs,
+		    (unsigned long long)report.task[i].errors,
+		    (unsigned long long)report.task[i].pages);
+	/* Vacuum reports the pages the freelist lost. */
+	freelist -= db_count("test.db", "PRAGMA freelist_count;");
+	if (report.task[LDB_MAINT_VACUUM].pages != (uint64_t)freelist)
+		return 1;
+
+	/* Nor does it run without auto_vacuum=INCREMENTAL. */
+	unlink("test-novacuum.db");
+	struct ldb_ctx *novacuum_ctx = ldb_init("test-novacuum.db", 1);
+	if (novacuum_ctx == NULL)
+		return 1;
+	ldb_maint_run(novacuum_ctx, 100);
+	ldb_maint_report(novacuum_ctx, &report);
+	printf("maint: no auto_vacuum, vacuum runs:%llu\n",
+	    (unsigned long long)report.task[LDB_MAINT_VACUUM].runs);
+	if (report.task[LDB_MAINT_VACUUM].runs != 0)
+		return 1;
+	ldb_fini(novacuum_ctx);
+
+	ldb_fini(ctx);
+
+	return 0;
+}